@@ -0,0 +1,72 @@
+# Distributed under the OSI-approved BSD 3-Clause License.  See https://cmake.org/licensing for details.
+
+#[=======================================================================[.rst:
+FindLibURing
+------------
+
+Find liburing include directory and library.
+
+Imported Targets
+^^^^^^^^^^^^^^^^
+
+An :ref:`imported target <Imported targets>` named
+``LibURing::LibURing`` is provided if liburing has been found.
+
+Result Variables
+^^^^^^^^^^^^^^^^
+
+This module defines the following variables:
+
+``LibURing_FOUND``
+  True if liburing was found, false otherwise.
+``LibURing_INCLUDE_DIRS``
+  Include directories needed to include liburing headers.
+``LibURing_LIBRARIES``
+  Libraries needed to link to liburing.
+
+Cache Variables
+^^^^^^^^^^^^^^^
+
+This module uses the following cache variables:
+
+``LibURing_LIBRARY``
+  The location of the liburing library file.
+``LibURing_INCLUDE_DIR``
+  The location of the liburing include directory containing ``liburing.h``.
+
+The cache variables should not be used by project code.
+They may be set by end users to point at liburing components.
+#]=======================================================================]
+
+#-----------------------------------------------------------------------------
+find_library(LibURing_LIBRARY
+  NAMES uring
+  )
+mark_as_advanced(LibURing_LIBRARY)
+
+find_path(LibURing_INCLUDE_DIR
+  NAMES liburing.h
+  )
+mark_as_advanced(LibURing_INCLUDE_DIR)
+
+#-----------------------------------------------------------------------------
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibURing
+  FOUND_VAR LibURing_FOUND
+  REQUIRED_VARS LibURing_LIBRARY LibURing_INCLUDE_DIR
+  )
+set(LIBURING_FOUND ${LibURing_FOUND})
+
+#-----------------------------------------------------------------------------
+# Provide documented result variables and targets.
+if(LibURing_FOUND)
+  set(LibURing_INCLUDE_DIRS ${LibURing_INCLUDE_DIR})
+  set(LibURing_LIBRARIES ${LibURing_LIBRARY})
+  if(NOT TARGET LibURing::LibURing)
+    add_library(LibURing::LibURing UNKNOWN IMPORTED)
+    set_target_properties(LibURing::LibURing PROPERTIES
+      IMPORTED_LOCATION "${LibURing_LIBRARY}"
+      INTERFACE_INCLUDE_DIRECTORIES "${LibURing_INCLUDE_DIRS}"
+      )
+  endif()
+endif()
@@ -0,0 +1,55 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_BENCH_H
+#define __THEME_BENCH_H
+
+#include "../io/buffer_pool.h"
+#include "../io/client_base.h"
+#include "../io/socket.h"
+
+#include <benchmark/benchmark.h>
+#include <tuple>
+
+namespace theme
+{
+    /** Exposes the client_base I/O machinery to the benchmarks. */
+    class bench_client : public client_base
+    {
+    public:
+        bench_client(socket& sock, buffer_pool& buffers)
+            : client_base(sock, buffers)
+        { }
+
+        using client_base::handle_read;
+        using client_base::handle_write;
+        using client_base::rx_bytes;
+    };
+
+    /** A connected pair of non-blocking unix sockets. */
+    std::tuple<bool, socket, socket> make_socket_pair();
+
+    /** Reads and throws away everything waiting on \param fd. */
+    void drain_fd(int fd);
+
+    /**
+     * Registers the client I/O benchmarks.
+     * These are generated from the protocol definitions, so they can't be registered statically.
+     */
+    void register_protocol_benchmarks();
+};
+
+#endif
@@ -0,0 +1,153 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "../core/config_parser.h"
+#include "../io/rc4.h"
+#include "../io/uru_crypt.h"
+
+#include <cstring>
+#include <openssl/evp.h>
+#include <random>
+#include <vector>
+
+using namespace ST::literals;
+
+// =================================================================================
+
+static const theme::config_item s_config[] = {
+    THEME_CONFIG_STR("gate", "crypt_k", "", "Private Key")
+    THEME_CONFIG_STR("gate", "crypt_n", "", "Public Key")
+    THEME_CONFIG_INT("gate", "crypt_g", 4, "Base Value")
+};
+
+static const uint8_t s_key[] = { 0x10, 0x32, 0x54, 0x76, 0x98, 0xBA, 0xDC };
+
+// =================================================================================
+
+/** The server half of the Diffie-Hellman exchange, which runs once per connection. */
+static void BM_make_server_key(benchmark::State& state)
+{
+    // No keys are configured, so a fresh pair is generated.
+    theme::crypto crypt;
+    theme::config_parser config(s_config);
+    theme::crypto_keys keys;
+    std::tie(std::ignore, keys) = crypt.load_keys(config, "gate"_st);
+
+    std::mt19937 rng;
+    uint8_t y_data[64];
+    for (uint8_t& i : y_data)
+        i = (uint8_t)rng();
+
+    uint8_t srv_seed[7];
+    uint8_t key[7];
+    for (auto _ : state) {
+        if (!crypt.make_server_key(keys, sizeof(y_data), y_data, sizeof(key), srv_seed, key)) {
+            state.SkipWithError("make_server_key() failed");
+            break;
+        }
+        benchmark::DoNotOptimize(key);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_make_server_key)->Unit(benchmark::kMicrosecond);
+
+/** Switching a client's stream over to RC4 once the handshake completes. */
+static void BM_set_crypt_key(benchmark::State& state)
+{
+    auto [result, local, remote] = theme::make_socket_pair();
+    if (!result) {
+        state.SkipWithError("socketpair() failed");
+        return;
+    }
+
+    theme::buffer_pool buffers;
+    theme::bench_client client(local, buffers);
+    for (auto _ : state)
+        client.set_crypt_key(sizeof(s_key), s_key);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_set_crypt_key);
+
+/** Raw RC4 throughput, without any of the message handling around it. */
+static void BM_rc4(benchmark::State& state)
+{
+    theme::rc4_stream stream;
+    stream.set_key(s_key, sizeof(s_key));
+
+    std::vector<uint8_t> in(state.range(0), 0x5A);
+    std::vector<uint8_t> out(state.range(0));
+    for (auto _ : state) {
+        stream.apply(out.data(), in.data(), in.size());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_rc4)->RangeMultiplier(4)->Range(1, 64 * 1024);
+
+/** OpenSSL's RC4, which clients used before, for comparison. */
+static void BM_rc4_evp(benchmark::State& state)
+{
+    std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> ctx{ EVP_CIPHER_CTX_new(),
+                                                                   EVP_CIPHER_CTX_free };
+    EVP_EncryptInit_ex(ctx.get(), EVP_rc4(), nullptr, nullptr, nullptr);
+    EVP_CIPHER_CTX_set_key_length(ctx.get(), sizeof(s_key));
+    EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr, s_key, nullptr);
+
+    std::vector<uint8_t> in(state.range(0), 0x5A);
+    std::vector<uint8_t> out(state.range(0));
+    for (auto _ : state) {
+        int outsz;
+        EVP_EncryptUpdate(ctx.get(), out.data(), &outsz, in.data(), (int)in.size());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_rc4_evp)->RangeMultiplier(4)->Range(1, 64 * 1024);
+
+/**
+ * Draining and refilling the keystream of range(0) clients, one at a time when range(1) is 0,
+ * or interleaved through an rc4_batch like the reactors do when it is 1.
+ */
+static void BM_rc4_refill(benchmark::State& state)
+{
+    std::vector<std::unique_ptr<theme::rc4_stream>> streams(state.range(0));
+    for (size_t i = 0; i < streams.size(); ++i) {
+        uint8_t key[sizeof(s_key)];
+        memcpy(key, s_key, sizeof(key));
+        key[0] = (uint8_t)i;
+        streams[i] = std::make_unique<theme::rc4_stream>();
+        streams[i]->set_key(key, sizeof(key));
+    }
+
+    theme::rc4_batch batch;
+    uint8_t buf[theme::rc4_stream::kKeystreamSize]{};
+    for (auto _ : state) {
+        for (auto& stream : streams)
+            stream->apply(buf, buf, sizeof(buf));
+        if (state.range(1)) {
+            for (auto& stream : streams)
+                stream->refill(batch);
+            batch.run();
+        } else {
+            for (auto& stream : streams)
+                stream->refill();
+        }
+        benchmark::DoNotOptimize(buf);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(buf));
+}
+BENCHMARK(BM_rc4_refill)->RangeMultiplier(8)->Ranges({ { 1, 512 }, { 0, 1 } });
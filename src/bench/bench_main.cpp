@@ -0,0 +1,76 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "../core/log.h"
+
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// =================================================================================
+
+std::tuple<bool, theme::socket, theme::socket> theme::make_socket_pair()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1)
+        return std::make_tuple(false, socket(), socket());
+    return std::make_tuple(true, socket(fds[0]), socket(fds[1]));
+}
+
+void theme::drain_fd(int fd)
+{
+    uint8_t buf[16 * 1024];
+    while (::read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    // Unix sockets make the socket class grumble about address families and Nagling.
+    theme::log::set_level(theme::log::level::e_error);
+
+    // The poll benchmarks want a lot of fds.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Emit JSON unless told otherwise, so that runs from different builds can be compared with
+    // Google Benchmark's compare.py.
+    std::vector<char*> args(argv, argv + argc);
+    char json_format[] = "--benchmark_format=json";
+    bool has_format = false;
+    for (int i = 1; i < argc; ++i)
+        has_format |= strncmp(argv[i], "--benchmark_format", 18) == 0;
+    if (!has_format)
+        args.push_back(json_format);
+    int nargs = (int)args.size();
+    args.push_back(nullptr);
+
+    theme::register_protocol_benchmarks();
+    benchmark::Initialize(&nargs, args.data());
+    if (benchmark::ReportUnrecognizedArguments(nargs, args.data()))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
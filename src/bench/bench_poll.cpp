@@ -0,0 +1,97 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "../io/poll.h"
+
+#include <unistd.h>
+#include <vector>
+
+// =================================================================================
+
+namespace
+{
+    class drain_handler : public theme::poll_handler
+    {
+    public:
+        size_t m_events;
+
+        drain_handler()
+            : m_events()
+        { }
+
+        void handle_events(int fd, uint32_t) override
+        {
+            theme::drain_fd(fd);
+            m_events++;
+        }
+    };
+};
+
+// =================================================================================
+
+/**
+ * The event loop with many registered connections, only some of which have data.
+ * Waking up the active connections is part of the measurement, since they have to be made
+ * readable again on every iteration.
+ */
+static void BM_dispatch(benchmark::State& state)
+{
+    size_t nfds = state.range(0);
+    size_t nactive = state.range(1);
+
+    auto poll = theme::poll_dispatch::create(theme::poll_dispatch::backend::e_epoll);
+    drain_handler handler;
+
+    std::vector<theme::socket> readers;
+    std::vector<theme::socket> writers;
+    readers.reserve(nfds);
+    writers.reserve(nfds);
+    for (size_t i = 0; i < nfds; ++i) {
+        auto [result, reader, writer] = theme::make_socket_pair();
+        if (!result) {
+            state.SkipWithError("socketpair() failed -- is RLIMIT_NOFILE too low?");
+            return;
+        }
+        poll->add_fd(reader, theme::poll_dispatch::e_read, &handler);
+        readers.emplace_back(std::move(reader));
+        writers.emplace_back(std::move(writer));
+    }
+
+    // Spread the active connections out so that they aren't all neighbors.
+    size_t stride = nactive ? nfds / nactive : 0;
+    const uint8_t byte = 0;
+    for (auto _ : state) {
+        for (size_t i = 0; i < nactive; ++i)
+            writers[i * stride].write(sizeof(byte), &byte);
+
+        // The dispatcher may need a few waits to get through everything if its batch is small.
+        handler.m_events = 0;
+        do {
+            poll->dispatch(0);
+        } while (handler.m_events < nactive);
+    }
+    state.SetItemsProcessed(state.iterations() * nactive);
+
+    for (const theme::socket& reader : readers)
+        poll->remove_fd(reader);
+}
+BENCHMARK(BM_dispatch)
+    ->ArgNames({ "fds", "active" })
+    ->Args({ 16, 0 })->Args({ 16, 1 })->Args({ 16, 16 })
+    ->Args({ 256, 0 })->Args({ 256, 1 })->Args({ 256, 16 })->Args({ 256, 256 })
+    ->Args({ 1024, 0 })->Args({ 1024, 1 })->Args({ 1024, 16 })->Args({ 1024, 256 })
+    ->Args({ 4096, 0 })->Args({ 4096, 1 })->Args({ 4096, 16 })->Args({ 4096, 256 });
@@ -0,0 +1,176 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "../core/endian.h"
+#include "../protocol/common.h"
+#include "../protocol/gatekeeper.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+// =================================================================================
+
+#define THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) \
+    &theme::protocol::_net_structs::protocol_name##_##msg_name,
+#define THEME_NET_STRUCT_BEGIN(protocol_name, msg_name) THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name)
+#define THEME_NET_MESSAGES_BEGIN(protocol_name, direction)
+#define THEME_NET_MESSAGES_END(protocol_name, direction)
+
+#define THEME_NET_FIELD_BLOB(name, size)
+#define THEME_NET_FIELD_BUFFER(name)
+#define THEME_NET_FIELD_BUFFER_REDUNDANT(name)
+#define THEME_NET_FIELD_UINT8(name)
+#define THEME_NET_FIELD_UINT16(name)
+#define THEME_NET_FIELD_UINT32(name)
+#define THEME_NET_FIELD_STRING_UTF16(name, size)
+#define THEME_NET_FIELD_UUID(name)
+#define THEME_NET_STRUCT_END(protocol_name, msg_name)
+
+static const theme::net_struct* const s_structs[] = {
+#include "../protocol/common.inl"
+#include "../protocol/gatekeeper.inl"
+};
+
+#include "../protocol/protocol_fields_end.inl"
+
+// Variable field sizes to try. Clients may not send buffers larger than 1024 elements.
+static const int64_t s_payloads[] = { 0, 16, 64, 256, 1024 };
+
+static const uint8_t s_key[] = { 0x10, 0x32, 0x54, 0x76, 0x98, 0xBA, 0xDC };
+
+// =================================================================================
+
+/**
+ * Lays out a message in its memory representation.
+ * \param payloadsz Number of bytes to put in the variable field, if any. Strings are clamped to
+ *                  their maximum size.
+ */
+static std::vector<uint8_t> make_message(const theme::net_struct* ns, size_t payloadsz)
+{
+    std::vector<uint8_t> msg(ns->m_offsets[ns->m_size] + payloadsz, 0x5A);
+    for (size_t i = ns->m_fixedcount; i < ns->m_size; ++i) {
+        const theme::net_field& field = ns->m_fields[i];
+        const theme::net_field& sz_field = ns->m_fields[i - 1];
+
+        size_t count = payloadsz / field.m_elementsz;
+        if (field.m_type == theme::net_field::data_type::e_string_utf16)
+            count = std::min(count, field.m_count - 1);
+        else if (field.m_type == theme::net_field::data_type::e_buffer_redundant)
+            count += sz_field.m_elementsz / field.m_elementsz;
+
+        uint8_t* sz_ptr = msg.data() + ns->m_offsets[i - 1];
+        if (sz_field.m_elementsz == sizeof(uint16_t)) {
+            uint16_t value = THEME_LE16((uint16_t)count);
+            memcpy(sz_ptr, &value, sizeof(value));
+        } else {
+            uint32_t value = THEME_LE32((uint32_t)count);
+            memcpy(sz_ptr, &value, sizeof(value));
+        }
+    }
+    return msg;
+}
+
+// =================================================================================
+
+/**
+ * Queues a message and flushes it to the socket.
+ * Nobody reads the other end, so the peer is drained whenever the socket buffer fills up.
+ */
+static void BM_write(benchmark::State& state, const theme::net_struct* ns)
+{
+    auto msg = make_message(ns, state.range(0));
+    auto [result, local, remote] = theme::make_socket_pair();
+    if (!result) {
+        state.SkipWithError("socketpair() failed");
+        return;
+    }
+
+    theme::buffer_pool buffers;
+    theme::bench_client sender(local, buffers);
+    if (state.range(1))
+        sender.set_crypt_key(sizeof(s_key), s_key);
+
+    for (auto _ : state) {
+        sender.write(ns, msg.data());
+        while (!sender.handle_write())
+            theme::drain_fd(remote);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+/** Sends a message from one client to another, which reads it back into memory. */
+static void BM_roundtrip(benchmark::State& state, const theme::net_struct* ns)
+{
+    auto msg = make_message(ns, state.range(0));
+    auto [result, local, remote] = theme::make_socket_pair();
+    if (!result) {
+        state.SkipWithError("socketpair() failed");
+        return;
+    }
+
+    theme::buffer_pool buffers;
+    theme::bench_client sender(local, buffers);
+    theme::bench_client receiver(remote, buffers);
+    if (state.range(1)) {
+        sender.set_crypt_key(sizeof(s_key), s_key);
+        receiver.set_crypt_key(sizeof(s_key), s_key);
+    }
+
+    for (auto _ : state) {
+        sender.write(ns, msg.data());
+        if (!sender.handle_write()) {
+            state.SkipWithError("message was not flushed in one send");
+            break;
+        }
+
+        receiver.read(ns);
+        auto buf = receiver.handle_read();
+        if (!buf) {
+            state.SkipWithError("message was not read completely");
+            break;
+        }
+        benchmark::DoNotOptimize(buf.get());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(receiver.rx_bytes());
+}
+
+// =================================================================================
+
+void theme::register_protocol_benchmarks()
+{
+    for (const net_struct* ns : s_structs) {
+        bool fixed = ns->m_fixedcount == ns->m_size;
+
+        std::string write_name = std::string("BM_write/") + ns->m_name;
+        std::string roundtrip_name = std::string("BM_roundtrip/") + ns->m_name;
+        auto write = benchmark::RegisterBenchmark(write_name.c_str(), BM_write, ns);
+        auto roundtrip = benchmark::RegisterBenchmark(roundtrip_name.c_str(), BM_roundtrip, ns);
+        for (benchmark::internal::Benchmark* bm : { write, roundtrip }) {
+            bm->ArgNames({ "payload", "rc4" });
+            for (int64_t encrypted : { 0, 1 }) {
+                if (fixed) {
+                    bm->Args({ 0, encrypted });
+                } else {
+                    for (int64_t payload : s_payloads)
+                        bm->Args({ payload, encrypted });
+                }
+            }
+        }
+    }
+}
@@ -20,7 +20,8 @@
 
 // =================================================================================
 
-static void _default_assert_handler(const char* cond, const char* file, int line, const char* msg)
+static void _default_assert_handler([[maybe_unused]] const char* cond, [[maybe_unused]] const char* file,
+                                    [[maybe_unused]] int line, [[maybe_unused]] const char* msg)
 {
     std::cerr << std::endl;
     std::cerr << "Assertion Failed" << std::endl;
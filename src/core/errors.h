@@ -24,8 +24,8 @@
 #   define THEME_ASSERTD(cond) if ((cond) == 0) { theme::assert::handle(#cond, __FILE__, __LINE__, nullptr); }
 #   define THEME_ASSERTD_V(cond, msg, ...) if ((cond) == 0) { theme::assert::_handle(#cond, __FILE__, __LINE__, msg, __VA_ARGS__); }
 #else
-#   define THEME_ASSERTD(cond) (cond);
-#   define THEME_ASSERTD_V(cond, msg, ...) (cond);
+#   define THEME_ASSERTD(cond) (void)(cond);
+#   define THEME_ASSERTD_V(cond, msg, ...) (void)(cond);
 #endif
 #define THEME_ASSERTR(cond) if ((cond) == 0) { theme::assert::handle(#cond, __FILE__, __LINE__, nullptr); }
 #define THEME_ASSERTR_V(cond, msg, ...) if ((cond) == 0) { theme::assert::_handle(#cond, __FILE__, __LINE__, msg, __VA_ARGS__); }
@@ -15,22 +15,45 @@
 */
 
 #include "log.h"
+#include "log_sink.h"
 
+#include <atomic>
+#include <cstring>
 #include <ctime>
 #include <iostream>
+#include <mutex>
 
 // =================================================================================
 
-static char s_time[64]{};
+// Each reactor thread ticks its own clock.
+static thread_local char s_time[64]{};
+static thread_local std::time_t s_now{};
+static std::mutex s_outputLock;
+
+static std::unique_ptr<theme::log_sink> s_sinkOwner;
+static std::atomic<theme::log_sink*> s_sink{};
 
 theme::log::level theme::log::s_level = theme::log::level::e_info;
+std::atomic<bool> theme::log::s_deferred{};
+
+static constexpr char kLevels[] = { 'D', 'I', 'W', 'E' };
 
 // =================================================================================
 
 void theme::log::write_line(theme::log::level level, const char* msg)
 {
-    // No need for any fancy pants log file handling here. This is a simple, single threaded
-    // file server. We'll just dump directly to stdout and tee to a file.
+    log_sink* sink = s_sink.load(std::memory_order_acquire);
+    if (sink) {
+        // Threads that never tick (eg the crypto workers) just ask for the time.
+        std::time_t now = s_now ? s_now : std::time(nullptr);
+        sink->push(now, kLevels[(size_t)level], m_name.c_str(), m_name.size(), msg, strlen(msg));
+        return;
+    }
+
+    // No need for any fancy pants log file handling here. We'll just dump directly to stdout
+    // and tee to a file. Reactors may be logging from several threads, though, so keep the
+    // lines from being spliced together.
+    std::lock_guard<std::mutex> lock(s_outputLock);
     std::cout << s_time << ' ' << m_name.c_str();
     switch (level) {
     case theme::log::level::e_debug:
@@ -49,12 +72,44 @@ void theme::log::write_line(theme::log::level level, const char* msg)
     std::cout << ' ' << msg << std::endl;
 }
 
+bool theme::log::write_deferred(theme::log::level level, const char* fmt, const uint8_t* args,
+                                size_t argsz)
+{
+    static_assert(kMaxDeferredSize <= log_sink::kMaxLineSize);
+
+    log_sink* sink = s_sink.load(std::memory_order_acquire);
+    if (!sink)
+        return false;
+
+    // A full queue counts as handled -- the line is dropped either way.
+    std::time_t now = s_now ? s_now : std::time(nullptr);
+    sink->push_deferred(now, kLevels[(size_t)level], m_name.c_str(), m_name.size(), fmt, args, argsz);
+    return true;
+}
+
 // =================================================================================
 
 void theme::log::tick()
 {
-    std::time_t rawtime;
-    std::time(&rawtime);
-    std::tm* timeinfo = std::gmtime(&rawtime);
-    std::strftime(s_time, sizeof(s_time), "[%Y-%m-%d %H:%M:%S]", timeinfo);
+    std::time(&s_now);
+    std::tm timeinfo;
+    gmtime_r(&s_now, &timeinfo);
+    std::strftime(s_time, sizeof(s_time), "[%Y-%m-%d %H:%M:%S]", &timeinfo);
+}
+
+// =================================================================================
+
+void theme::log::start_async(std::unique_ptr<log_sink> sink)
+{
+    stop_async();
+    s_sinkOwner = std::move(sink);
+    s_sink.store(s_sinkOwner.get(), std::memory_order_release);
+}
+
+void theme::log::stop_async()
+{
+    // Anyone still logging must be done with the sink before it goes away, so this should only
+    // be called once the reactors and workers are shut down.
+    s_sink.store(nullptr, std::memory_order_release);
+    s_sinkOwner.reset();
 }
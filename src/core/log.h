@@ -17,10 +17,16 @@
 #ifndef __THEME_LOG_H
 #define __THEME_LOG_H
 
+#include <atomic>
+#include <memory>
 #include <string_theory/format>
 
+#include "log_format.h"
+
 namespace theme
 {
+    class log_sink;
+
     class log
     {
     public:
@@ -39,6 +45,27 @@ namespace theme
         void write_line(level level, const char* msg);
         void write_line(level level, const ST::string& msg) { write_line(level, msg.c_str()); }
 
+        /** Lines whose arguments are all recordable skip formatting when this is set. */
+        static std::atomic<bool> s_deferred;
+        static constexpr size_t kMaxDeferredSize = 440;
+
+        bool write_deferred(level level, const char* fmt, const uint8_t* args, size_t argsz);
+
+        template<typename... _Args>
+        void write_format(level level, log_literal fmt, _Args&&... args)
+        {
+            if constexpr ((log_args::is_deferrable_v<std::decay_t<_Args>> && ...)) {
+                if (s_deferred.load(std::memory_order_relaxed)) {
+                    uint8_t buf[kMaxDeferredSize];
+                    log_args record(buf, sizeof(buf));
+                    record.add_all(args...);
+                    if (write_deferred(level, fmt.c_str(), buf, record.size()))
+                        return;
+                }
+            }
+            write_line(level, ST::format(fmt.c_str(), std::forward<_Args>(args)...));
+        }
+
     public:
         log() = delete;
         log(const log&) = delete;
@@ -59,10 +86,10 @@ namespace theme
 
     public:
         template<typename... _Args>
-        void debug(const char* fmt, _Args&&... args)
+        void debug(log_literal fmt, _Args&&... args)
         {
             if (s_level <= level::e_debug)
-                write_line(level::e_debug, ST::format(fmt, std::forward<_Args>(args)...));
+                write_format(level::e_debug, fmt, std::forward<_Args>(args)...);
         }
 
         void debug(const char* msg)
@@ -72,10 +99,10 @@ namespace theme
         }
 
         template<typename... _Args>
-        void info(const char* fmt, _Args&&... args)
+        void info(log_literal fmt, _Args&&... args)
         {
             if (s_level <= level::e_info)
-                write_line(level::e_info, ST::format(fmt, std::forward<_Args>(args)...));
+                write_format(level::e_info, fmt, std::forward<_Args>(args)...);
         }
 
         void info(const char* msg)
@@ -85,10 +112,10 @@ namespace theme
         }
 
         template<typename... _Args>
-        void warning(const char* fmt, _Args&&... args)
+        void warning(log_literal fmt, _Args&&... args)
         {
             if (s_level <= level::e_warning)
-                write_line(level::e_warning, ST::format(fmt, std::forward<_Args>(args)...));
+                write_format(level::e_warning, fmt, std::forward<_Args>(args)...);
         }
 
         void warning(const char* msg)
@@ -98,10 +125,10 @@ namespace theme
         }
 
         template<typename... _Args>
-        void error(const char* fmt, _Args&&... args)
+        void error(log_literal fmt, _Args&&... args)
         {
             if (s_level <= level::e_error)
-                write_line(level::e_error, ST::format(fmt, std::forward<_Args>(args)...));
+                write_format(level::e_error, fmt, std::forward<_Args>(args)...);
         }
 
         void error(const char* msg)
@@ -114,6 +141,22 @@ namespace theme
         static void set_level(level level) { s_level = level; }
 
         static void tick();
+
+        /**
+         * Hands all further output to a background writer.
+         * Until this is called, and after stop_async(), lines are written synchronously.
+         */
+        static void start_async(std::unique_ptr<log_sink> sink);
+
+        /** Flushes the background writer and goes back to synchronous output. */
+        static void stop_async();
+
+        /**
+         * Records log arguments raw and leaves formatting to the background writer.
+         * Only has an effect while output is asynchronous. The writer reads format strings long
+         * after the call returns, which is why they are taken as a log_literal.
+         */
+        static void set_deferred(bool deferred) { s_deferred.store(deferred, std::memory_order_relaxed); }
     };
 };
 
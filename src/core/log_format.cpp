@@ -0,0 +1,281 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log_format.h"
+
+#include <cstdio>
+
+// =================================================================================
+
+namespace
+{
+    struct format_spec
+    {
+        enum { e_default, e_left, e_right } m_align;
+        char m_pad;
+        char m_sign;
+        size_t m_width;
+        int m_precision;
+        char m_type;
+    };
+
+    const char* parse_spec(const char* fmt, format_spec& spec)
+    {
+        spec = { format_spec::e_default, ' ', 0, 0, -1, 0 };
+        while (*fmt && *fmt != '}') {
+            switch (*fmt) {
+            case '<':
+                spec.m_align = format_spec::e_left;
+                break;
+            case '>':
+                spec.m_align = format_spec::e_right;
+                break;
+            case '_':
+                if (fmt[1] && fmt[1] != '}')
+                    spec.m_pad = *++fmt;
+                break;
+            case '+':
+                spec.m_sign = '+';
+                break;
+            case '.':
+                spec.m_precision = 0;
+                while (fmt[1] >= '0' && fmt[1] <= '9')
+                    spec.m_precision = spec.m_precision * 10 + (*++fmt - '0');
+                break;
+            case '0':
+                if (spec.m_width == 0) {
+                    spec.m_pad = '0';
+                    break;
+                }
+                [[fallthrough]];
+            case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+                spec.m_width = spec.m_width * 10 + (*fmt - '0');
+                break;
+            default:
+                spec.m_type = *fmt;
+                break;
+            }
+            ++fmt;
+        }
+        return fmt;
+    }
+
+    void append_padded(std::string& out, const format_spec& spec, const char* str, size_t len,
+                       bool numeric)
+    {
+        size_t pad = spec.m_width > len ? spec.m_width - len : 0;
+        bool left = spec.m_align == format_spec::e_left ||
+                    (spec.m_align == format_spec::e_default && !numeric);
+        if (pad && spec.m_pad == '0' && numeric && (*str == '-' || *str == '+')) {
+            // Zeroes go after the sign.
+            out.push_back(*str++);
+            len--;
+        }
+        if (!left)
+            out.append(pad, spec.m_pad);
+        out.append(str, len);
+        if (left)
+            out.append(pad, spec.m_pad);
+    }
+
+    void append_integer(std::string& out, const format_spec& spec, uint64_t magnitude, bool negative)
+    {
+        char buf[80];
+        char* end = buf + sizeof(buf);
+        char* p = end;
+
+        unsigned int base = 10;
+        const char* digits = "0123456789abcdef";
+        switch (spec.m_type) {
+        case 'x':
+            base = 16;
+            break;
+        case 'X':
+            base = 16;
+            digits = "0123456789ABCDEF";
+            break;
+        case 'o':
+            base = 8;
+            break;
+        case 'b':
+            base = 2;
+            break;
+        }
+
+        do {
+            *--p = digits[magnitude % base];
+            magnitude /= base;
+        } while (magnitude);
+        if (negative)
+            *--p = '-';
+        else if (spec.m_sign)
+            *--p = spec.m_sign;
+        append_padded(out, spec, p, end - p, true);
+    }
+
+    void append_float(std::string& out, const format_spec& spec, double value)
+    {
+        char fmt[8] = "%";
+        char* p = fmt + 1;
+        if (spec.m_sign)
+            *p++ = '+';
+        *p++ = '.';
+        *p++ = '*';
+        *p++ = (spec.m_type == 'f' || spec.m_type == 'e' || spec.m_type == 'E') ? spec.m_type : 'g';
+        *p = 0;
+
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), fmt, spec.m_precision < 0 ? 6 : spec.m_precision, value);
+        append_padded(out, spec, buf, std::clamp(len, 0, (int)sizeof(buf) - 1), true);
+    }
+};
+
+// =================================================================================
+
+void theme::log_args::format(std::string& out, const char* fmt, const uint8_t* args, size_t argsz)
+{
+    const uint8_t* end = args + argsz;
+    while (*fmt) {
+        if (*fmt == '{' && fmt[1] == '{') {
+            out.push_back('{');
+            fmt += 2;
+            continue;
+        }
+        if (*fmt == '}' && fmt[1] == '}') {
+            // string_theory doesn't treat this as an escape, so neither do we.
+            out.append("}}");
+            fmt += 2;
+            continue;
+        }
+        if (*fmt != '{') {
+            const char* next = strchr(fmt, '{');
+            size_t len = next ? next - fmt : strlen(fmt);
+            out.append(fmt, len);
+            fmt += len;
+            continue;
+        }
+
+        format_spec spec;
+        fmt = parse_spec(fmt + 1, spec);
+        if (*fmt == '}')
+            ++fmt;
+
+        if (args >= end) {
+            out.append("{?}");
+            continue;
+        }
+
+        auto take = [&](auto& value) {
+            if (args + sizeof(value) > end) {
+                args = end;
+                return false;
+            }
+            memcpy(&value, args, sizeof(value));
+            args += sizeof(value);
+            return true;
+        };
+
+        switch (*args++) {
+        case e_int:
+            {
+                int64_t value;
+                if (take(value)) {
+                    // Like string_theory, other bases get a sign too rather than two's complement.
+                    bool negative = value < 0;
+                    uint64_t magnitude = negative ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+                    append_integer(out, spec, magnitude, negative);
+                }
+            }
+            break;
+        case e_uint:
+            {
+                uint64_t value;
+                if (take(value))
+                    append_integer(out, spec, value, false);
+            }
+            break;
+        case e_float:
+            {
+                double value;
+                if (take(value))
+                    append_float(out, spec, value);
+            }
+            break;
+        case e_bool:
+            {
+                uint8_t value;
+                if (take(value))
+                    append_padded(out, spec, value ? "true" : "false", value ? 4 : 5, false);
+            }
+            break;
+        case e_char:
+            {
+                char value;
+                if (take(value))
+                    append_padded(out, spec, &value, 1, false);
+            }
+            break;
+        case e_string:
+            {
+                uint16_t len;
+                if (take(len)) {
+                    len = std::min((size_t)len, (size_t)(end - args));
+                    append_padded(out, spec, (const char*)args, len, false);
+                    args += len;
+                }
+            }
+            break;
+        default:
+            // Garbage. Don't try to make sense of anything after it.
+            args = end;
+            out.append("{?}");
+            break;
+        }
+    }
+}
+
+// =================================================================================
+
+void theme::log_file::append_line(std::string& out, const char* timestamp, char level,
+                                  std::string_view name, std::string_view line)
+{
+    out.append(timestamp);
+    out.push_back(' ');
+    out.append(name);
+    switch (level) {
+    case 'D':
+        out.append(" DEBUG: ");
+        break;
+    case 'I':
+        out.append(" INFO: ");
+        break;
+    case 'W':
+        out.append(" WARNING: ");
+        break;
+    default:
+        out.append(" ERROR: ");
+        break;
+    }
+    out.append(line);
+    out.push_back('\n');
+}
+
+void theme::log_file::format_time(char (&buf)[64], std::time_t time)
+{
+    std::tm timeinfo;
+    gmtime_r(&time, &timeinfo);
+    std::strftime(buf, sizeof(buf), "[%Y-%m-%d %H:%M:%S]", &timeinfo);
+}
@@ -0,0 +1,198 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_LOG_FORMAT_H
+#define __THEME_LOG_FORMAT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_theory/string>
+#include <string_view>
+#include <type_traits>
+
+namespace theme
+{
+    /**
+     * A format string that outlives the log call.
+     * Deferred lines are formatted long after the call returns, holding on to nothing but the
+     * pointer, so this only converts from string literals. Mutable arrays are refused, but a
+     * const array on the stack still gets through, so don't.
+     */
+    class log_literal
+    {
+        const char* m_str;
+
+    public:
+        template<size_t _Sz>
+        constexpr log_literal(const char(&str)[_Sz])
+            : m_str(str)
+        { }
+
+        template<size_t _Sz>
+        log_literal(char(&str)[_Sz]) = delete;
+
+        constexpr const char* c_str() const { return m_str; }
+    };
+
+    /**
+     * Raw log arguments, recorded now and formatted later.
+     * Each argument is a one byte tag followed by its value in host byte order. Strings are
+     * copied, so the buffer doesn't reference anything owned by the caller.
+     */
+    class log_args
+    {
+    public:
+        enum tag : uint8_t
+        {
+            e_int,
+            e_uint,
+            e_float,
+            e_bool,
+            e_char,
+            e_string,
+        };
+
+        /** Arguments of these types can be recorded. Anything else is formatted immediately. */
+        template<typename T>
+        static constexpr bool is_deferrable_v = std::is_arithmetic_v<T> ||
+                                                std::is_same_v<T, const char*> ||
+                                                std::is_same_v<T, char*> ||
+                                                std::is_same_v<T, ST::string>;
+
+    private:
+        uint8_t* m_buf;
+        size_t m_capacity;
+        size_t m_size;
+
+        void put(tag t, const void* value, size_t valuesz)
+        {
+            if (m_size + 1 + valuesz > m_capacity) {
+                // Out of room. The formatter treats missing arguments gracefully.
+                m_size = m_capacity;
+                return;
+            }
+            m_buf[m_size++] = t;
+            memcpy(m_buf + m_size, value, valuesz);
+            m_size += valuesz;
+        }
+
+        void put_string(const char* str, size_t len)
+        {
+            if (m_size + 3 > m_capacity) {
+                m_size = m_capacity;
+                return;
+            }
+            uint16_t strsz = (uint16_t)std::min(std::min(len, m_capacity - m_size - 3), (size_t)UINT16_MAX);
+            m_buf[m_size++] = e_string;
+            memcpy(m_buf + m_size, &strsz, sizeof(strsz));
+            memcpy(m_buf + m_size + sizeof(strsz), str, strsz);
+            m_size += sizeof(strsz) + strsz;
+        }
+
+    public:
+        log_args(uint8_t* buf, size_t capacity)
+            : m_buf(buf), m_capacity(capacity), m_size()
+        { }
+
+        size_t size() const { return m_size; }
+
+        template<typename T>
+        void add(const T& value)
+        {
+            if constexpr (std::is_same_v<T, bool>) {
+                uint8_t v = value;
+                put(e_bool, &v, sizeof(v));
+            } else if constexpr (std::is_same_v<T, char>) {
+                put(e_char, &value, sizeof(value));
+            } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+                int64_t v = value;
+                put(e_int, &v, sizeof(v));
+            } else if constexpr (std::is_integral_v<T>) {
+                uint64_t v = value;
+                put(e_uint, &v, sizeof(v));
+            } else if constexpr (std::is_floating_point_v<T>) {
+                double v = value;
+                put(e_float, &v, sizeof(v));
+            } else if constexpr (std::is_same_v<T, ST::string>) {
+                put_string(value.c_str(), value.size());
+            } else {
+                static_assert(std::is_same_v<T, const char*> || std::is_same_v<T, char*>);
+                const char* str = value ? value : "(null)";
+                put_string(str, strlen(str));
+            }
+        }
+
+        template<typename... _Args>
+        void add_all(const _Args&... args)
+        {
+            (add<std::decay_t<const _Args&>>(args), ...);
+        }
+
+    public:
+        /**
+         * Formats recorded arguments into \param out.
+         * Supports the subset of the string_theory format syntax that the log calls use:
+         * alignment, padding, width, precision, and the integer and float type specifiers.
+         * Like string_theory, only '{' is escaped by doubling it; '}}' is copied as is.
+         */
+        static void format(std::string& out, const char* fmt, const uint8_t* args, size_t argsz);
+    };
+
+    namespace log_file
+    {
+        /** Binary log files start with this, followed by a uint32_t version. */
+        constexpr char kMagic[8] = { 'T', 'H', 'E', 'M', 'E', 'L', 'O', 'G' };
+        constexpr uint32_t kVersion = 1;
+
+        enum frame_type : uint8_t
+        {
+            /** Introduces a format string. The data is the string, named by m_format. */
+            e_format,
+
+            /** A line that was formatted by the caller. The data is the line. */
+            e_text,
+
+            /** A line with deferred formatting. The data is a log_args buffer. */
+            e_deferred,
+        };
+
+        /** Each frame is this header followed by m_namesz bytes of name and m_datasz of data. */
+        struct frame_header
+        {
+            uint8_t m_type;
+            char m_level;
+            uint8_t m_namesz;
+            uint8_t m_reserved;
+            uint32_t m_format;
+            int64_t m_time;
+            uint32_t m_datasz;
+            uint32_t m_reserved2;
+        };
+        static_assert(sizeof(frame_header) == 24);
+
+        /** Appends a complete text log line, including the newline. */
+        void append_line(std::string& out, const char* timestamp, char level,
+                         std::string_view name, std::string_view line);
+
+        /** Formats \param time into a log timestamp. */
+        void format_time(char (&buf)[64], std::time_t time);
+    };
+};
+
+#endif
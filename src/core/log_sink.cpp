@@ -0,0 +1,339 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log_sink.h"
+#include "log_format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// =================================================================================
+
+// The writer naps this long when there is nothing to do. Producers only wake it when it is
+// asleep, so this also bounds how long a missed wakeup can delay output.
+constexpr auto kIdleWait = std::chrono::milliseconds(100);
+
+// Don't let a single write grow without bound while the ring is being hammered.
+constexpr size_t kMaxBatchSize = 64 * 1024;
+
+// =================================================================================
+
+theme::log_sink::log_sink(options opts)
+    : m_options(std::move(opts)), m_head(), m_tail(), m_dropped(), m_running(true),
+      m_sleeping(), m_fd(-1), m_filesz(), m_batchTime(-1), m_timestamp()
+{
+    size_t capacity = 64;
+    while (capacity < m_options.m_capacity)
+        capacity <<= 1;
+    m_ring = std::make_unique<record[]>(capacity);
+    m_mask = capacity - 1;
+    for (size_t i = 0; i < capacity; ++i)
+        m_ring[i].m_sequence.store(i, std::memory_order_relaxed);
+
+    m_batch.reserve(kMaxBatchSize + kMaxLineSize + 128);
+    if (!m_options.m_path.empty())
+        open_file();
+
+    m_thread = std::thread(&log_sink::run, this);
+}
+
+theme::log_sink::~log_sink()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_wakeLock);
+        m_running.store(false, std::memory_order_relaxed);
+    }
+    m_wake.notify_one();
+    m_thread.join();
+
+    if (m_fd != -1)
+        close(m_fd);
+}
+
+// =================================================================================
+
+theme::log_sink::record* theme::log_sink::claim()
+{
+    // Bounded MPMC queue a la Vyukov, except that there is only ever one consumer. Each slot's
+    // sequence tells producers whether the writer is done with it.
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    for (;;) {
+        record* rec = &m_ring[pos & m_mask];
+        size_t seq = rec->m_sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                return rec;
+        } else if (diff < 0) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void theme::log_sink::publish(record* rec)
+{
+    // The slot's position is its sequence minus the lap, which is exactly what we claimed.
+    size_t pos = rec->m_sequence.load(std::memory_order_relaxed);
+    rec->m_sequence.store(pos + 1, std::memory_order_release);
+
+    if (m_sleeping.load(std::memory_order_relaxed))
+        m_wake.notify_one();
+}
+
+bool theme::log_sink::push(std::time_t time, char level, const char* name, size_t namesz,
+                           const char* line, size_t linesz)
+{
+    record* rec = claim();
+    if (!rec)
+        return false;
+
+    rec->m_time = time;
+    rec->m_format = nullptr;
+    rec->m_level = level;
+    rec->m_namesz = (uint8_t)std::min(namesz, kMaxNameSize);
+    memcpy(rec->m_name, name, rec->m_namesz);
+    rec->m_linesz = (uint16_t)std::min(linesz, kMaxLineSize);
+    memcpy(rec->m_line, line, rec->m_linesz);
+    publish(rec);
+    return true;
+}
+
+bool theme::log_sink::push_deferred(std::time_t time, char level, const char* name, size_t namesz,
+                                    const char* fmt, const uint8_t* args, size_t argsz)
+{
+    record* rec = claim();
+    if (!rec)
+        return false;
+
+    // log_args never produces more than it was given room for, so nothing is cut in half here.
+    rec->m_time = time;
+    rec->m_format = fmt;
+    rec->m_level = level;
+    rec->m_namesz = (uint8_t)std::min(namesz, kMaxNameSize);
+    memcpy(rec->m_name, name, rec->m_namesz);
+    rec->m_linesz = (uint16_t)std::min(argsz, kMaxLineSize);
+    memcpy(rec->m_line, args, rec->m_linesz);
+    publish(rec);
+    return true;
+}
+
+// =================================================================================
+
+void theme::log_sink::format_time(std::time_t time)
+{
+    if (time == m_batchTime)
+        return;
+    log_file::format_time(m_timestamp, time);
+    m_batchTime = time;
+}
+
+void theme::log_sink::append_frame(std::string& out, uint8_t type, char level, uint32_t format,
+                                   std::time_t time, const char* name, size_t namesz,
+                                   const char* data, size_t datasz) const
+{
+    log_file::frame_header header{};
+    header.m_type = type;
+    header.m_level = level;
+    header.m_namesz = (uint8_t)namesz;
+    header.m_format = format;
+    header.m_time = time;
+    header.m_datasz = (uint32_t)datasz;
+    out.append((const char*)&header, sizeof(header));
+    out.append(name, namesz);
+    out.append(data, datasz);
+}
+
+uint32_t theme::log_sink::intern_format(const char* fmt)
+{
+    auto it = m_formatIds.find(fmt);
+    if (it != m_formatIds.end())
+        return it->second;
+
+    uint32_t id = (uint32_t)m_formatIds.size();
+    m_formatIds.emplace(fmt, id);
+    append_frame(m_frames, log_file::e_format, 0, id, 0, nullptr, 0, fmt, strlen(fmt));
+    return id;
+}
+
+bool theme::log_sink::drain()
+{
+    bool text = text_wanted();
+    bool binary = m_fd != -1 && m_options.m_binary;
+
+    bool result = false;
+    while (m_batch.size() < kMaxBatchSize && m_frames.size() < kMaxBatchSize) {
+        record& rec = m_ring[m_tail & m_mask];
+        if (rec.m_sequence.load(std::memory_order_acquire) != m_tail + 1)
+            break;
+
+        if (text) {
+            format_time(rec.m_time);
+            std::string_view line(rec.m_line, rec.m_linesz);
+            if (rec.m_format) {
+                m_formatted.clear();
+                log_args::format(m_formatted, rec.m_format, (const uint8_t*)rec.m_line,
+                                 rec.m_linesz);
+                line = m_formatted;
+            }
+            log_file::append_line(m_batch, m_timestamp, rec.m_level,
+                                  std::string_view(rec.m_name, rec.m_namesz), line);
+        }
+        if (binary) {
+            if (rec.m_format) {
+                uint32_t id = intern_format(rec.m_format);
+                append_frame(m_frames, log_file::e_deferred, rec.m_level, id, rec.m_time,
+                             rec.m_name, rec.m_namesz, rec.m_line, rec.m_linesz);
+            } else {
+                append_frame(m_frames, log_file::e_text, rec.m_level, 0, rec.m_time,
+                             rec.m_name, rec.m_namesz, rec.m_line, rec.m_linesz);
+            }
+        }
+
+        // Hand the slot back to the producers.
+        rec.m_sequence.store(m_tail + m_mask + 1, std::memory_order_release);
+        m_tail++;
+        result = true;
+    }
+
+    uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped != 0) {
+        std::time_t now = std::time(nullptr);
+        char msg[96];
+        int msgsz = snprintf(msg, sizeof(msg), "dropped %llu lines, the writer fell behind",
+                             (unsigned long long)dropped);
+        std::string_view line(msg, std::clamp(msgsz, 0, (int)sizeof(msg) - 1));
+        if (text) {
+            format_time(now);
+            log_file::append_line(m_batch, m_timestamp, 'W', "LOG", line);
+        }
+        if (binary)
+            append_frame(m_frames, log_file::e_text, 'W', 0, now, "LOG", 3, line.data(), line.size());
+        result = true;
+    }
+    return result;
+}
+
+void theme::log_sink::flush()
+{
+    // A short or failed write to the console is not worth stalling over.
+    if (m_options.m_console && !m_batch.empty()) {
+        [[maybe_unused]] ssize_t nconsole = ::write(STDOUT_FILENO, m_batch.data(), m_batch.size());
+    }
+
+    const std::string& out = m_options.m_binary ? m_frames : m_batch;
+    if (m_fd != -1 && !out.empty()) {
+        if (m_options.m_maxFileSize != 0 && m_filesz + out.size() > m_options.m_maxFileSize)
+            rotate_file();
+        if (m_fd != -1) {
+            ssize_t nwrite = ::write(m_fd, out.data(), out.size());
+            if (nwrite > 0)
+                m_filesz += nwrite;
+        }
+    }
+    m_batch.clear();
+    m_frames.clear();
+}
+
+void theme::log_sink::run()
+{
+    for (;;) {
+        if (drain()) {
+            flush();
+            continue;
+        }
+        if (!m_running.load(std::memory_order_relaxed))
+            break;
+
+        std::unique_lock<std::mutex> lock(m_wakeLock);
+        m_sleeping.store(true, std::memory_order_relaxed);
+        if (m_running.load(std::memory_order_relaxed))
+            m_wake.wait_for(lock, kIdleWait);
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    // Catch anything that slipped in while we were shutting down.
+    while (drain())
+        flush();
+}
+
+// =================================================================================
+
+bool theme::log_sink::open_file()
+{
+    m_fd = ::open(m_options.m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd == -1) {
+        fprintf(stderr, "unable to open log file '%s': %s\n", m_options.m_path.c_str(),
+                strerror(errno));
+        return false;
+    }
+
+    struct stat info;
+    m_filesz = fstat(m_fd, &info) == 0 ? info.st_size : 0;
+
+    // Binary files can't be appended to -- the format IDs from a previous run are meaningless.
+    if (m_options.m_binary) {
+        if (m_filesz != 0) {
+            [[maybe_unused]] int result = ftruncate(m_fd, 0);
+            m_filesz = 0;
+        }
+
+        std::string header(log_file::kMagic, sizeof(log_file::kMagic));
+        header.append((const char*)&log_file::kVersion, sizeof(log_file::kVersion));
+
+        // Every file must stand on its own, so repeat any formats introduced in earlier ones.
+        std::vector<const char*> formats(m_formatIds.size());
+        for (const auto& [fmt, id] : m_formatIds)
+            formats[id] = fmt;
+        for (uint32_t i = 0; i < formats.size(); ++i)
+            append_frame(header, log_file::e_format, 0, i, 0, nullptr, 0, formats[i], strlen(formats[i]));
+
+        ssize_t nwrite = ::write(m_fd, header.data(), header.size());
+        if (nwrite > 0)
+            m_filesz += nwrite;
+    }
+    return true;
+}
+
+void theme::log_sink::rotate_file()
+{
+    close(m_fd);
+    m_fd = -1;
+
+    // log.N-1 -> log.N, ..., log -> log.1. Whatever was in the oldest slot gets clobbered.
+    std::error_code ec;
+    auto rotated = [this](unsigned int i) {
+        std::filesystem::path path = m_options.m_path;
+        path += "." + std::to_string(i);
+        return path;
+    };
+    if (m_options.m_maxFiles == 0) {
+        std::filesystem::remove(m_options.m_path, ec);
+    } else {
+        for (unsigned int i = m_options.m_maxFiles - 1; i > 0; --i)
+            std::filesystem::rename(rotated(i), rotated(i + 1), ec);
+        std::filesystem::rename(m_options.m_path, rotated(1), ec);
+    }
+    open_file();
+}
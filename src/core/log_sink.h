@@ -0,0 +1,158 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_LOG_SINK_H
+#define __THEME_LOG_SINK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace theme
+{
+    /**
+     * Moves log output off of the threads doing the logging.
+     * Lines are copied into a bounded ring that any number of threads may push into without
+     * locking, and a single writer thread drains it to stdout and, optionally, a log file. When
+     * the ring is full, lines are counted and thrown away rather than blocking the caller.
+     * Lines may also be pushed as a format string and its raw arguments, in which case they are
+     * formatted by the writer, or not at all if they are only going to a binary log file.
+     */
+    class log_sink
+    {
+    public:
+        struct options
+        {
+            /** Log file to tee output into. Empty for stdout only. */
+            std::filesystem::path m_path;
+
+            /** Rotate the log file once it reaches this many bytes. 0 never rotates. */
+            size_t m_maxFileSize;
+
+            /** Number of rotated log files to keep around. */
+            unsigned int m_maxFiles;
+
+            /** Number of lines that may be waiting for the writer. Rounded up to a power of two. */
+            size_t m_capacity;
+
+            /** Write lines to stdout. */
+            bool m_console;
+
+            /**
+             * Write the log file in the binary format, leaving deferred lines unformatted.
+             * These files are turned back into text by theme_logdecode.
+             */
+            bool m_binary;
+        };
+
+        /** Lines longer than this are truncated. */
+        static constexpr size_t kMaxLineSize = 440;
+        static constexpr size_t kMaxNameSize = 16;
+
+    private:
+        struct record
+        {
+            std::atomic<size_t> m_sequence;
+            std::time_t m_time;
+
+            /** Format string of a deferred line, or nullptr if m_line is already formatted. */
+            const char* m_format;
+            uint16_t m_linesz;
+            uint8_t m_namesz;
+            char m_level;
+            char m_name[kMaxNameSize];
+            char m_line[kMaxLineSize];
+        };
+
+        options m_options;
+        std::unique_ptr<record[]> m_ring;
+        size_t m_mask;
+
+        alignas(64) std::atomic<size_t> m_head;
+        alignas(64) size_t m_tail;
+        std::atomic<uint64_t> m_dropped;
+
+        std::atomic<bool> m_running;
+        std::atomic<bool> m_sleeping;
+        std::mutex m_wakeLock;
+        std::condition_variable m_wake;
+        std::thread m_thread;
+
+        int m_fd;
+        size_t m_filesz;
+        std::string m_batch;
+        std::string m_frames;
+        std::string m_formatted;
+        std::time_t m_batchTime;
+        char m_timestamp[64];
+
+        /** Format strings already written to the binary log file, by address. */
+        std::unordered_map<const char*, uint32_t> m_formatIds;
+
+    private:
+        record* claim();
+        void publish(record* rec);
+
+        void run();
+        bool drain();
+        void flush();
+        void format_time(std::time_t time);
+
+        bool text_wanted() const { return m_options.m_console || (m_fd != -1 && !m_options.m_binary); }
+        void append_frame(std::string& out, uint8_t type, char level, uint32_t format,
+                          std::time_t time, const char* name, size_t namesz,
+                          const char* data, size_t datasz) const;
+        uint32_t intern_format(const char* fmt);
+
+        bool open_file();
+        void rotate_file();
+
+    public:
+        log_sink(options opts);
+        log_sink(const log_sink&) = delete;
+        log_sink(log_sink&&) = delete;
+
+        /** Writes out everything that has been pushed before returning. */
+        ~log_sink();
+
+    public:
+        /**
+         * Queues a line for the writer.
+         * \param level Single character level tag.
+         * \return Returns false if the line was dropped.
+         */
+        bool push(std::time_t time, char level, const char* name, size_t namesz,
+                  const char* line, size_t linesz);
+
+        /**
+         * Queues a line to be formatted by the writer.
+         * \param fmt Format string, which must outlive the sink. In practice, a string literal.
+         * \param args Arguments recorded by a theme::log_args.
+         */
+        bool push_deferred(std::time_t time, char level, const char* name, size_t namesz,
+                           const char* fmt, const uint8_t* args, size_t argsz);
+
+        uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+    };
+};
+
+#endif
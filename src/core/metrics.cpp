@@ -0,0 +1,325 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "errors.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// =================================================================================
+
+theme::metric::metric(type type, const char* name, const char* help, const char* labels)
+    : m_name(name), m_help(help), m_labels(labels), m_type(type), m_next()
+{
+    metrics_registry::get().add(this);
+}
+
+theme::metric::~metric()
+{
+    metrics_registry::get().remove(this);
+}
+
+void theme::metric::render_sample(std::string& out, const char* suffix, const char* extra_label,
+                                  const char* value) const
+{
+    out.append(m_name);
+    if (suffix)
+        out.append(suffix);
+    if (m_labels || extra_label) {
+        out.push_back('{');
+        if (m_labels)
+            out.append(m_labels);
+        if (m_labels && extra_label)
+            out.push_back(',');
+        if (extra_label)
+            out.append(extra_label);
+        out.push_back('}');
+    }
+    out.push_back(' ');
+    out.append(value);
+    out.push_back('\n');
+}
+
+// =================================================================================
+
+size_t theme::counter::get_stripe()
+{
+    // Hand out stripes round robin as threads first touch a counter.
+    static std::atomic<size_t> s_nextStripe{};
+    static thread_local size_t s_stripe = s_nextStripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return s_stripe;
+}
+
+uint64_t theme::counter::value() const
+{
+    uint64_t result = 0;
+    for (const stripe& s : m_stripes)
+        result += s.m_value.load(std::memory_order_relaxed);
+    return result;
+}
+
+void theme::counter::render(std::string& out) const
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value());
+    render_sample(out, nullptr, nullptr, buf);
+}
+
+// =================================================================================
+
+void theme::gauge::render(std::string& out) const
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", (long long)value());
+    render_sample(out, nullptr, nullptr, buf);
+}
+
+// =================================================================================
+
+theme::histogram::histogram(const char* name, const char* help,
+                            std::initializer_list<double> bounds, const char* labels)
+    : histogram(name, help, std::vector<double>(bounds), labels)
+{
+}
+
+theme::histogram::histogram(const char* name, const char* help, std::vector<double> bounds,
+                            const char* labels)
+    : metric(type::e_histogram, name, help, labels), m_bounds(std::move(bounds)),
+      m_count(), m_sum()
+{
+    THEME_ASSERTD(std::is_sorted(m_bounds.begin(), m_bounds.end()));
+
+    // The last bucket is +Inf.
+    m_buckets = std::make_unique<std::atomic<uint64_t>[]>(m_bounds.size() + 1);
+    for (size_t i = 0; i <= m_bounds.size(); ++i)
+        m_buckets[i].store(0, std::memory_order_relaxed);
+}
+
+std::vector<double> theme::histogram::exponential(double start, double factor, size_t count)
+{
+    std::vector<double> result(count);
+    for (size_t i = 0; i < count; ++i, start *= factor)
+        result[i] = start;
+    return result;
+}
+
+void theme::histogram::observe(double value)
+{
+    size_t bucket = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+
+    double sum = m_sum.load(std::memory_order_relaxed);
+    while (!m_sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed))
+        ;
+}
+
+void theme::histogram::render(std::string& out) const
+{
+    // Prometheus buckets are cumulative.
+    char value[32], label[48];
+    uint64_t total = 0;
+    for (size_t i = 0; i <= m_bounds.size(); ++i) {
+        total += m_buckets[i].load(std::memory_order_relaxed);
+        if (i < m_bounds.size())
+            snprintf(label, sizeof(label), "le=\"%g\"", m_bounds[i]);
+        else
+            strcpy(label, "le=\"+Inf\"");
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)total);
+        render_sample(out, "_bucket", label, value);
+    }
+
+    snprintf(value, sizeof(value), "%g", m_sum.load(std::memory_order_relaxed));
+    render_sample(out, "_sum", nullptr, value);
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)m_count.load(std::memory_order_relaxed));
+    render_sample(out, "_count", nullptr, value);
+}
+
+// =================================================================================
+
+theme::latency_histogram::latency_histogram(const char* name, const char* help, const char* labels)
+    : metric(type::e_summary, name, help, labels), m_count(), m_sum()
+{
+    m_buckets = std::make_unique<std::atomic<uint64_t>[]>(kBuckets);
+    for (size_t i = 0; i < kBuckets; ++i)
+        m_buckets[i].store(0, std::memory_order_relaxed);
+}
+
+size_t theme::latency_histogram::get_bucket(uint64_t value)
+{
+    // The first kSubBuckets values get a bucket each. After that, each power of two gets
+    // kSubBuckets buckets, indexed by the bits just below the leading one.
+    if (value < kSubBuckets)
+        return value;
+    size_t exponent = 63 - __builtin_clzll(value);
+    size_t mantissa = (value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+    return (exponent - kSubBucketBits + 1) * kSubBuckets + mantissa;
+}
+
+uint64_t theme::latency_histogram::get_bucket_limit(size_t bucket)
+{
+    if (bucket < kSubBuckets)
+        return bucket;
+    size_t exponent = bucket / kSubBuckets - 1 + kSubBucketBits;
+    uint64_t mantissa = kSubBuckets + bucket % kSubBuckets;
+    uint64_t width = (uint64_t)1 << (exponent - kSubBucketBits);
+    return mantissa * width + (width - 1);
+}
+
+void theme::latency_histogram::record(uint64_t usec)
+{
+    m_buckets[get_bucket(usec)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(usec, std::memory_order_relaxed);
+}
+
+theme::latency_histogram::snapshot theme::latency_histogram::take_snapshot() const
+{
+    snapshot result;
+    result.m_counts.resize(kBuckets);
+    for (size_t i = 0; i < kBuckets; ++i)
+        result.m_counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+    result.m_count = m_count.load(std::memory_order_relaxed);
+    result.m_sum = m_sum.load(std::memory_order_relaxed);
+    return result;
+}
+
+theme::latency_histogram::snapshot
+theme::latency_histogram::snapshot::operator-(const snapshot& rhs) const
+{
+    snapshot result = *this;
+    if (rhs.m_counts.size() == m_counts.size()) {
+        for (size_t i = 0; i < m_counts.size(); ++i)
+            result.m_counts[i] -= rhs.m_counts[i];
+        result.m_count -= rhs.m_count;
+        result.m_sum -= rhs.m_sum;
+    }
+    return result;
+}
+
+uint64_t theme::latency_histogram::snapshot::percentile(double q) const
+{
+    // The buckets and the total are read separately, so trust the buckets.
+    uint64_t total = 0;
+    for (uint64_t count : m_counts)
+        total += count;
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = std::max((uint64_t)(q * total + 0.5), (uint64_t)1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_counts.size(); ++i) {
+        seen += m_counts[i];
+        if (seen >= rank)
+            return get_bucket_limit(i);
+    }
+    return max();
+}
+
+uint64_t theme::latency_histogram::snapshot::max() const
+{
+    for (size_t i = m_counts.size(); i-- > 0;) {
+        if (m_counts[i] != 0)
+            return get_bucket_limit(i);
+    }
+    return 0;
+}
+
+void theme::latency_histogram::render(std::string& out) const
+{
+    // Summaries are in seconds, by convention.
+    snapshot snap = take_snapshot();
+    char value[32];
+    for (const char* q : { "0.5", "0.99", "0.999" }) {
+        char label[32];
+        snprintf(label, sizeof(label), "quantile=\"%s\"", q);
+        snprintf(value, sizeof(value), "%g", snap.percentile(atof(q)) / 1e6);
+        render_sample(out, nullptr, label, value);
+    }
+    snprintf(value, sizeof(value), "%g", snap.m_sum / 1e6);
+    render_sample(out, "_sum", nullptr, value);
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)snap.m_count);
+    render_sample(out, "_count", nullptr, value);
+}
+
+// =================================================================================
+
+theme::metrics_registry& theme::metrics_registry::get()
+{
+    // Metrics are usually statics themselves, so this must be ready before any of them.
+    static metrics_registry s_registry;
+    return s_registry;
+}
+
+void theme::metrics_registry::add(theme::metric* m)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m->m_next = m_head;
+    m_head = m;
+}
+
+void theme::metrics_registry::remove(theme::metric* m)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (metric** it = &m_head; *it; it = &(*it)->m_next) {
+        if (*it == m) {
+            *it = m->m_next;
+            break;
+        }
+    }
+}
+
+std::string theme::metrics_registry::render() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // Samples of the same metric have to be grouped under a single HELP and TYPE.
+    std::vector<const metric*> metrics;
+    for (const metric* it = m_head; it; it = it->m_next)
+        metrics.push_back(it);
+    std::stable_sort(metrics.begin(), metrics.end(), [](const metric* lhs, const metric* rhs) {
+        return strcmp(lhs->m_name, rhs->m_name) < 0;
+    });
+
+    std::string result;
+    const char* last = nullptr;
+    for (const metric* m : metrics) {
+        if (!last || strcmp(last, m->m_name) != 0) {
+            result.append("# HELP ").append(m->m_name).append(" ").append(m->m_help).append("\n");
+            result.append("# TYPE ").append(m->m_name);
+            switch (m->m_type) {
+            case metric::type::e_counter:
+                result.append(" counter\n");
+                break;
+            case metric::type::e_gauge:
+                result.append(" gauge\n");
+                break;
+            case metric::type::e_histogram:
+                result.append(" histogram\n");
+                break;
+            case metric::type::e_summary:
+                result.append(" summary\n");
+                break;
+            }
+            last = m->m_name;
+        }
+        m->render(result);
+    }
+    return result;
+}
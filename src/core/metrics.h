@@ -0,0 +1,232 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_METRICS_H
+#define __THEME_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace theme
+{
+    /**
+     * Something worth measuring.
+     * Metrics are meant to be declared as statics next to the code they measure. They register
+     * themselves with the metrics_registry on construction, and updating them never takes a lock.
+     */
+    class metric
+    {
+    public:
+        enum class type
+        {
+            e_counter,
+            e_gauge,
+            e_histogram,
+            e_summary,
+        };
+
+    private:
+        const char* m_name;
+        const char* m_help;
+        const char* m_labels;
+        type m_type;
+        metric* m_next;
+
+        friend class metrics_registry;
+
+    public:
+        const char* labels() const { return m_labels; }
+
+    protected:
+        /**
+         * \param name Metric name, which should follow the Prometheus conventions.
+         * \param labels Fixed label set, eg `type="ping"`, or nullptr. Metrics sharing a name
+         *        must have distinct labels.
+         */
+        metric(type type, const char* name, const char* help, const char* labels);
+
+        /** Appends the sample lines for this metric in the Prometheus text format. */
+        virtual void render(std::string& out) const = 0;
+
+        void render_sample(std::string& out, const char* suffix, const char* extra_label,
+                           const char* value) const;
+
+    public:
+        metric(const metric&) = delete;
+        metric(metric&&) = delete;
+        virtual ~metric();
+
+        const char* name() const { return m_name; }
+    };
+
+    /**
+     * A monotonically increasing count.
+     * The count is striped over several cache lines so that reactors bumping the same counter
+     * don't fight over it.
+     */
+    class counter final : public metric
+    {
+        static constexpr size_t kStripes = 8;
+
+        struct alignas(64) stripe
+        {
+            std::atomic<uint64_t> m_value;
+        };
+        stripe m_stripes[kStripes];
+
+        static size_t get_stripe();
+        void render(std::string& out) const override;
+
+    public:
+        counter(const char* name, const char* help, const char* labels=nullptr)
+            : metric(type::e_counter, name, help, labels), m_stripes()
+        { }
+
+        void inc(uint64_t value=1)
+        {
+            m_stripes[get_stripe()].m_value.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        uint64_t value() const;
+    };
+
+    /** A value that can go up as well as down. */
+    class gauge final : public metric
+    {
+        std::atomic<int64_t> m_value;
+
+        void render(std::string& out) const override;
+
+    public:
+        gauge(const char* name, const char* help, const char* labels=nullptr)
+            : metric(type::e_gauge, name, help, labels), m_value()
+        { }
+
+        void inc(int64_t value=1) { m_value.fetch_add(value, std::memory_order_relaxed); }
+        void dec(int64_t value=1) { m_value.fetch_sub(value, std::memory_order_relaxed); }
+        void set(int64_t value) { m_value.store(value, std::memory_order_relaxed); }
+
+        int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+    };
+
+    /** Counts observations into fixed buckets. */
+    class histogram final : public metric
+    {
+        std::vector<double> m_bounds;
+        std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+        std::atomic<uint64_t> m_count;
+        std::atomic<double> m_sum;
+
+        void render(std::string& out) const override;
+
+    public:
+        /** \param bounds Inclusive upper bound of each bucket, in ascending order. */
+        histogram(const char* name, const char* help, std::initializer_list<double> bounds,
+                  const char* labels=nullptr);
+
+        /** Buckets of \param start, start * factor, ... for \param count buckets. */
+        static std::vector<double> exponential(double start, double factor, size_t count);
+        histogram(const char* name, const char* help, std::vector<double> bounds,
+                  const char* labels=nullptr);
+
+        void observe(double value);
+    };
+
+    /**
+     * Log-bucketed latencies, in microseconds, a la HdrHistogram.
+     * Every power of two is split into kSubBuckets linear buckets, so any recorded value is
+     * known to within 1/kSubBuckets of itself, from one microsecond up to hours, at a fixed
+     * cost of a few KiB. Exposed to Prometheus as a summary of its p50, p99, and p999.
+     */
+    class latency_histogram final : public metric
+    {
+    public:
+        static constexpr size_t kSubBucketBits = 3;
+        static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+        static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+        /** A point in time copy of the counts, which can be diffed against an earlier one. */
+        struct snapshot
+        {
+            std::vector<uint64_t> m_counts;
+            uint64_t m_count;
+            uint64_t m_sum;
+
+            snapshot operator-(const snapshot& rhs) const;
+
+            /** \return Returns the smallest value that at least \param q of samples are within. */
+            uint64_t percentile(double q) const;
+            uint64_t max() const;
+        };
+
+    private:
+        std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+        std::atomic<uint64_t> m_count;
+        std::atomic<uint64_t> m_sum;
+
+        void render(std::string& out) const override;
+
+    public:
+        latency_histogram(const char* name, const char* help, const char* labels=nullptr);
+
+        static size_t get_bucket(uint64_t value);
+
+        /** \return Returns the largest value that lands in \param bucket. */
+        static uint64_t get_bucket_limit(size_t bucket);
+
+        void record(uint64_t usec);
+        snapshot take_snapshot() const;
+    };
+
+    class metrics_registry
+    {
+        /** Only guards the list itself. Metrics are updated without it. */
+        mutable std::mutex m_lock;
+        metric* m_head;
+
+        friend class metric;
+        void add(metric* m);
+        void remove(metric* m);
+
+        metrics_registry()
+            : m_head()
+        { }
+
+    public:
+        static metrics_registry& get();
+
+        /** Renders every registered metric in the Prometheus text exposition format. */
+        std::string render() const;
+
+        /** Calls \param func with every registered latency_histogram. */
+        template<typename _Func>
+        void for_each_latency(_Func&& func) const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (const metric* it = m_head; it; it = it->m_next) {
+                if (it->m_type == metric::type::e_summary)
+                    func(*static_cast<const latency_histogram*>(it));
+            }
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_SLAB_H
+#define __THEME_SLAB_H
+
+#include "errors.h"
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace theme
+{
+    /**
+     * Names an object in a slab.
+     * Every time a slot is reused, its generation is bumped, so a handle kept around after its
+     * object is destroyed will simply fail to resolve rather than find a stranger.
+     */
+    struct slab_handle
+    {
+        uint32_t m_index;
+        uint32_t m_generation;
+
+        bool operator==(const slab_handle& rhs) const
+        {
+            return m_index == rhs.m_index && m_generation == rhs.m_generation;
+        }
+        bool operator!=(const slab_handle& rhs) const { return !operator==(rhs); }
+    };
+
+    /**
+     * A table of objects that never move once constructed.
+     * Objects are stored in fixed size chunks that are never freed until the slab is, and
+     * destroyed slots are threaded onto a free list for reuse. Once the slab has grown to its
+     * working size, creating and destroying objects touches no allocator. Not thread safe.
+     */
+    template<typename T, size_t _ChunkSz=256>
+    class slab
+    {
+        static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+        struct slot
+        {
+            alignas(T) uint8_t m_storage[sizeof(T)];
+
+            /** Odd while the slot holds a live object. */
+            uint32_t m_generation;
+            uint32_t m_nextFree;
+
+            T* get() { return std::launder(reinterpret_cast<T*>(m_storage)); }
+            bool live() const { return m_generation & 1; }
+        };
+
+        std::vector<std::unique_ptr<slot[]>> m_chunks;
+        uint32_t m_freeHead;
+        size_t m_capacity;
+        size_t m_size;
+
+        slot& at(uint32_t index) { return m_chunks[index / _ChunkSz][index % _ChunkSz]; }
+        const slot& at(uint32_t index) const { return m_chunks[index / _ChunkSz][index % _ChunkSz]; }
+
+        uint32_t acquire()
+        {
+            if (m_freeHead == kNoSlot) {
+                THEME_ASSERTR(m_capacity + _ChunkSz < kNoSlot);
+                auto& chunk = m_chunks.emplace_back(std::make_unique<slot[]>(_ChunkSz));
+                for (size_t i = _ChunkSz; i-- > 0;) {
+                    chunk[i].m_generation = 0;
+                    chunk[i].m_nextFree = m_freeHead;
+                    m_freeHead = (uint32_t)(m_capacity + i);
+                }
+                m_capacity += _ChunkSz;
+            }
+
+            uint32_t index = m_freeHead;
+            m_freeHead = at(index).m_nextFree;
+            return index;
+        }
+
+    public:
+        slab()
+            : m_freeHead(kNoSlot), m_capacity(), m_size()
+        { }
+        slab(const slab&) = delete;
+        slab(slab&&) = delete;
+        ~slab() { clear(); }
+
+    public:
+        /**
+         * Constructs a new object in the slab.
+         * \return Returns the object's handle and a pointer to it, which remains valid until the
+         *         object is erased.
+         */
+        template<typename... _Args>
+        std::pair<slab_handle, T*> emplace(_Args&&... args)
+        {
+            uint32_t index = acquire();
+            slot& s = at(index);
+            T* result;
+            try {
+                result = new(s.m_storage) T(std::forward<_Args>(args)...);
+            } catch (...) {
+                s.m_nextFree = m_freeHead;
+                m_freeHead = index;
+                throw;
+            }
+            s.m_generation++;
+            m_size++;
+            return std::make_pair(slab_handle{ index, s.m_generation }, result);
+        }
+
+        /** Destroys the object named by \param handle, if it still exists. */
+        void erase(slab_handle handle)
+        {
+            if (handle.m_index >= m_capacity)
+                return;
+            slot& s = at(handle.m_index);
+            if (s.m_generation != handle.m_generation || !s.live())
+                return;
+
+            // Retire the handle before running the destructor so that anything it triggers sees
+            // the object as already gone.
+            s.m_generation++;
+            m_size--;
+            s.get()->~T();
+            s.m_nextFree = m_freeHead;
+            m_freeHead = handle.m_index;
+        }
+
+        /** \return Returns the object named by \param handle, or nullptr if it is gone. */
+        T* get(slab_handle handle)
+        {
+            if (handle.m_index >= m_capacity)
+                return nullptr;
+            slot& s = at(handle.m_index);
+            if (s.m_generation != handle.m_generation || !s.live())
+                return nullptr;
+            return s.get();
+        }
+
+        const T* get(slab_handle handle) const
+        {
+            return const_cast<slab*>(this)->get(handle);
+        }
+
+        /** Calls \param func on every live object, in slot order. */
+        template<typename _Func>
+        void for_each(_Func&& func)
+        {
+            for (uint32_t i = 0; i < m_capacity; ++i) {
+                slot& s = at(i);
+                if (s.live())
+                    func(slab_handle{ i, s.m_generation }, *s.get());
+            }
+        }
+
+        void clear()
+        {
+            for (uint32_t i = 0; i < m_capacity; ++i) {
+                if (at(i).live())
+                    erase(slab_handle{ i, at(i).m_generation });
+            }
+        }
+
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        size_t capacity() const { return m_capacity; }
+    };
+};
+
+#endif
@@ -41,6 +41,7 @@ namespace theme
 
     public:
         uuid() {}
+        uuid(const uuid& copy) { memcpy(m_data, copy.m_data, sizeof(m_data)); }
 
         uint8_t* data() { return m_data; }
         const uint8_t* data() const { return m_data; }
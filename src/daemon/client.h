@@ -18,34 +18,62 @@
 #define __THEME_CLIENT_H
 
 #include "../core/endian.h"
+#include "../core/slab.h"
 #include "../io/client_base.h"
+#include "../io/poll.h"
+#include "../io/timer_wheel.h"
+#include "limiter.h"
+
+#include <chrono>
 #include "../protocol/net_struct.h" // :(
 
-#include <list>
 #include <openssl/ossl_typ.h>
 
 namespace theme
 {
-    class client : public client_base
+    struct crypto_job;
+    class crypto_keys;
+
+    class client : public client_base, public stream_handler, public timer_handler
     {
     protected:
-        class server* m_server;
-        std::list<client>::iterator m_iterator;
+        class reactor* m_reactor;
+        slab_handle m_handle;
         uint32_t m_flags;
         class client_handler* m_handler;
+        connection_limiter::source m_source;
 
-        // So the m_iterator can be lazy-inited
-        friend class server;
+        enum class phase
+        {
+            e_connecting,
+            e_handshaking,
+            e_established,
+        };
+
+        /** Disconnects the client if it stalls in its current phase. */
+        timer m_deadline;
+        phase m_phase;
+        timer_wheel::clock_t::time_point m_phaseStart;
+        uint64_t m_phaseBytes;
+
+        // So the m_handle can be lazy-inited
+        friend class reactor;
 
     public:
-        client(socket& sock, class server* server);
+        client(socket& sock, const connection_limiter::source& source, class reactor* reactor);
         ~client();
 
     protected:
-        void handle_dispatch(int fd, uint32_t events);
+        void handle_events(int fd, uint32_t events) override;
+        bool handle_recv(int fd, const uint8_t* buf, size_t bufsz) override;
+        void handle_sent(int fd, size_t bytes) override;
         void pump_read();
         void pump_write();
 
+        std::chrono::milliseconds phase_timeout() const;
+        void update_deadline();
+        void handle_timeout(timer& t) override;
+
     public:
         enum flags
         {
@@ -60,6 +88,15 @@ namespace theme
 
             /** Waiting for a message header from the client. */
             e_wantMsgHeader = (1<<3),
+
+            /** Reads are on hold until an asynchronous operation completes. */
+            e_suspended = (1<<4),
+
+            /** Reads are on hold until the client drains its output backlog. */
+            e_throttled = (1<<5),
+
+            /** The dispatcher stopped receiving for us while reads were on hold. */
+            e_recvPaused = (1<<6),
         };
 
         uint32_t& flags() { return m_flags; }
@@ -69,7 +106,18 @@ namespace theme
         const class client_handler* handler() const { return m_handler; }
         void set_handler(class client_handler* handler) { m_handler = handler; }
 
-        const class server* server() const { return m_server; }
+        /** Names this client in its reactor's client table. Safe to hold past the client's death. */
+        slab_handle handle() const { return m_handle; }
+
+        class reactor* reactor() { return m_reactor; }
+        const class reactor* reactor() const { return m_reactor; }
+        const class server* server() const;
+
+        /** Suspends reading from the client until resume() is called. */
+        void suspend() { m_flags |= e_suspended; }
+
+        /** Picks reading and writing back up after a suspend(). */
+        void resume();
     };
 
     class client_handler
@@ -80,7 +128,7 @@ namespace theme
         client_handler(client_handler&&) = delete;
         virtual ~client_handler() = default;
 
-        virtual bool read(client& cli, socket& sock, std::unique_ptr<uint8_t[]>& buf) = 0;
+        virtual bool read(client& cli, socket& sock, buffer_ptr_t& buf) = 0;
         virtual void hup(client& cli, socket& sock) = 0;
 
     public:
@@ -100,24 +148,30 @@ namespace theme
         /** Even more crazy variable length buffer hackery. */
         net_struct m_encryptMsg;
         net_field m_encryptBuf;
+        size_t m_encryptOffsets[2];
+
+        /** The key agreement currently being computed by the crypto workers, if any. */
+        crypto_job* m_keyJob;
+        std::chrono::steady_clock::time_point m_keyStart;
 
     private:
         bool handle_handshake(client& cli, socket& sock, uint8_t* buf);
         bool handle_ydata(client& cli, socket& sock, uint8_t* buf);
+        void handle_server_key(client& cli, socket& sock, crypto_job& job);
 
     protected:
         encrypted_handler() = delete;
         encrypted_handler(client& cli);
         encrypted_handler(const encrypted_handler&) = delete;
         encrypted_handler(encrypted_handler&&) = delete;
-        virtual ~encrypted_handler() = default;
+        virtual ~encrypted_handler();
 
-        virtual std::tuple<BIGNUM*, BIGNUM*> get_keys(client& cli) = 0;
+        virtual const crypto_keys& get_keys(client& cli) = 0;
 
         /** Encryption has been successfully negotiated. */
         virtual bool handle_encryption(client& cli, socket& sock) = 0;
 
-        bool read(client& cli, socket& sock, std::unique_ptr<uint8_t[]>& buf);
+        bool read(client& cli, socket& sock, buffer_ptr_t& buf);
     };
 };
 
@@ -18,16 +18,36 @@
 
 #include "../core/errors.h"
 #include "../core/log.h"
+#include "../core/metrics.h"
+#include "../io/crypto_pool.h"
 #include "../io/poll.h"
 #include "../protocol/common.h"
+#include "reactor.h"
 #include "server.h"
 
 // =================================================================================
 
+static theme::gauge s_activeClients{"theme_clients_active", "Clients currently connected"};
+static theme::counter s_stalledClients{"theme_clients_timed_out_total",
+                                       "Clients disconnected for stalling"};
+static theme::counter s_badConnType{"theme_clients_rejected_total",
+                                    "Clients disconnected for requesting an unknown service"};
+
+static theme::counter s_handshakesStarted{"theme_handshakes_started_total",
+                                          "Encryption handshakes submitted to the crypto workers"};
+static theme::counter s_handshakesCompleted{"theme_handshakes_completed_total",
+                                            "Encryption handshakes successfully established"};
+static theme::counter s_handshakesFailed{"theme_handshakes_failed_total",
+                                         "Encryption handshakes that were malformed or failed"};
+static theme::latency_histogram s_handshakeLatency{"theme_handshake_latency_seconds",
+                                                   "Time spent computing a client's encryption key"};
+
+// =================================================================================
+
 class incoming_client : public theme::client_handler
 {
 public:
-    bool read(theme::client& cli, theme::socket& sock, std::unique_ptr<uint8_t[]>& buf) override
+    bool read(theme::client& cli, theme::socket& sock, theme::buffer_ptr_t& buf) override
     {
         auto header = (theme::protocol::common_connection_header*)buf.get();
         switch (header->get_connType()) {
@@ -37,6 +57,7 @@ public:
         default:
             cli.logger().warning("{}: unhandled connection type {x}, discarding",
                                  sock.to_string(), header->get_connType());
+            s_badConnType.inc();
             return false;
         }
         return true;
@@ -50,30 +71,47 @@ public:
 
 // =================================================================================
 
-theme::client::client(theme::socket& socket, theme::server* server)
-    : client_base(socket), m_server(server), m_flags(), m_handler(&s_incomingHandler)
+theme::client::client(theme::socket& socket, const connection_limiter::source& source,
+                      theme::reactor* reactor)
+    : client_base(socket, reactor->buffers()), m_reactor(reactor), m_handle(), m_flags(),
+      m_handler(&s_incomingHandler),
+      m_source(source), m_deadline(this), m_phase(phase::e_connecting), m_phaseBytes()
 {
     constexpr uint32_t events = poll_dispatch::e_read | poll_dispatch::e_write | poll_dispatch::e_hup;
 
-    if (server->poll()->add_fd(m_socket, (poll_dispatch::events)events,
-                               std::bind(&client::handle_dispatch, this,
-                                         std::placeholders::_1,
-                                         std::placeholders::_2)))
+    // Where the dispatcher can move our data itself, there's no need to poll for readiness.
+    poll_dispatch* poll = reactor->poll();
+    if (poll->supports_streams()) {
+        if (poll->add_stream(m_socket, this)) {
+            m_flags |= e_polling;
+            stream_via(poll);
+        }
+    } else if (poll->add_fd(m_socket, (poll_dispatch::events)events, this)) {
         m_flags |= e_polling;
+    }
 
     // We're awaiting a connection packet...
     read<protocol::common_connection_header>();
+    update_deadline();
+    s_activeClients.inc();
 }
 
 theme::client::~client()
 {
     if (m_flags & e_polling)
-        m_server->poll()->remove_fd(m_socket);
+        m_reactor->poll()->remove_fd(m_socket);
+    m_reactor->server()->limiter().release(m_source);
+    s_activeClients.dec();
+}
+
+const theme::server* theme::client::server() const
+{
+    return m_reactor->server();
 }
 
 // =================================================================================
 
-void theme::client::handle_dispatch(int fd, uint32_t events)
+void theme::client::handle_events(int, uint32_t events)
 {
     // Important: handle hang-ups first since the base class is in an undefined state
     // (read: nullptrs may be in mah state) -- it would be a shame if that crashed us.
@@ -83,29 +121,95 @@ void theme::client::handle_dispatch(int fd, uint32_t events)
         m_flags &= ~e_polling;
 
         // triggers destruction of this instance.
-        m_server->clients().erase(m_iterator);
+        m_reactor->clients().erase(m_handle);
         return;
     }
 
-    if (events & poll_dispatch::e_write)
-        pump_write();
+    // Replies are only queued while reading, so pipelined requests go out in a single send.
     if (events & poll_dispatch::e_read)
         pump_read();
+    pump_write();
+
+    // The replies are on their way, so get the cipher ready for whatever comes next along
+    // with everyone else who was serviced in this pass.
+    refill_keystream(m_reactor->keystreams());
+}
+
+bool theme::client::handle_recv(int, const uint8_t* buf, size_t bufsz)
+{
+    if (receive(buf, bufsz)) {
+        pump_read();
+        pump_write();
+        refill_keystream(m_reactor->keystreams());
+    }
+
+    // Anything more can wait in the socket until reads pick back up.
+    if (m_flags & (e_suspended | e_throttled)) {
+        m_flags |= e_recvPaused;
+        return false;
+    }
+    return true;
+}
+
+void theme::client::handle_sent(int, size_t bytes)
+{
+    sent(bytes);
+    pump_write();
+    refill_keystream(m_reactor->keystreams());
+}
+
+void theme::client::resume()
+{
+    THEME_ASSERTD(m_flags & e_suspended);
+    m_flags &= ~e_suspended;
+    update_deadline();
+
+    // The socket is edge triggered, so anything that arrived while we were suspended won't
+    // generate another event.
+    pump_read();
+    pump_write();
+    refill_keystream(m_reactor->keystreams());
 }
 
 void theme::client::pump_read()
 {
-    while (auto buf = handle_read()) {
+    if (m_flags & (e_suspended | e_throttled))
+        return;
+
+    if (m_flags & e_recvPaused) {
+        m_flags &= ~e_recvPaused;
+        m_reactor->poll()->resume_recv(m_socket);
+    }
+
+    while (true) {
+        // Don't keep taking requests from a client that isn't reading the replies.
+        if (write_backlogged()) {
+            s_log.debug("{}: output backlog is full, throttling reads", m_socket.to_string());
+            m_flags |= e_throttled;
+            return;
+        }
+
+        auto buf = handle_read();
+        if (!buf)
+            break;
+
         // Great! If we're here, this is a completed net message -- post it up to the high level
         // handler. That handler is responsible for registering the next struct for us to read.
         // A lack of a new struct is potentially an error...
         if (!m_handler->read(*this, m_socket, buf)) {
-            s_log.debug("{}: handle_dispatch() read says it's time to shutdown.",
+            s_log.debug("{}: handle_events() read says it's time to shutdown.",
                         m_socket.to_string());
-            m_socket.shutdown();
+            // Give any parting words the handler queued a chance to go out.
+            shutdown_after_write();
+            return;
+        }
+
+        update_deadline();
+        if (m_flags & e_suspended) {
+            // The handler will resume us when it is ready to continue.
             return;
         } else if (!has_pending_read()) {
-            s_log.error("{}: handle_dispatch() has no queued reads. Bug?",
+            s_log.error("{}: handle_events() has no queued reads. Bug?",
                         m_socket.to_string());
             m_socket.shutdown();
             return;
@@ -113,24 +217,95 @@ void theme::client::pump_read()
     }
 }
 
+std::chrono::milliseconds theme::client::phase_timeout() const
+{
+    const client_deadlines& deadlines = m_reactor->deadlines();
+    return (m_phase == phase::e_established) ? deadlines.m_idle : deadlines.m_handshake;
+}
+
+void theme::client::update_deadline()
+{
+    phase next;
+    if (m_handler == &s_incomingHandler)
+        next = phase::e_connecting;
+    else if (!(m_flags & e_encrypted))
+        next = phase::e_handshaking;
+    else
+        next = phase::e_established;
+
+    // The handshake phases get a single deadline each, no matter how many messages they take.
+    // Established clients get a fresh one for every message.
+    if (next == m_phase && next != phase::e_established && m_deadline.armed())
+        return;
+
+    m_phase = next;
+    m_phaseStart = timer_wheel::clock_t::now();
+    m_phaseBytes = rx_bytes();
+    m_reactor->timers().schedule(m_deadline, phase_timeout());
+}
+
+void theme::client::handle_timeout(theme::timer&)
+{
+    // Don't hold time spent waiting on the crypto workers against the client.
+    if (m_flags & e_suspended) {
+        m_reactor->timers().schedule(m_deadline, phase_timeout());
+        return;
+    }
+
+    // Clients that are slow but still making progress earn extra time for what they've sent.
+    auto deadline = m_phaseStart + phase_timeout();
+    uint32_t min_rate = m_reactor->deadlines().m_minRate;
+    if (min_rate != 0)
+        deadline += std::chrono::seconds((rx_bytes() - m_phaseBytes) / min_rate);
+
+    auto now = timer_wheel::clock_t::now();
+    if (now < deadline) {
+        m_reactor->timers().schedule(m_deadline,
+                                     std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+        return;
+    }
+
+    s_log.debug("{}: stalled for too long, disconnecting", m_socket.to_string());
+    s_stalledClients.inc();
+
+    // The HUP will be along to clean up shortly.
+    m_socket.shutdown();
+}
+
 void theme::client::pump_write()
 {
     do {
-        if (!handle_write())
+        handle_write();
+
+        // The socket is edge triggered, so whatever we left unread while throttled won't
+        // generate another event.
+        if (!(m_flags & e_throttled) || !write_drained())
             break;
+        m_flags &= ~e_throttled;
+        pump_read();
     } while (true);
 }
 
 // =================================================================================
 
 theme::encrypted_handler::encrypted_handler(theme::client& cli)
-    : m_encryptMsg({"m_encryptMsg", 1, &m_encryptBuf}),
-      m_encryptBuf({net_field::data_type::e_blob, "buffer", 1, 0})
+    : m_encryptMsg({"m_encryptMsg", 1, &m_encryptBuf, m_encryptOffsets, 1, 0}),
+      m_encryptBuf({net_field::data_type::e_blob, "buffer", 1, 0}),
+      m_encryptOffsets(),
+      m_keyJob(), m_keyStart()
 {
     // We don't actually want to hold the client, just setup the read state.
     cli.read<protocol::common_encrypt_header>();
 }
 
+theme::encrypted_handler::~encrypted_handler()
+{
+    // The crypto workers may still be chewing on our key. Make sure they don't call back into
+    // a dead handler.
+    if (m_keyJob)
+        m_keyJob->m_complete = nullptr;
+}
+
 // =================================================================================
 
 bool theme::encrypted_handler::handle_handshake(theme::client& cli, theme::socket& sock, uint8_t* buf)
@@ -139,11 +314,13 @@ bool theme::encrypted_handler::handle_handshake(theme::client& cli, theme::socke
     if (header->get_msgId() != e_c2s_connect) {
         cli.logger().error("{}: unexpected encryption packet {}", sock.to_string(),
                            header->get_msgId());
+        s_handshakesFailed.inc();
         return false;
     }
     if (header->get_bufsz() != 2 && header->get_bufsz() != 66) {
         cli.logger().error("{}: bad encryption handshake size {}, expected 2 or 66",
                            sock.to_string(), header->get_bufsz());
+        s_handshakesFailed.inc();
         return false;
     }
 
@@ -157,10 +334,13 @@ bool theme::encrypted_handler::handle_handshake(theme::client& cli, theme::socke
 #else
         cli.logger().error("{}: sent an empty encryption handshake, which is verboten",
                            sock.to_string());
+        s_handshakesFailed.inc();
         return false;
 #endif
     } else {
         m_encryptBuf.m_count = header->get_bufsz() - 2;
+        m_encryptOffsets[1] = m_encryptBuf.m_count;
+        m_encryptMsg.m_fixedsz = m_encryptBuf.m_count;
         cli.read(&m_encryptMsg);
         cli.flags() |= client::e_wantClientSeed;
         return true;
@@ -172,29 +352,66 @@ bool theme::encrypted_handler::handle_ydata(theme::client& cli, theme::socket& s
     // This is a little over-engineered for the current application, but we may (in the future) want
     // to proxy other connections aside from just GateKeeperSrv and FileSrv, so it's best to keep
     // things fairly general.
-    auto keys = get_keys(cli);
+    auto job = std::make_unique<crypto_job>();
+    if (m_encryptBuf.m_count > sizeof(job->m_ydata)) {
+        cli.logger().error("{}: client seed is too large ({} bytes)", sock.to_string(),
+                           m_encryptBuf.m_count);
+        s_handshakesFailed.inc();
+        return false;
+    }
+    job->m_keys = &get_keys(cli);
+    job->m_ydatasz = m_encryptBuf.m_count;
+    memcpy(job->m_ydata, buf, m_encryptBuf.m_count);
+    // The socket belongs to the client, so it is only touched if the client is still around.
+    job->m_complete = [this, &sock, reactor = cli.reactor(), handle = cli.handle()](crypto_job& job) {
+        if (client* cli = reactor->clients().get(handle))
+            handle_server_key(*cli, sock, job);
+    };
 
-    protocol::common_encrypt_s2c reply;
-    reply.set_msgId(e_s2c_encrypt);
-    reply.set_bufsz(sizeof(reply));
+    // The modular exponentiation is far too slow to do on the reactor thread, so park the client
+    // until the crypto workers hand us back the key.
+    m_keyJob = job.get();
+    m_keyStart = std::chrono::steady_clock::now();
+    s_handshakesStarted.inc();
+    cli.suspend();
+    cli.server()->crypto_workers().submit(std::move(job), cli.reactor()->crypto_queue());
+    return true;
+}
 
-    uint8_t key[sizeof(reply.m_srvSeed)];
-    const auto& crypto = cli.server()->crypto();
-    if (!crypto.make_server_key(std::get<0>(keys), std::get<1>(keys), m_encryptBuf.m_count,
-                                buf, sizeof(key), reply.m_srvSeed, key)) {
+void theme::encrypted_handler::handle_server_key(theme::client& cli, theme::socket& sock,
+                                                 theme::crypto_job& job)
+{
+    m_keyJob = nullptr;
+    auto elapsed = std::chrono::steady_clock::now() - m_keyStart;
+    s_handshakeLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+    if (!job.m_result) {
         cli.logger().error("{}: failed to establish encryption", sock.to_string());
-        return false;
+        s_handshakesFailed.inc();
+        sock.shutdown();
+        return;
     }
 
+    protocol::common_encrypt_s2c reply;
+    reply.set_msgId(e_s2c_encrypt);
+    reply.set_bufsz(sizeof(reply));
+    static_assert(sizeof(reply.m_srvSeed) == sizeof(job.m_srvSeed));
+    memcpy(reply.m_srvSeed, job.m_srvSeed, sizeof(reply.m_srvSeed));
+
     // Write the reply back to the client in the clear, so don't apply the evp yet.
     cli.write(&reply);
-    cli.set_crypt_key(sizeof(key), key);
+    cli.set_crypt_key(sizeof(job.m_key), job.m_key);
     cli.flags() |= client::e_encrypted;
-    return handle_encryption(cli, sock);
+    if (!handle_encryption(cli, sock)) {
+        sock.shutdown();
+        return;
+    }
+    s_handshakesCompleted.inc();
+    cli.resume();
 }
 
 bool theme::encrypted_handler::read(theme::client& cli, theme::socket& sock,
-                                    std::unique_ptr<uint8_t[]>& buf)
+                                    theme::buffer_ptr_t& buf)
 {
     THEME_ASSERTD(!(cli.flags() & client::e_encrypted));
 
@@ -19,9 +19,8 @@
 #include "client.h"
 #include "server.h"
 
-#include <openssl/bn.h>
-
 #include "../core/log.h"
+#include "../core/metrics.h"
 #include "../io/uru_crypt.h"
 #include "../protocol/common.h"
 #include "../protocol/gatekeeper.h"
@@ -32,25 +31,33 @@ using namespace ST::literals;
 
 static theme::log s_log{"GATEKEEPER"};
 
+static constexpr char kRequestsName[] = "theme_gatekeeper_requests_total";
+static constexpr char kRequestsHelp[] = "GateKeeper requests dispatched, by message type";
+static theme::counter s_pingRequests{kRequestsName, kRequestsHelp, "type=\"ping\""};
+static theme::counter s_fileSrvRequests{kRequestsName, kRequestsHelp, "type=\"fileSrv\""};
+static theme::counter s_authSrvRequests{kRequestsName, kRequestsHelp, "type=\"authSrv\""};
+static theme::counter s_unknownRequests{kRequestsName, kRequestsHelp, "type=\"unknown\""};
+
 // =================================================================================
 
 theme::gatekeeper_daemon::gatekeeper_daemon(const server* parent)
     : m_parent(parent),
       m_authsrv(parent->config().get<std::u16string>("gate", "authaddr")),
-      m_filesrv(parent->config().get<std::u16string>("gate", "fileaddr")),
-      m_cryptK(), m_cryptN()
+      m_filesrv(parent->config().get<std::u16string>("gate", "fileaddr"))
 {
     bool result;
-    std::tie(result, m_cryptK, m_cryptN) = parent->crypto().load_keys(parent->config(), "gate"_st);
+    std::tie(result, m_cryptKeys) = parent->crypto().load_keys(parent->config(), "gate"_st);
     if (!result) {
         s_log.warning("gatekeeper encryption keys not configured properly--encrypted connections will fail");
     }
+
+    client_base::track_latency(protocol::gatekeeper_pingRequest::net_struct);
+    client_base::track_latency(protocol::gatekeeper_fileSrvRequest::net_struct);
+    client_base::track_latency(protocol::gatekeeper_authSrvRequest::net_struct);
 }
 
 theme::gatekeeper_daemon::~gatekeeper_daemon()
 {
-    BN_free(m_cryptK);
-    BN_free(m_cryptN);
 }
 
 // =================================================================================
@@ -59,47 +66,67 @@ namespace theme
 {
     class gatekeeper_server : public encrypted_handler, public client_handler
     {
+    public:
+        typedef bool (*dispatch_t)(gatekeeper_server&, client&, socket&, buffer_ptr_t&);
+
+        template<typename _Msg>
+        static bool dispatch(gatekeeper_server& self, client& cli, socket& sock, buffer_ptr_t& buf)
+        {
+            return self.handle(cli, sock, (_Msg*)buf.get());
+        }
+
     protected:
-        std::tuple<BIGNUM*, BIGNUM*> get_keys(client& cli) override;
+        const crypto_keys& get_keys(client& cli) override;
 
-        bool handle_ping(client& cli, socket& sock, protocol::gatekeeper_pingRequest* req);
-        bool handle_fileSrvReq(client& cli, socket& sock, protocol::gatekeeper_fileSrvRequest* req);
-        bool handle_authSrvReq(client& cli, socket& sock, protocol::gatekeeper_authSrvRequest* req);
+        bool handle(client& cli, socket& sock, protocol::gatekeeper_pingRequest* req);
+        bool handle(client& cli, socket& sock, protocol::gatekeeper_fileSrvRequest* req);
+        bool handle(client& cli, socket& sock, protocol::gatekeeper_authSrvRequest* req);
+        bool handle_unknown(client& cli, socket& sock, uint16_t type);
 
         bool handle_encryption(client& cli, socket& sock) override;
-        bool dispatch_msg(client& cli, socket& sock, std::unique_ptr<uint8_t[]>& buf);
-        bool read_msg(client& cli, socket& sock, std::unique_ptr<uint8_t[]>& buf);
+        bool dispatch_msg(client& cli, socket& sock, buffer_ptr_t& buf);
+        bool read_msg(client& cli, socket& sock, buffer_ptr_t& buf);
 
     public:
         gatekeeper_server(client& cli)
             : encrypted_handler(cli)
         { }
 
-        bool read(client& cli, socket& sock, std::unique_ptr<uint8_t[]>& buf) override;
+        bool read(client& cli, socket& sock, buffer_ptr_t& buf) override;
         void hup(client& cli, socket& sock) override;
     };
 };
 
 // =================================================================================
 
-std::tuple<BIGNUM*, BIGNUM*> theme::gatekeeper_server::get_keys(theme::client& cli)
+static constexpr auto s_messages = theme::protocol::gatekeeper::cli2srv<theme::gatekeeper_server>();
+static_assert(s_messages.find(theme::protocol::gatekeeper::e_authSrvRequest)->m_struct ==
+              theme::protocol::gatekeeper_authSrvRequest::net_struct);
+
+// =================================================================================
+
+const theme::crypto_keys& theme::gatekeeper_server::get_keys(theme::client& cli)
 {
     return cli.server()->gatekeeper()->get_keys();
 }
 
 // =================================================================================
 
-bool theme::gatekeeper_server::handle_ping(theme::client& cli, theme::socket& sock,
-                                           theme::protocol::gatekeeper_pingRequest* req)
+bool theme::gatekeeper_server::handle(theme::client& cli, theme::socket&,
+                                      theme::protocol::gatekeeper_pingRequest* req)
 {
+    s_pingRequests.inc();
+
     // Response is simply a bitwise copy--no need for any additional processing.
     cli.write<protocol::gatekeeper_pingReply>((protocol::gatekeeper_pingReply*)req);
     return true;
 }
 
-bool theme::gatekeeper_server::handle_fileSrvReq(theme::client& cli, theme::socket& sock,
-                                                 theme::protocol::gatekeeper_fileSrvRequest* req)
+bool theme::gatekeeper_server::handle(theme::client& cli, theme::socket&,
+                                      theme::protocol::gatekeeper_fileSrvRequest* req)
 {
+    s_fileSrvRequests.inc();
+
     protocol::gatekeeper_fileSrvReply reply;
     reply.set_type(reply.id());
     reply.set_transId(req->get_transId());
@@ -108,9 +135,11 @@ bool theme::gatekeeper_server::handle_fileSrvReq(theme::client& cli, theme::sock
     return true;
 }
 
-bool theme::gatekeeper_server::handle_authSrvReq(theme::client& cli, theme::socket& sock,
-                                                 theme::protocol::gatekeeper_authSrvRequest* req)
+bool theme::gatekeeper_server::handle(theme::client& cli, theme::socket&,
+                                      theme::protocol::gatekeeper_authSrvRequest* req)
 {
+    s_authSrvRequests.inc();
+
     protocol::gatekeeper_fileSrvReply reply;
     reply.set_type(reply.id());
     reply.set_transId(req->get_transId());
@@ -119,9 +148,17 @@ bool theme::gatekeeper_server::handle_authSrvReq(theme::client& cli, theme::sock
     return true;
 }
 
+bool theme::gatekeeper_server::handle_unknown(theme::client& cli, theme::socket& sock,
+                                              uint16_t type)
+{
+    cli.logger().warning("{}: sent unknown message {x}", sock.to_string(), type);
+    s_unknownRequests.inc();
+    return false;
+}
+
 // =================================================================================
 
-bool theme::gatekeeper_server::handle_encryption(theme::client& cli, theme::socket& sock)
+bool theme::gatekeeper_server::handle_encryption(theme::client& cli, theme::socket&)
 {
     // Begin reading encrypted messages from the client.
     cli.flags() |= client::e_wantMsgHeader;
@@ -130,52 +167,30 @@ bool theme::gatekeeper_server::handle_encryption(theme::client& cli, theme::sock
 }
 
 bool theme::gatekeeper_server::dispatch_msg(theme::client& cli, theme::socket& sock,
-                                            std::unique_ptr<uint8_t[]>& buf)
+                                            theme::buffer_ptr_t& buf)
 {
     auto header = (const protocol::common_msg_std_header*)buf.get();
-    switch (header->get_type()) {
-    case protocol::gatekeeper::e_pingRequest:
-        return handle_ping(cli, sock, (protocol::gatekeeper_pingRequest*)buf.get());
-    case protocol::gatekeeper::e_fileSrvRequest:
-        return handle_fileSrvReq(cli, sock, (protocol::gatekeeper_fileSrvRequest*)buf.get());
-    case protocol::gatekeeper::e_authSrvRequest:
-        return handle_authSrvReq(cli, sock, (protocol::gatekeeper_authSrvRequest*)buf.get());
-    default:
-        cli.logger().warning("{}: dispatch_msg() no dispatcher for {x}", sock.to_string(),
-                             header->get_type());
-        return false;
-    }
+    auto entry = s_messages.find(header->get_type());
+    if (!entry)
+        return handle_unknown(cli, sock, header->get_type());
+    return entry->m_dispatch(*this, cli, sock, buf);
 }
 
 bool theme::gatekeeper_server::read_msg(theme::client& cli, theme::socket& sock,
-                                        std::unique_ptr<uint8_t[]>& buf)
+                                        theme::buffer_ptr_t& buf)
 {
-    const net_struct* ns;
     auto header = (const protocol::common_msg_std_header*)buf.get();
-
-    switch (header->get_type()) {
-    case protocol::gatekeeper::e_pingRequest:
-        ns = protocol::gatekeeper_pingRequest::net_struct;
-        break;
-    case protocol::gatekeeper::e_fileSrvRequest:
-        ns = protocol::gatekeeper_fileSrvRequest::net_struct;
-        break;
-    case protocol::gatekeeper::e_authSrvRequest:
-        ns = protocol::gatekeeper_authSrvRequest::net_struct;
-        break;
-    default:
-        cli.logger().warning("{}: read_msg() sent unknown message {x}", sock.to_string(),
-                             header->get_type());
-        return false;
-    }
+    auto entry = s_messages.find(header->get_type());
+    if (!entry)
+        return handle_unknown(cli, sock, header->get_type());
 
     // Keep the same buffer as before but advance beyond the type field
-    cli.read(ns, 1, buf);
+    cli.read(entry->m_struct, 1, buf);
     return true;
 }
 
 bool theme::gatekeeper_server::read(theme::client& cli, theme::socket& sock,
-                                    std::unique_ptr<uint8_t[]>& buf)
+                                    theme::buffer_ptr_t& buf)
 {
     // The base classes take care of establishing encryption and reading complete messages
     // from the client off the wire ^_^
@@ -193,7 +208,7 @@ bool theme::gatekeeper_server::read(theme::client& cli, theme::socket& sock,
     }
 }
 
-void theme::gatekeeper_server::hup(theme::client& cli, theme::socket& sock)
+void theme::gatekeeper_server::hup(theme::client&, theme::socket& sock)
 {
     s_log.debug("{}: good-bye, cruel world!", sock.to_string());
     delete this;
@@ -17,9 +17,9 @@
 #ifndef __THEME_GATEKEEPER
 #define __THEME_GATEKEEPER
 
-#include <openssl/ossl_typ.h>
 #include <string>
-#include <tuple>
+
+#include "../io/uru_crypt.h"
 
 namespace theme
 {
@@ -28,8 +28,7 @@ namespace theme
         const class server* m_parent;
         std::u16string m_authsrv;
         std::u16string m_filesrv;
-        BIGNUM* m_cryptK;
-        BIGNUM* m_cryptN;
+        crypto_keys m_cryptKeys;
 
     public:
         gatekeeper_daemon() = delete;
@@ -49,9 +48,9 @@ namespace theme
             return m_filesrv;
         }
 
-        std::tuple<BIGNUM*, BIGNUM*> get_keys() const
+        const crypto_keys& get_keys() const
         {
-            return std::make_tuple(m_cryptK, m_cryptN);
+            return m_cryptKeys;
         };
     };
 };
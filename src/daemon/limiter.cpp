@@ -0,0 +1,159 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "limiter.h"
+#include "../core/errors.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <sys/socket.h>
+
+// =================================================================================
+
+enum
+{
+    e_unknown,
+    e_host4,
+    e_network4,
+    e_host6,
+    e_network6,
+};
+
+// Don't bother sweeping out idle accounts until there are at least this many.
+constexpr size_t kMinPruneSize = 1024;
+
+// =================================================================================
+
+theme::connection_limiter::connection_limiter(const limits& host, const limits& network)
+    : m_hostLimits(host), m_networkLimits(network), m_pruneAt(kMinPruneSize)
+{
+}
+
+// =================================================================================
+
+theme::connection_limiter::source theme::connection_limiter::get_source(const sockaddr_storage& addr)
+{
+    source result{};
+    switch (addr.ss_family) {
+    case AF_INET:
+        {
+            uint32_t ip = ntohl(((const sockaddr_in&)addr).sin_addr.s_addr);
+            result.m_host = { ip, e_host4 };
+            result.m_network = { ip & 0xFFFFFF00, e_network4 };
+        }
+        break;
+    case AF_INET6:
+        {
+            const uint8_t* ip = ((const sockaddr_in6&)addr).sin6_addr.s6_addr;
+            uint64_t prefix = 0;
+            for (size_t i = 0; i < 8; ++i)
+                prefix = (prefix << 8) | ip[i];
+            result.m_host = { prefix, e_host6 };
+            result.m_network = { prefix & 0xFFFFFFFFFFFF0000, e_network6 };
+        }
+        break;
+    default:
+        // Everything else gets lumped together.
+        result.m_host = { 0, e_unknown };
+        result.m_network = { 0, e_unknown };
+        break;
+    }
+    return result;
+}
+
+// =================================================================================
+
+void theme::connection_limiter::refill(account& acct, const limits& lim,
+                                       clock_t::time_point now) const
+{
+    std::chrono::duration<float> elapsed = now - acct.m_refilled;
+    acct.m_tokens = std::min(lim.burst(), acct.m_tokens + elapsed.count() * lim.m_rate);
+    acct.m_refilled = now;
+}
+
+bool theme::connection_limiter::charge(account& acct, const limits& lim,
+                                       clock_t::time_point now) const
+{
+    if (lim.m_maxConns != 0 && acct.m_active >= lim.m_maxConns)
+        return false;
+    if (lim.m_rate != 0) {
+        refill(acct, lim, now);
+        if (acct.m_tokens < 1.f)
+            return false;
+    }
+    return true;
+}
+
+bool theme::connection_limiter::admit(const source& src, clock_t::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // New accounts start out with a full bucket.
+    auto host = m_accounts.try_emplace(src.m_host, account{ 0, m_hostLimits.burst(), now }).first;
+    auto network = m_accounts.try_emplace(src.m_network,
+                                          account{ 0, m_networkLimits.burst(), now }).first;
+
+    // Check both before charging either, so that a rejection costs nothing.
+    bool result = charge(host->second, m_hostLimits, now) &&
+                  charge(network->second, m_networkLimits, now);
+    if (result) {
+        // Buckets without a rate never refill, so don't spend from them.
+        host->second.m_active++;
+        if (m_hostLimits.m_rate != 0)
+            host->second.m_tokens -= 1.f;
+        network->second.m_active++;
+        if (m_networkLimits.m_rate != 0)
+            network->second.m_tokens -= 1.f;
+    }
+
+    if (m_accounts.size() >= m_pruneAt)
+        prune(now);
+    return result;
+}
+
+void theme::connection_limiter::release(const source& src)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (const key& k : { src.m_host, src.m_network }) {
+        auto it = m_accounts.find(k);
+        THEME_ASSERTD(it != m_accounts.end() && it->second.m_active > 0);
+        if (it != m_accounts.end() && it->second.m_active > 0)
+            it->second.m_active--;
+    }
+}
+
+size_t theme::connection_limiter::size()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_accounts.size();
+}
+
+void theme::connection_limiter::prune(clock_t::time_point now)
+{
+    // An account with no connections and a full bucket is indistinguishable from a new one.
+    for (auto it = m_accounts.begin(); it != m_accounts.end();) {
+        const limits& lim = (it->first.m_kind == e_host4 || it->first.m_kind == e_host6)
+                          ? m_hostLimits : m_networkLimits;
+        refill(it->second, lim, now);
+        bool full = lim.m_rate == 0 || it->second.m_tokens >= lim.burst();
+        if (it->second.m_active == 0 && full)
+            it = m_accounts.erase(it);
+        else
+            ++it;
+    }
+    m_pruneAt = std::max(kMinPruneSize, m_accounts.size() * 2);
+}
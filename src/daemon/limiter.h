@@ -0,0 +1,128 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_LIMITER_H
+#define __THEME_LIMITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+struct sockaddr_storage;
+
+namespace theme
+{
+    /**
+     * Per-source connection accounting.
+     * Every connection is charged against its host (an IPv4 address or IPv6 /64) and its
+     * network (an IPv4 /24 or IPv6 /48). Each of those has a cap on concurrent connections and
+     * a token bucket limiting how quickly new ones may be opened. The table is shared by all of
+     * the reactors.
+     */
+    class connection_limiter
+    {
+    public:
+        struct limits
+        {
+            /** Concurrent connections allowed. 0 is unlimited. */
+            uint32_t m_maxConns;
+
+            /**
+             * New connections allowed per second, with bursts of up to m_maxConns (or one
+             * second's worth if that is unlimited). 0 is unlimited.
+             */
+            uint32_t m_rate;
+
+            /** The most tokens a bucket may hold. */
+            float burst() const
+            {
+                return (float)(m_maxConns ? m_maxConns : std::max<uint32_t>(m_rate, 1));
+            }
+        };
+
+        struct key
+        {
+            uint64_t m_prefix;
+            uint8_t m_kind;
+
+            bool operator==(const key& rhs) const
+            {
+                return m_prefix == rhs.m_prefix && m_kind == rhs.m_kind;
+            }
+        };
+
+        /** The accounts a connection is charged against. */
+        struct source
+        {
+            key m_host;
+            key m_network;
+        };
+
+        typedef std::chrono::steady_clock clock_t;
+
+    private:
+        struct key_hash
+        {
+            size_t operator()(const key& k) const
+            {
+                return std::hash<uint64_t>()(k.m_prefix) ^ k.m_kind;
+            }
+        };
+
+        struct account
+        {
+            uint32_t m_active;
+            float m_tokens;
+            clock_t::time_point m_refilled;
+        };
+
+        limits m_hostLimits;
+        limits m_networkLimits;
+
+        std::mutex m_lock;
+        std::unordered_map<key, account, key_hash> m_accounts;
+        size_t m_pruneAt;
+
+        bool charge(account& acct, const limits& lim, clock_t::time_point now) const;
+        void refill(account& acct, const limits& lim, clock_t::time_point now) const;
+        void prune(clock_t::time_point now);
+
+    public:
+        connection_limiter(const limits& host, const limits& network);
+        connection_limiter(const connection_limiter&) = delete;
+        connection_limiter(connection_limiter&&) = delete;
+
+    public:
+        /** Determines who a connection from \param addr should be charged to. */
+        static source get_source(const sockaddr_storage& addr);
+
+        /**
+         * Charges a new connection to its source.
+         * \return Returns false if the source is over one of its limits. Nothing is charged.
+         */
+        bool admit(const source& src, clock_t::time_point now=clock_t::now());
+
+        /** Returns a connection previously admitted. */
+        void release(const source& src);
+
+        /** Number of hosts and networks currently being tracked. */
+        size_t size();
+    };
+};
+
+#endif
@@ -0,0 +1,186 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics_endpoint.h"
+
+#include "../core/errors.h"
+#include "../core/metrics.h"
+
+// =================================================================================
+
+// Nobody sane sends a scrape request bigger than this.
+constexpr size_t kMaxRequestSize = 8 * 1024;
+
+// Scrapers are few and far between. Anything beyond this is probably up to no good.
+constexpr size_t kMaxConnections = 16;
+
+// =================================================================================
+
+theme::metrics_endpoint::metrics_endpoint()
+    : m_log("METRICS"), m_poll()
+{
+}
+
+theme::metrics_endpoint::~metrics_endpoint()
+{
+    if (m_poll) {
+        for (auto& it : m_connections)
+            m_poll->remove_fd(it.first);
+        m_poll->remove_fd(m_listenSock);
+    }
+}
+
+bool theme::metrics_endpoint::init(const char* addr, uint16_t port, theme::poll_dispatch* poll)
+{
+    if (!m_listenSock.bind(addr, port) || !m_listenSock.listen())
+        return false;
+    if (!poll->add_fd(m_listenSock, poll_dispatch::e_read, this))
+        return false;
+
+    m_poll = poll;
+    m_log.info("serving metrics on {}", m_listenSock.to_string());
+    return true;
+}
+
+// =================================================================================
+
+void theme::metrics_endpoint::accept_connections()
+{
+    for (;;) {
+        socket sock;
+        if (!m_listenSock.accept(sock))
+            return;
+
+        if (m_connections.size() >= kMaxConnections) {
+            m_log.warning("too many scrapers, dropping {}", sock.to_string());
+            continue;
+        }
+
+        int fd = sock;
+        constexpr uint32_t events = poll_dispatch::e_read | poll_dispatch::e_write | poll_dispatch::e_hup;
+        auto& conn = m_connections.emplace(fd, connection{ std::move(sock), {}, {}, 0 }).first->second;
+        if (!m_poll->add_fd(fd, (poll_dispatch::events)events, this)) {
+            m_connections.erase(fd);
+            continue;
+        }
+
+        // The request may well have arrived with the connection.
+        if (!pump(conn))
+            close(fd, true);
+    }
+}
+
+void theme::metrics_endpoint::handle_request(connection& conn)
+{
+    const char* status = "200 OK";
+    std::string body;
+    if (conn.m_request.compare(0, 13, "GET /metrics ") == 0 ||
+        conn.m_request.compare(0, 13, "GET /metrics?") == 0) {
+        body = metrics_registry::get().render();
+    } else if (conn.m_request.compare(0, 4, "GET ") == 0) {
+        status = "404 Not Found";
+        body = "Not Found\n";
+    } else {
+        status = "405 Method Not Allowed";
+        body = "Method Not Allowed\n";
+    }
+
+    conn.m_response = ST::format("HTTP/1.1 {}\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: {}\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n", status, body.size()).c_str();
+    conn.m_response.append(body);
+}
+
+bool theme::metrics_endpoint::pump(connection& conn)
+{
+    // Edge triggered, so everything has to be read or written until the socket would block.
+    while (conn.m_response.empty()) {
+        char buf[1024];
+        auto [ok, nread] = conn.m_socket.read(sizeof(buf), (uint8_t*)buf);
+        if (!ok)
+            return nread == 0;
+        if (nread == 0)
+            return false;
+
+        conn.m_request.append(buf, nread);
+        if (conn.m_request.find("\r\n\r\n") != std::string::npos)
+            handle_request(conn);
+        else if (conn.m_request.size() > kMaxRequestSize)
+            return false;
+    }
+
+    while (conn.m_sent < conn.m_response.size()) {
+        auto [ok, nwrite] = conn.m_socket.write(conn.m_response.size() - conn.m_sent,
+                                                (const uint8_t*)conn.m_response.data() + conn.m_sent);
+        if (!ok)
+            return nwrite == 0;
+        conn.m_sent += nwrite;
+    }
+    return false;
+}
+
+void theme::metrics_endpoint::close(int fd, bool polling)
+{
+    if (polling)
+        m_poll->remove_fd(fd);
+    m_connections.erase(fd);
+}
+
+void theme::metrics_endpoint::handle_events(int fd, uint32_t events)
+{
+    if (fd == m_listenSock) {
+        accept_connections();
+        return;
+    }
+
+    auto it = m_connections.find(fd);
+    THEME_ASSERTR(it != m_connections.end());
+
+    // A hang-up means the dispatcher has already forgotten about the fd.
+    if (events & poll_dispatch::e_hup)
+        close(fd, false);
+    else if (!pump(it->second))
+        close(fd, true);
+}
+
+// =================================================================================
+
+theme::latency_reporter::latency_reporter(theme::timer_wheel& timers,
+                                          std::chrono::milliseconds interval)
+    : m_log("LATENCY"), m_timers(timers), m_timer(this), m_interval(interval)
+{
+    m_timers.schedule(m_timer, m_interval);
+}
+
+void theme::latency_reporter::handle_timeout(theme::timer&)
+{
+    metrics_registry::get().for_each_latency([this](const latency_histogram& histogram) {
+        auto current = histogram.take_snapshot();
+        auto& previous = m_previous[&histogram];
+        auto interval = current - previous;
+        previous = std::move(current);
+        if (interval.m_count == 0)
+            return;
+
+        m_log.info("{} {}: n={} p50={}us p99={}us p999={}us max={}us", histogram.name(),
+                   histogram.labels() ? histogram.labels() : "", interval.m_count,
+                   interval.percentile(0.5), interval.percentile(0.99),
+                   interval.percentile(0.999), interval.max());
+    });
+    m_timers.schedule(m_timer, m_interval);
+}
@@ -0,0 +1,90 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_METRICS_ENDPOINT_H
+#define __THEME_METRICS_ENDPOINT_H
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+#include "../core/log.h"
+#include "../core/metrics.h"
+#include "../io/poll.h"
+#include "../io/socket.h"
+#include "../io/timer_wheel.h"
+
+namespace theme
+{
+    /**
+     * A tiny HTTP server that hands the metrics registry to Prometheus.
+     * It shares a reactor's dispatcher, so each scrape is rendered on that reactor's thread.
+     * Only `GET /metrics` is understood, and every connection is closed after one response.
+     */
+    class metrics_endpoint : public poll_handler
+    {
+        struct connection
+        {
+            socket m_socket;
+            std::string m_request;
+            std::string m_response;
+            size_t m_sent;
+        };
+
+        log m_log;
+        socket m_listenSock;
+        poll_dispatch* m_poll;
+        std::unordered_map<int, connection> m_connections;
+
+        void accept_connections();
+        void handle_request(connection& conn);
+
+        /** \return Returns false if the connection is finished, one way or another. */
+        bool pump(connection& conn);
+        void close(int fd, bool polling);
+
+    protected:
+        void handle_events(int fd, uint32_t events) override;
+
+    public:
+        metrics_endpoint();
+        metrics_endpoint(const metrics_endpoint&) = delete;
+        metrics_endpoint(metrics_endpoint&&) = delete;
+        ~metrics_endpoint();
+
+        bool init(const char* addr, uint16_t port, poll_dispatch* poll);
+    };
+
+    /** Periodically logs the percentiles of every latency_histogram over the last interval. */
+    class latency_reporter : public timer_handler
+    {
+        log m_log;
+        timer_wheel& m_timers;
+        timer m_timer;
+        std::chrono::milliseconds m_interval;
+        std::unordered_map<const latency_histogram*, latency_histogram::snapshot> m_previous;
+
+    protected:
+        void handle_timeout(timer& t) override;
+
+    public:
+        latency_reporter(timer_wheel& timers, std::chrono::milliseconds interval);
+        latency_reporter(const latency_reporter&) = delete;
+        latency_reporter(latency_reporter&&) = delete;
+    };
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reactor.h"
+#include "client.h"
+#include "server.h"
+
+#include "../core/errors.h"
+#include "../core/metrics.h"
+#include "../io/poll.h"
+
+#include <sys/socket.h>
+
+// =================================================================================
+
+static theme::counter s_acceptedConns{"theme_connections_accepted_total",
+                                      "Connections accepted from the listen sockets"};
+static theme::counter s_rejectedConns{"theme_connections_rejected_total",
+                                      "Connections closed at accept for exceeding a source limit"};
+
+// =================================================================================
+
+theme::reactor::reactor(theme::server* parent, size_t id)
+    : m_server(parent), m_id(id), m_log(ST::format("REACTOR{}", id)), m_acceptPending(),
+      m_acceptBudget(), m_deadlines()
+{
+}
+
+theme::reactor::~reactor()
+{
+    // Clients must go away before the dispatcher they are registered with.
+    m_clients.clear();
+}
+
+// =================================================================================
+
+bool theme::reactor::init(bool reuseport)
+{
+    const config_parser& config = m_server->config();
+
+    m_log.debug("Initializing listen socket...");
+    if (!m_listenSock.bind(config.get<const char*>("lobby", "bindaddr"),
+                           config.get<unsigned int>("lobby", "port"), reuseport))
+        return false;
+    if (!m_listenSock.listen())
+        return false;
+
+    const ST::string& backend_name = config.get<const ST::string&>("lobby", "poll_backend");
+    auto backend = poll_dispatch::backend::e_epoll;
+    if (backend_name.compare_i("io_uring") == 0)
+        backend = poll_dispatch::backend::e_uring;
+    else if (backend_name.compare_i("epoll") != 0)
+        m_log.warning("unknown lobby.poll_backend '{}', using epoll", backend_name);
+
+    m_deadlines.m_handshake = std::chrono::seconds(std::max(config.get<int>("lobby", "handshake_timeout"), 1));
+    m_deadlines.m_idle = std::chrono::seconds(std::max(config.get<int>("lobby", "idle_timeout"), 1));
+    m_deadlines.m_minRate = std::max(config.get<int>("lobby", "min_rate"), 0);
+
+    m_acceptBudget = std::max(config.get<int>("lobby", "accept_batch"), 1);
+
+    int batch = config.get<int>("lobby", "poll_batch");
+    m_poll = poll_dispatch::create(backend, std::max(batch, 1));
+    THEME_ASSERTR(m_poll->add_fd(m_listenSock, poll_dispatch::e_read, this));
+    THEME_ASSERTR(m_cryptoQueue.attach(m_poll.get()));
+
+    m_log.debug("Reactor FDs successfully initialized!");
+    return true;
+}
+
+void theme::reactor::run()
+{
+    // Run until we are nuked by a signal. Wake up in time for the next deadline so that stalled
+    // clients get reaped in bulk rather than hanging on to their fds forever. New connections
+    // are accepted after the established clients have been serviced, and if the backlog isn't
+    // drained, the next wait only polls so that we can get back to it. Keystream for everyone
+    // who was serviced is generated once all of their replies have gone out.
+    do {
+        m_poll->dispatch(m_acceptPending ? 0 : m_timers.next_timeout(30000));
+        m_keystreams.run();
+        m_timers.advance();
+        if (m_acceptPending)
+            accept_clients();
+    } while (m_server->active());
+}
+
+void theme::reactor::start()
+{
+    m_thread = std::thread(&reactor::run, this);
+}
+
+void theme::reactor::join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+// =================================================================================
+
+void theme::reactor::handle_events(int, uint32_t events)
+{
+    if (!(events & poll_dispatch::e_read)) {
+        m_log.warning("WTF?!?! got polled with nothing to accept?!");
+        return;
+    }
+
+    m_acceptPending = true;
+}
+
+void theme::reactor::accept_clients()
+{
+    connection_limiter& limiter = m_server->limiter();
+    for (size_t i = 0; i < m_acceptBudget; ++i) {
+        socket sock;
+        sockaddr_storage addr;
+        if (!m_listenSock.accept(sock, &addr)) {
+            m_acceptPending = false;
+            return;
+        }
+
+        // Turn away abusive sources before spending anything on them. The socket closes when it
+        // goes out of scope.
+        auto source = connection_limiter::get_source(addr);
+        if (!limiter.admit(source)) {
+            m_log.debug("rejecting connection from {}: over limit", sock.to_string());
+            s_rejectedConns.inc();
+            continue;
+        }
+
+        m_log.debug("incoming connection from {}", sock.to_string());
+        s_acceptedConns.inc();
+        auto [handle, client] = m_clients.emplace(sock, source, this);
+        client->m_handle = handle;
+    }
+}
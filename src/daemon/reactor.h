@@ -0,0 +1,131 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_REACTOR_H
+#define __THEME_REACTOR_H
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "../core/log.h"
+#include "../core/slab.h"
+#include "../io/buffer_pool.h"
+#include "../io/crypto_pool.h"
+#include "../io/poll.h"
+#include "../io/rc4.h"
+#include "../io/socket.h"
+#include "../io/timer_wheel.h"
+
+namespace theme
+{
+    class client;
+    class server;
+
+    /** How long clients get to hold a connection without making progress. */
+    struct client_deadlines
+    {
+        /** Time allowed for the connection header, and then again for the encryption handshake. */
+        std::chrono::milliseconds m_handshake;
+
+        /** Time allowed for each message once the connection is established. */
+        std::chrono::milliseconds m_idle;
+
+        /** Every this many bytes received buys the client another second. 0 disables. */
+        uint32_t m_minRate;
+    };
+
+    /**
+     * An independent event loop with its own listen socket, dispatcher, and clients.
+     * When the server runs more than one reactor, each listen socket is bound with SO_REUSEPORT
+     * so that the kernel shards incoming connections across them.
+     */
+    class reactor : public poll_handler
+    {
+        class server* m_server;
+        size_t m_id;
+        log m_log;
+
+        socket m_listenSock;
+
+        /**
+         * Connections still waiting in the listen backlog. The listen socket is edge triggered, so
+         * once an accept batch runs out of budget, nothing will tell us about these again.
+         */
+        bool m_acceptPending;
+        size_t m_acceptBudget;
+
+        /** Outlives the dispatcher, which may still hold buffers for sends in flight. */
+        buffer_pool m_buffers;
+
+        std::unique_ptr<poll_dispatch> m_poll;
+        crypto_pool::completion_queue m_cryptoQueue;
+        timer_wheel m_timers;
+        client_deadlines m_deadlines;
+        rc4_batch m_keystreams;
+        slab<client> m_clients;
+        std::thread m_thread;
+
+    public:
+        reactor() = delete;
+        reactor(const reactor&) = delete;
+        reactor(reactor&&) = delete;
+
+        reactor(class server* parent, size_t id);
+        ~reactor();
+
+    public:
+        slab<client>& clients() { return m_clients; }
+        const slab<client>& clients() const { return m_clients; }
+
+        size_t id() const { return m_id; }
+
+        crypto_pool::completion_queue& crypto_queue() { return m_cryptoQueue; }
+
+        buffer_pool& buffers() { return m_buffers; }
+        const buffer_pool& buffers() const { return m_buffers; }
+
+        timer_wheel& timers() { return m_timers; }
+        const client_deadlines& deadlines() const { return m_deadlines; }
+
+        /** Client ciphers that are refilled together after each dispatch pass. */
+        rc4_batch& keystreams() { return m_keystreams; }
+
+        poll_dispatch* poll() { return m_poll.get(); }
+        const poll_dispatch* poll() const { return m_poll.get(); }
+
+        class server* server() { return m_server; }
+        const class server* server() const { return m_server; }
+
+    public:
+        bool init(bool reuseport);
+
+        /** Runs the event loop on the calling thread until the server is deactivated. */
+        void run();
+
+        /** Runs the event loop on a new thread. */
+        void start();
+        void join();
+
+    protected:
+        /** Accepts at most one batch of connections from the listen backlog. */
+        void accept_clients();
+
+        void handle_events(int fd, uint32_t events) override;
+    };
+};
+
+#endif
@@ -15,11 +15,14 @@
  */
 
 #include "server.h"
-#include "client.h"
 #include "gatekeeper.h"
+#include "metrics_endpoint.h"
+#include "reactor.h"
 
 #include "../core/errors.h"
-#include "../io/poll.h"
+#include "../core/log_sink.h"
+#include "../io/capture.h"
+#include "../io/client_base.h"
 
 #include <fstream>
 #include <iostream>
@@ -40,6 +43,138 @@ theme::config_item s_daemonConfig[] = {
                      "Lobby Bind Port\n"
                      "Port that this THEME server should listen for connections on")
 
+    THEME_CONFIG_INT("lobby", "threads", 1,
+                     "Lobby Reactor Threads\n"
+                     "Number of independent event loops to run. Each one has its own listen socket "
+                     "(using SO_REUSEPORT), so incoming connections are spread across CPU cores.")
+
+    THEME_CONFIG_INT("lobby", "crypto_threads", 2,
+                     "Lobby Crypto Threads\n"
+                     "Number of worker threads that compute encryption handshakes so that the "
+                     "reactors can keep serving other clients. 0 computes them on the reactor.")
+
+    THEME_CONFIG_INT("lobby", "handshake_timeout", 10,
+                     "Lobby Handshake Timeout\n"
+                     "Seconds a client gets to send its connection header, and then again to "
+                     "complete the encryption handshake, before it is disconnected.")
+
+    THEME_CONFIG_INT("lobby", "idle_timeout", 60,
+                     "Lobby Idle Timeout\n"
+                     "Seconds an established client gets to send each message before it is "
+                     "disconnected.")
+
+    THEME_CONFIG_INT("lobby", "min_rate", 64,
+                     "Lobby Minimum Byte Rate\n"
+                     "Slow clients earn one more second before their timeout for each this many "
+                     "bytes they send. 0 disables the allowance.")
+
+    THEME_CONFIG_STR("lobby", "poll_backend", "epoll",
+                     "Lobby Poll Backend\n"
+                     "Either epoll or io_uring. With io_uring, the kernel receives client data "
+                     "into a shared ring of buffers and sends replies itself, instead of the "
+                     "reactor reading and writing each socket when it becomes ready. Kernels "
+                     "without multishot receives (older than 6.0) only get readiness polls "
+                     "batched into the wait, and kernels without multishot polls (older than "
+                     "5.13) fall back to epoll.")
+
+    THEME_CONFIG_INT("lobby", "poll_batch", 1024,
+                     "Lobby Poll Batch Size\n"
+                     "Maximum number of socket events each reactor collects per wait. Reactors "
+                     "start with a small batch and grow it only when waits keep coming back full.")
+
+    THEME_CONFIG_INT("lobby", "accept_batch", 64,
+                     "Lobby Accept Batch Size\n"
+                     "Maximum number of connections each reactor accepts between servicing its "
+                     "established clients.")
+
+    THEME_CONFIG_INT("lobby", "max_conns_per_ip", 16,
+                     "Lobby Connections per Host\n"
+                     "Maximum number of simultaneous connections from a single IPv4 address or "
+                     "IPv6 /64. 0 is unlimited.")
+
+    THEME_CONFIG_INT("lobby", "max_conns_per_net", 64,
+                     "Lobby Connections per Network\n"
+                     "Maximum number of simultaneous connections from a single IPv4 /24 or "
+                     "IPv6 /48. 0 is unlimited.")
+
+    THEME_CONFIG_INT("lobby", "conn_rate_per_ip", 5,
+                     "Lobby Connection Rate per Host\n"
+                     "New connections accepted from a single host each second. Hosts may burst "
+                     "up to their connection limit, or one second's worth if that is unlimited. "
+                     "0 is unlimited. Together with max_conns_per_ip, the defaults will throttle "
+                     "load tests (such as theme_loadgen) run from a single machine, so raise or "
+                     "disable both for those.")
+
+    THEME_CONFIG_INT("lobby", "conn_rate_per_net", 20,
+                     "Lobby Connection Rate per Network\n"
+                     "New connections accepted from a single network each second. Networks may "
+                     "burst up to their connection limit, or one second's worth if that is "
+                     "unlimited. 0 is unlimited.")
+
+    THEME_CONFIG_BOOL("log", "async", true,
+                      "Asynchronous Logging\n"
+                      "Hand log lines to a background writer instead of writing them on the "
+                      "reactor threads. Lines are dropped, and counted, if the writer falls behind.")
+
+    THEME_CONFIG_BOOL("log", "deferred", true,
+                      "Deferred Log Formatting\n"
+                      "Record the arguments of asynchronous log lines and format them on the "
+                      "background writer.")
+
+    THEME_CONFIG_BOOL("log", "console", true,
+                      "Console Logging\n"
+                      "Write asynchronous log output to stdout.")
+
+    THEME_CONFIG_STR("log", "path", "",
+                     "Log File\n"
+                     "Asynchronous log output is copied into this file as well as stdout.")
+
+    THEME_CONFIG_STR("log", "format", "text",
+                     "Log File Format\n"
+                     "Either text or binary. Binary log files skip formatting deferred lines "
+                     "entirely and must be read with theme_logdecode.")
+
+    THEME_CONFIG_INT("log", "max_size", 64,
+                     "Log File Size\n"
+                     "Size, in MiB, at which the log file is rotated. 0 disables rotation.")
+
+    THEME_CONFIG_INT("log", "max_files", 5,
+                     "Log File Count\n"
+                     "Number of rotated log files to keep.")
+
+    THEME_CONFIG_INT("log", "queue_size", 8192,
+                     "Log Queue Size\n"
+                     "Number of lines that may be waiting for the background writer.")
+
+    THEME_CONFIG_STR("metrics", "bindaddr", "127.0.0.1",
+                     "Metrics Bind Address\n"
+                     "Address to serve Prometheus metrics on. Keep this on loopback unless the "
+                     "scraper is trusted.")
+
+    THEME_CONFIG_INT("metrics", "port", 14618,
+                     "Metrics Port\n"
+                     "Port to serve Prometheus metrics on, at /metrics. 0 disables the endpoint.")
+
+    THEME_CONFIG_INT("metrics", "latency_report", 300,
+                     "Latency Report Interval\n"
+                     "Seconds between logging reply and handshake latency percentiles. "
+                     "0 disables the report.")
+
+    THEME_CONFIG_STR("capture", "path", "",
+                     "Traffic Capture File\n"
+                     "Record every client's decrypted messages into this file so that they can be "
+                     "played back with theme_replay. Captures hold the traffic in the clear, so "
+                     "treat them with care. Empty disables capturing.")
+
+    THEME_CONFIG_INT("capture", "max_size", 1024,
+                     "Traffic Capture Size\n"
+                     "Size, in MiB, at which the capture stops. 0 is unlimited.")
+
+    THEME_CONFIG_INT("capture", "queue_size", 16,
+                     "Traffic Capture Queue Size\n"
+                     "MiB of messages that may be waiting for the capture writer. Connections are "
+                     "dropped from the capture if the writer falls behind.")
+
     THEME_CONFIG_STR("gate", "crypt_k", "", "Private Key")
     THEME_CONFIG_STR("gate", "crypt_n", "", "Public Key")
     THEME_CONFIG_STR("gate", "crypt_x", "", "Shared Key")
@@ -60,7 +195,7 @@ theme::config_item s_daemonConfig[] = {
 // =================================================================================
 
 theme::server::server(const std::filesystem::path& config)
-    : m_config(s_daemonConfig), m_log("LOBBY"), m_listenSock(), m_active(true)
+    : m_config(s_daemonConfig), m_log("LOBBY"), m_active(true)
 {
     m_config.read(config);
 
@@ -71,6 +206,17 @@ theme::server::server(const std::filesystem::path& config)
 theme::server::~server()
 {
     // needed due to incomplete types
+    // Workers post to the reactors, and clients reference the daemons, so tear down
+    // in that order. Clients still waiting on a key cancel their job as they go away, so the
+    // pool's queue has to outlive them.
+    if (m_cryptoPool)
+        m_cryptoPool->stop();
+    m_metrics.reset();
+    m_latencyReporter.reset();
+    m_reactors.clear();
+    m_cryptoPool.reset();
+    client_base::stop_capture();
+    log::stop_async();
 }
 
 // =================================================================================
@@ -109,58 +255,103 @@ void theme::server::generate_daemon_keys()
 
 bool theme::server::run()
 {
-    if (!init_fds())
-        return false;
+    if (m_config.get<bool>("log", "async")) {
+        log_sink::options opts;
+        opts.m_path = m_config.get<const ST::string&>("log", "path").c_str();
+        opts.m_maxFileSize = (size_t)std::max(m_config.get<int>("log", "max_size"), 0) * 1024 * 1024;
+        opts.m_maxFiles = std::max(m_config.get<int>("log", "max_files"), 0);
+        opts.m_capacity = std::max(m_config.get<int>("log", "queue_size"), 1);
+        opts.m_console = m_config.get<bool>("log", "console");
+
+        const ST::string& format = m_config.get<const ST::string&>("log", "format");
+        opts.m_binary = format.compare_i("binary") == 0;
+        if (!opts.m_binary && format.compare_i("text") != 0)
+            m_log.warning("unknown log.format '{}', using text", format);
+
+        log::start_async(std::make_unique<log_sink>(std::move(opts)));
+        log::set_deferred(m_config.get<bool>("log", "deferred"));
+    }
+
+    const ST::string& capture = m_config.get<const ST::string&>("capture", "path");
+    if (!capture.empty()) {
+        capture_sink::options opts;
+        opts.m_path = capture.c_str();
+        opts.m_maxFileSize = (size_t)std::max(m_config.get<int>("capture", "max_size"), 0) * 1024 * 1024;
+        opts.m_capacity = (size_t)std::max(m_config.get<int>("capture", "queue_size"), 1) * 1024 * 1024;
+
+        auto sink = std::make_unique<capture_sink>(std::move(opts));
+        if (!sink->is_open())
+            return false;
+        client_base::start_capture(std::move(sink));
+    }
+
     if (!init_servers())
         return false;
+    if (!init_reactors())
+        return false;
+    if (!init_metrics())
+        return false;
 
-    // Run until we are nuked by a signal
-    do {
-        // todo: defeat slowloris
-        m_poll->dispatch();
-    } while(m_active);
+    // The first reactor runs on the main thread; any others get a thread of their own.
+    for (size_t i = 1; i < m_reactors.size(); ++i)
+        m_reactors[i]->start();
+    m_reactors.front()->run();
+    for (size_t i = 1; i < m_reactors.size(); ++i)
+        m_reactors[i]->join();
 
     return true;
 }
 
-bool theme::server::init_fds()
+bool theme::server::init_reactors()
 {
-    m_log.debug("Initializing listen socket...");
-    if (!m_listenSock.bind(m_config.get<const char*>("lobby", "bindaddr"),
-                           m_config.get<unsigned int>("lobby", "port")))
-        return false;
-    if (!m_listenSock.listen())
-        return false;
+    int threads = m_config.get<int>("lobby", "threads");
+    if (threads < 1) {
+        m_log.warning("lobby.threads must be at least 1 (got {}), using 1", threads);
+        threads = 1;
+    }
 
-    m_poll = poll_dispatch::create();
-    THEME_ASSERTR(m_poll->add_fd(m_listenSock, poll_dispatch::e_read,
-                                 std::bind(&server::accept_cb, this,
-                                           std::placeholders::_1,
-                                           std::placeholders::_2)));
+    auto get_limit = [this](const char* key) {
+        return (uint32_t)std::max(m_config.get<int>("lobby", key), 0);
+    };
+    connection_limiter::limits host{ get_limit("max_conns_per_ip"), get_limit("conn_rate_per_ip") };
+    connection_limiter::limits network{ get_limit("max_conns_per_net"), get_limit("conn_rate_per_net") };
+    m_limiter = std::make_unique<connection_limiter>(host, network);
+
+    m_log.debug("Initializing {} reactor(s)...", threads);
+    m_reactors.reserve(threads);
+    for (int i = 0; i < threads; ++i) {
+        auto& r = m_reactors.emplace_back(std::make_unique<reactor>(this, i));
+        if (!r->init(threads > 1))
+            return false;
+    }
 
     m_log.debug("Daemon FDs successfully initialized!");
     return true;
 }
 
-void theme::server::accept_cb(int fd, uint32_t events)
+bool theme::server::init_metrics()
 {
-    if (!(events & poll_dispatch::e_read)) {
-        m_log.warning("WTF?!?! got polled with nothing to accept?!");
-        return;
+    int interval = m_config.get<int>("metrics", "latency_report");
+    if (interval > 0) {
+        m_latencyReporter = std::make_unique<latency_reporter>(m_reactors.front()->timers(),
+                                                               std::chrono::seconds(interval));
     }
 
-    socket sock;
-    while (m_listenSock.accept(sock)) {
-        m_log.debug("incoming connection from {}", sock.to_string());
-        auto& client = m_clients.emplace_back(sock, this);
-        client.m_iterator = m_clients.end();
-        // WTF?! No operator-, only operator--
-        --client.m_iterator;
-    }
+    int port = m_config.get<int>("metrics", "port");
+    if (port <= 0)
+        return true;
+
+    // Scrapes are rare, so the first reactor can take care of them.
+    m_metrics = std::make_unique<metrics_endpoint>();
+    return m_metrics->init(m_config.get<const char*>("metrics", "bindaddr"), (uint16_t)port,
+                           m_reactors.front()->poll());
 }
 
 bool theme::server::init_servers()
 {
+    int threads = m_config.get<int>("lobby", "crypto_threads");
+    m_cryptoPool = std::make_unique<crypto_pool>(m_crypt, std::max(threads, 0));
+
     m_gatekeeperSrv = std::make_unique<gatekeeper_daemon>(this);
     return true;
 }
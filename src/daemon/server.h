@@ -17,20 +17,23 @@
 #ifndef __THEME_SERVER_H
 #define __THEME_SERVER_H
 
+#include <atomic>
 #include <filesystem>
-#include <list>
 #include <memory>
+#include <vector>
 
 #include "../core/config_parser.h"
 #include "../core/log.h"
-#include "../io/socket.h"
+#include "../io/crypto_pool.h"
 #include "../io/uru_crypt.h"
+#include "limiter.h"
 
 namespace theme
 {
-    class client;
     class gatekeeper_daemon;
-    class poll_dispatch;
+    class latency_reporter;
+    class metrics_endpoint;
+    class reactor;
 
     class server
     {
@@ -38,10 +41,12 @@ namespace theme
         ::theme::crypto m_crypt;
         log m_log;
 
-        socket m_listenSock;
-        std::unique_ptr<poll_dispatch> m_poll;
-        std::list<client> m_clients;
-        bool m_active;
+        std::unique_ptr<crypto_pool> m_cryptoPool;
+        std::unique_ptr<connection_limiter> m_limiter;
+        std::vector<std::unique_ptr<reactor>> m_reactors;
+        std::unique_ptr<metrics_endpoint> m_metrics;
+        std::unique_ptr<latency_reporter> m_latencyReporter;
+        std::atomic<bool> m_active;
 
         std::unique_ptr<gatekeeper_daemon> m_gatekeeperSrv;
 
@@ -54,19 +59,19 @@ namespace theme
         ~server();
 
     public:
-        std::list<client>& clients() { return m_clients; }
-        const std::list<client>& clients() const { return m_clients; }
-
         config_parser& config() { return m_config; }
         const config_parser& config() const { return m_config; }
 
         ::theme::crypto& cypto() { return m_crypt; }
         const ::theme::crypto& crypto() const { return m_crypt; }
 
+        crypto_pool& crypto_workers() const { return *m_cryptoPool; }
+
+        connection_limiter& limiter() const { return *m_limiter; }
+
         gatekeeper_daemon* gatekeeper() const { return m_gatekeeperSrv.get(); }
 
-        poll_dispatch* poll() { return m_poll.get(); }
-        const poll_dispatch* poll() const { return m_poll.get(); }
+        bool active() const { return m_active.load(std::memory_order_relaxed); }
 
     public:
         void generate_client_ini(const std::filesystem::path& path) const;
@@ -76,10 +81,9 @@ namespace theme
         bool run();
 
     protected:
-        bool init_fds();
+        bool init_reactors();
+        bool init_metrics();
         bool init_servers();
-
-        void accept_cb(int fd, uint32_t events);
     };
 };
 
@@ -0,0 +1,96 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "buffer_pool.h"
+
+#include <algorithm>
+
+// =================================================================================
+
+// Don't hoard more than this many bytes in any single size class.
+constexpr size_t kMaxCachedBytes = 256 * 1024;
+
+// =================================================================================
+
+static inline size_t _size_class(size_t size)
+{
+    const auto& classes = theme::buffer_pool::kSizeClasses;
+    return std::lower_bound(std::begin(classes), std::end(classes), size) - std::begin(classes);
+}
+
+// =================================================================================
+
+void theme::buffer_deleter::operator()(uint8_t* buf) const
+{
+    if (m_pool)
+        m_pool->release(buf, m_capacity);
+    else
+        delete[] buf;
+}
+
+// =================================================================================
+
+theme::buffer_pool::~buffer_pool()
+{
+    for (auto& freelist : m_free) {
+        for (uint8_t* buf : freelist)
+            delete[] buf;
+    }
+}
+
+// =================================================================================
+
+theme::buffer_ptr_t theme::buffer_pool::alloc(size_t size)
+{
+    size_t idx = _size_class(size);
+    if (idx == kNumSizeClasses) {
+        // Too big to pool -- this should be rare.
+        m_misses++;
+        return buffer_ptr_t(new uint8_t[size], { nullptr, size });
+    }
+
+    size_t capacity = kSizeClasses[idx];
+    auto& freelist = m_free[idx];
+    if (freelist.empty()) {
+        m_misses++;
+        return buffer_ptr_t(new uint8_t[capacity], { this, capacity });
+    }
+
+    m_hits++;
+    uint8_t* buf = freelist.back();
+    freelist.pop_back();
+    return buffer_ptr_t(buf, { this, capacity });
+}
+
+void theme::buffer_pool::release(uint8_t* buf, size_t capacity)
+{
+    size_t idx = _size_class(capacity);
+    auto& freelist = m_free[idx];
+    if (freelist.size() * capacity >= kMaxCachedBytes)
+        delete[] buf;
+    else
+        freelist.push_back(buf);
+}
+
+// =================================================================================
+
+theme::buffer_pool::stats theme::buffer_pool::get_stats() const
+{
+    stats result{ m_hits, m_misses, 0 };
+    for (const auto& freelist : m_free)
+        result.m_cached += freelist.size();
+    return result;
+}
@@ -0,0 +1,90 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IO_BUFFER_POOL_H
+#define __IO_BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace theme
+{
+    class buffer_pool;
+
+    /** Hands a buffer back to the pool it came from. */
+    struct buffer_deleter final
+    {
+        buffer_pool* m_pool;
+        size_t m_capacity;
+
+        void operator()(uint8_t* buf) const;
+    };
+
+    typedef std::unique_ptr<uint8_t[], buffer_deleter> buffer_ptr_t;
+
+    /**
+     * Size-classed free lists for message buffers.
+     * Each reactor owns one of these, so it is deliberately NOT thread safe. Buffers must be
+     * released on the thread that allocated them.
+     */
+    class buffer_pool
+    {
+    public:
+        static constexpr size_t kSizeClasses[] = { 64, 256, 1024, 4096, 16384 };
+        static constexpr size_t kNumSizeClasses = std::size(kSizeClasses);
+
+        struct stats
+        {
+            /** Allocations served from a free list. */
+            uint64_t m_hits;
+
+            /** Allocations that had to go to the heap, including oversized ones. */
+            uint64_t m_misses;
+
+            /** Buffers currently held in the free lists. */
+            size_t m_cached;
+        };
+
+    private:
+        std::vector<uint8_t*> m_free[kNumSizeClasses];
+        uint64_t m_hits;
+        uint64_t m_misses;
+
+        friend struct buffer_deleter;
+        void release(uint8_t* buf, size_t capacity);
+
+    public:
+        buffer_pool()
+            : m_hits(), m_misses()
+        { }
+        buffer_pool(const buffer_pool&) = delete;
+        buffer_pool(buffer_pool&&) = delete;
+        ~buffer_pool();
+
+        /**
+         * Allocates a buffer of at least \param size bytes.
+         * \note The contents are NOT zeroed.
+         */
+        buffer_ptr_t alloc(size_t size);
+
+        stats get_stats() const;
+    };
+};
+
+#endif
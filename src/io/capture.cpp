@@ -0,0 +1,175 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "capture.h"
+
+#include "../core/log.h"
+#include "../core/metrics.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// =================================================================================
+
+static theme::log s_log{"CAPTURE"};
+
+static theme::counter s_capturedBytes{"theme_capture_bytes_total",
+                                      "Bytes written to the traffic capture file"};
+static theme::counter s_droppedFrames{"theme_capture_frames_dropped_total",
+                                      "Capture frames thrown away because the writer fell behind "
+                                      "or the file is full"};
+
+// The writer wakes up this often to write out whatever has been captured.
+constexpr auto kFlushInterval = std::chrono::milliseconds(50);
+
+// =================================================================================
+
+theme::capture_sink::capture_sink(options opts)
+    : m_options(std::move(opts)), m_start(std::chrono::steady_clock::now()), m_nextConn(),
+      m_full(), m_running(true), m_fd(-1), m_filesz()
+{
+    m_pending.reserve(m_options.m_capacity);
+    if (!open_file())
+        m_full.store(true, std::memory_order_relaxed);
+    m_thread = std::thread(&capture_sink::run, this);
+}
+
+theme::capture_sink::~capture_sink()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_running = false;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+
+    if (m_fd != -1)
+        close(m_fd);
+}
+
+// =================================================================================
+
+bool theme::capture_sink::open_file()
+{
+    m_fd = ::open(m_options.m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (m_fd == -1) {
+        s_log.error("unable to open capture file '{}': {}", m_options.m_path.c_str(),
+                    strerror(errno));
+        return false;
+    }
+
+    std::string header(capture_file::kMagic, sizeof(capture_file::kMagic));
+    header.append((const char*)&capture_file::kVersion, sizeof(capture_file::kVersion));
+    ssize_t nwrite = ::write(m_fd, header.data(), header.size());
+    if (nwrite > 0)
+        m_filesz += nwrite;
+
+    s_log.info("capturing client traffic to '{}'", m_options.m_path.c_str());
+    return true;
+}
+
+void theme::capture_sink::run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (;;) {
+        if (m_pending.empty()) {
+            if (!m_running)
+                break;
+            m_wake.wait_for(lock, kFlushInterval);
+            continue;
+        }
+
+        // Let the reactors keep appending while we're stuck in the write.
+        m_writing.swap(m_pending);
+        lock.unlock();
+        write_out();
+        lock.lock();
+    }
+}
+
+void theme::capture_sink::write_out()
+{
+    const char* buf = m_writing.data();
+    size_t bufsz = m_writing.size();
+    while (bufsz > 0 && m_fd != -1) {
+        ssize_t nwrite = ::write(m_fd, buf, bufsz);
+        if (nwrite < 0) {
+            if (errno == EINTR)
+                continue;
+            s_log.error("capture file write failed, no longer capturing: {}", strerror(errno));
+            close(m_fd);
+            m_fd = -1;
+            m_full.store(true, std::memory_order_relaxed);
+            break;
+        }
+
+        buf += nwrite;
+        bufsz -= nwrite;
+        m_filesz += nwrite;
+        s_capturedBytes.inc(nwrite);
+    }
+    m_writing.clear();
+
+    if (m_options.m_maxFileSize != 0 && m_filesz >= m_options.m_maxFileSize &&
+        !m_full.exchange(true, std::memory_order_relaxed)) {
+        s_log.warning("capture file reached {} bytes, no longer capturing", m_filesz);
+    }
+}
+
+// =================================================================================
+
+uint32_t theme::capture_sink::open_connection()
+{
+    uint32_t conn = m_nextConn.fetch_add(1, std::memory_order_relaxed) + 1;
+    return push(capture_file::e_open, conn, std::chrono::steady_clock::now()) ? conn : 0;
+}
+
+bool theme::capture_sink::push(capture_file::frame_type type, uint32_t conn,
+                               std::chrono::steady_clock::time_point when,
+                               const uint8_t* data, size_t datasz)
+{
+    if (m_full.load(std::memory_order_relaxed)) {
+        s_droppedFrames.inc();
+        return false;
+    }
+
+    capture_file::frame_header header{};
+    header.m_type = type;
+    header.m_conn = conn;
+    header.m_datasz = (uint32_t)datasz;
+    header.m_time = std::chrono::duration_cast<std::chrono::microseconds>(when - m_start).count();
+
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_pending.size() + sizeof(header) + datasz > m_options.m_capacity) {
+            s_droppedFrames.inc();
+            return false;
+        }
+
+        m_pending.append((const char*)&header, sizeof(header));
+        if (datasz != 0)
+            m_pending.append((const char*)data, datasz);
+
+        // The writer comes around often enough on its own unless we're filling up fast.
+        wake = m_pending.size() >= m_options.m_capacity / 2;
+    }
+    if (wake)
+        m_wake.notify_one();
+    return true;
+}
@@ -0,0 +1,140 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IO_CAPTURE_H
+#define __IO_CAPTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace theme
+{
+    namespace capture_file
+    {
+        /** Capture files start with this, followed by a uint32_t version. */
+        constexpr char kMagic[8] = { 'T', 'H', 'E', 'M', 'E', 'C', 'A', 'P' };
+        constexpr uint32_t kVersion = 1;
+
+        enum frame_type : uint8_t
+        {
+            /** A client connected. There is no data. */
+            e_open,
+
+            /** A complete message from the client. The data is its decrypted wire bytes. */
+            e_message,
+
+            /** The server switched on encryption. Later messages were encrypted on the wire. */
+            e_encrypted,
+
+            /** The client went away. There is no data. */
+            e_close,
+        };
+
+        /**
+         * Each frame is this header followed by m_datasz bytes of data.
+         * Frames are only roughly in time order across connections, but always in order within
+         * a connection.
+         */
+        struct frame_header
+        {
+            uint8_t m_type;
+            uint8_t m_reserved[3];
+            uint32_t m_conn;
+
+            /** Microseconds since the capture started. */
+            int64_t m_time;
+            uint32_t m_datasz;
+            uint32_t m_reserved2;
+        };
+        static_assert(sizeof(frame_header) == 24);
+    };
+
+    /**
+     * Records what clients send into a capture file for theme_replay.
+     * Frames from every reactor are appended to a shared queue and written out by a background
+     * thread. When the queue is full, or the file has reached its maximum size, frames are
+     * counted and thrown away rather than blocking the caller.
+     */
+    class capture_sink
+    {
+    public:
+        struct options
+        {
+            std::filesystem::path m_path;
+
+            /** Stop capturing once the file reaches this many bytes. 0 is unlimited. */
+            size_t m_maxFileSize;
+
+            /** Bytes of frames that may be waiting for the writer. */
+            size_t m_capacity;
+        };
+
+    private:
+        options m_options;
+        std::chrono::steady_clock::time_point m_start;
+        std::atomic<uint32_t> m_nextConn;
+        std::atomic<bool> m_full;
+
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        std::string m_pending;
+        bool m_running;
+        std::thread m_thread;
+
+        int m_fd;
+        size_t m_filesz;
+        std::string m_writing;
+
+    private:
+        bool open_file();
+        void run();
+        void write_out();
+
+    public:
+        capture_sink(options opts);
+        capture_sink(const capture_sink&) = delete;
+        capture_sink(capture_sink&&) = delete;
+
+        /** Writes out everything that has been pushed before returning. */
+        ~capture_sink();
+
+    public:
+        bool is_open() const { return m_fd != -1; }
+
+        /**
+         * Starts capturing a new connection.
+         * \return Returns the connection's ID in the capture, or 0 if it can't be captured.
+         */
+        uint32_t open_connection();
+
+        /**
+         * Queues a frame for the writer.
+         * \return Returns false if the frame was dropped, in which case the rest of the
+         *         connection should not be captured either.
+         */
+        bool push(capture_file::frame_type type, uint32_t conn,
+                  std::chrono::steady_clock::time_point when, const uint8_t* data=nullptr,
+                  size_t datasz=0);
+    };
+};
+
+#endif
@@ -15,14 +15,19 @@
  */
 
 #include "client_base.h"
+#include "capture.h"
+#include "poll.h"
 #include "theme_config.h"
 
 #include "../core/errors.h"
 #include "../core/log.h"
+#include "../core/metrics.h"
 #include "../protocol/common.h"
 
-#include <openssl/evp.h>
+#include <atomic>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unordered_map>
 
 // =================================================================================
 
@@ -31,36 +36,111 @@ theme::log theme::client_base::s_log{"CLIENT"};
 // Die if the client tries to send more than this many elements in a buffer.
 constexpr size_t kMaxBufCount = 1024;
 
-// Maximum buffer size we can allocate on the stack
-constexpr size_t kMaxStackBufSize = 2048;
+// How much we try to pull off of the socket in one go.
+constexpr size_t kReadAheadSize = 16 * 1024;
+
+static theme::counter s_bytesReceived{"theme_bytes_received_total", "Bytes read from client sockets"};
+static theme::counter s_bytesSent{"theme_bytes_sent_total", "Bytes written to client sockets"};
+static theme::counter s_messagesReceived{"theme_messages_received_total",
+                                         "Protocol structures completely read from clients"};
+static theme::counter s_socketErrors{"theme_socket_errors_total",
+                                     "Client sockets shut down due to a read or write error"};
+static theme::counter s_latencyDropped{"theme_reply_latency_dropped_total",
+                                       "Requests left out of the reply latency histograms because "
+                                       "too many were pipelined"};
+static theme::histogram s_sendSize{"theme_send_bytes", "Bytes flushed per send to a client socket",
+                                   theme::histogram::exponential(64, 4, 8)};
+
+namespace
+{
+    struct tracked_latency
+    {
+        std::string m_labels;
+        theme::latency_histogram m_histogram;
+
+        tracked_latency(const theme::net_struct* ns)
+            : m_labels(ST::format("msg=\"{}\"", ns->m_name).c_str()),
+              m_histogram("theme_reply_latency_seconds",
+                          "Time from a request being read to its reply being flushed",
+                          m_labels.c_str())
+        { }
+    };
+};
+
+// Filled in at startup and only read afterward, so no locking is needed.
+static std::unordered_map<const theme::net_struct*, std::unique_ptr<tracked_latency>> s_latencies;
+
+static std::unique_ptr<theme::capture_sink> s_captureOwner;
+static std::atomic<theme::capture_sink*> s_capture;
 
 // =================================================================================
 
-theme::client_base::client_base(theme::socket& sock)
-    : m_socket(std::move(sock)),
-      m_encrypt({ EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free }),
-      m_decrypt({ EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free })
+theme::client_base::client_base(theme::socket& sock, theme::buffer_pool& buffers)
+    : m_socket(std::move(sock)), m_buffers(buffers), m_dispatch(), m_sending(), m_closing(),
+      m_rxbytes(), m_txbytes(), m_pendingReplies(), m_npending(), m_captureId()
+{
+    if (capture_sink* sink = s_capture.load(std::memory_order_acquire))
+        m_captureId = sink->open_connection();
+}
+
+theme::client_base::~client_base()
+{
+    flush_capture();
+    capture(capture_file::e_close, std::chrono::steady_clock::now());
+}
+
+void theme::client_base::track_latency(const theme::net_struct* ns)
+{
+    auto& tracked = s_latencies[ns];
+    if (!tracked)
+        tracked = std::make_unique<tracked_latency>(ns);
+}
+
+void theme::client_base::start_capture(std::unique_ptr<theme::capture_sink> sink)
 {
-    EVP_EncryptInit_ex(m_encrypt.get(), EVP_enc_null(), nullptr, nullptr, nullptr);
-    EVP_DecryptInit_ex(m_decrypt.get(), EVP_enc_null(), nullptr, nullptr, nullptr);
+    stop_capture();
+    s_captureOwner = std::move(sink);
+    s_capture.store(s_captureOwner.get(), std::memory_order_release);
+}
+
+void theme::client_base::stop_capture()
+{
+    s_capture.store(nullptr, std::memory_order_release);
+    s_captureOwner.reset();
+}
+
+void theme::client_base::capture(uint8_t type, std::chrono::steady_clock::time_point when,
+                                 const uint8_t* buf, size_t bufsz)
+{
+    if (m_captureId == 0)
+        return;
+
+    // A connection with holes in it can't be replayed, so give up on it entirely.
+    capture_sink* sink = s_capture.load(std::memory_order_acquire);
+    if (!sink || !sink->push((capture_file::frame_type)type, m_captureId, when, buf, bufsz)) {
+        m_captureId = 0;
+        m_captured = std::string();
+    }
+}
+
+void theme::client_base::flush_capture()
+{
+    if (m_captured.empty())
+        return;
+    capture(capture_file::e_message, m_capturedAt, (const uint8_t*)m_captured.data(),
+            m_captured.size());
+    m_captured.clear();
 }
 
 void theme::client_base::set_crypt_key(size_t keysz, const uint8_t* const key)
 {
     s_log.debug("{}: changing encryption ({} bits)", m_socket.to_string(), keysz * 8);
 
-    auto cipher = EVP_rc4();
-    auto initproc = EVP_CIPHER_meth_get_init(cipher);
+    m_encrypt.set_key(key, keysz);
+    m_decrypt.set_key(key, keysz);
 
-    EVP_CIPHER_CTX_reset(m_encrypt.get());
-    THEME_ASSERTD(EVP_EncryptInit_ex(m_encrypt.get(), cipher, nullptr, nullptr, nullptr) == 1);
-    EVP_CIPHER_CTX_set_key_length(m_encrypt.get(), keysz);
-    THEME_ASSERTD(initproc(m_encrypt.get(), key, nullptr, 1) == 1);
-
-    EVP_CIPHER_CTX_reset(m_decrypt.get());
-    THEME_ASSERTD(EVP_DecryptInit_ex(m_decrypt.get(), cipher, nullptr, nullptr, nullptr) == 1);
-    EVP_CIPHER_CTX_set_key_length(m_decrypt.get(), keysz);
-    THEME_ASSERTD(initproc(m_decrypt.get(), key, nullptr, 0) == 1);
+    flush_capture();
+    capture(capture_file::e_encrypted, std::chrono::steady_clock::now());
 }
 
 // =================================================================================
@@ -75,7 +155,14 @@ bool theme::client_base::alloc_buf(theme::client_base::io_state& state, size_t r
         bufsz = (blocks + 4) * sizeof(size_t);
     }
 
-    auto buf = std::make_unique<uint8_t[]>(bufsz);
+    // Growing within the size class we already have is free.
+    size_t capacity = state.m_buf ? state.m_buf.get_deleter().m_capacity : 0;
+    if (bufsz <= capacity) {
+        state.m_bufsz = exact ? bufsz : std::max(state.m_bufsz, bufsz);
+        return true;
+    }
+
+    auto buf = m_buffers.alloc(bufsz);
     if (!buf) {
         s_log.error("{}: failed to resize buffer current: {x} desired: {x} final: {x}",
                     m_socket.to_string(), state.m_bufsz, requestsz, bufsz);
@@ -83,7 +170,7 @@ bool theme::client_base::alloc_buf(theme::client_base::io_state& state, size_t r
     }
 
     if (state.m_buf)
-        memcpy(buf.get(), state.m_buf.get(), state.m_bufsz);
+        memcpy(buf.get(), state.m_buf.get(), std::min(state.m_bufsz, capacity));
     state.m_bufsz = bufsz;
     state.m_buf = std::move(buf);
     return true;
@@ -111,7 +198,8 @@ std::tuple<bool, size_t, size_t> theme::client_base::calc_field_sz(const theme::
         alloc += cur_field.m_elementsz * cur_field.m_count;
         if (buf) {
             const net_field& sz_field = ns->m_fields[field - 1];
-            wire = cur_field.m_elementsz * extract_elementcount(sz_field, cur_field, buf);
+            size_t count = extract_elementcount(sz_field, cur_field, buf);
+            wire = (count == (size_t)-1) ? count : cur_field.m_elementsz * count;
         } else {
             // Don't increment the wire size -- we don't know the size of this field, so it's
             // better for the IO operation to complete and then for us to "double check" to
@@ -204,41 +292,101 @@ void theme::client_base::debug_field(const theme::net_field& field, const uint8_
 
 // =================================================================================
 
-bool theme::client_base::resume_read(io_state& state)
+bool theme::client_base::fill_input()
 {
-    do {
-        // How much have we read?
-        size_t memsz = 0;
-        size_t wiresz = 0;
-        for (size_t i = 0; i < state.m_read.m_field; ++i) {
-            auto result = calc_field_sz(state.m_read.m_struct, i, state.m_buf.get() + memsz);
-            THEME_ASSERTD(std::get<0>(result));
-            memsz += std::get<1>(result);
-            wiresz += std::get<2>(result);
+    if (m_dispatch)
+        return false;
+
+    if (!m_input.reserve(m_buffers, kReadAheadSize)) {
+        s_log.error("{}: failed to allocate receive buffer", m_socket.to_string());
+        m_socket.shutdown();
+        return false;
+    }
+
+    uint8_t* buf;
+    size_t bufsz;
+    std::tie(buf, bufsz) = m_input.writable();
+
+    auto result = m_socket.read(bufsz, buf);
+    if (!std::get<0>(result) || std::get<1>(result) == 0) {
+        if (std::get<1>(result) == (size_t)-1) {
+            s_socketErrors.inc();
+            m_socket.shutdown();
         }
 
-        // How much more do we need to read?
-        bool fixedsz = true;
-        size_t allocsz = memsz;
-        size_t readsz = 0;
-
-        for (size_t i = state.m_read.m_field; i < state.m_read.m_struct->m_size; ++i) {
-            // For the first field ONLY, it is safe to examine the read buffer. Past here, we have
-            // undefined/uninitialized data. Yikes.
-            const uint8_t* ptr = (i == state.m_read.m_field) ? state.m_buf.get() + memsz : nullptr;
-            auto sizes = calc_field_sz(state.m_read.m_struct, i, ptr);
-            if (std::get<2>(sizes) == (size_t)-1) {
+        // EOF -- the peer hung up, and the HUP will be along to clean up shortly. Either way,
+        // don't pin a receive buffer while there's nothing to put in it.
+        m_input.shrink();
+        return false;
+    }
+
+    m_input.commit(std::get<1>(result));
+    m_rxbytes += std::get<1>(result);
+    s_bytesReceived.inc(std::get<1>(result));
+    return true;
+}
+
+bool theme::client_base::receive(const uint8_t* buf, size_t bufsz)
+{
+    if (bufsz == (size_t)-1) {
+        s_socketErrors.inc();
+        m_socket.shutdown();
+        return false;
+    }
+
+    // Whatever a closing client says now goes unanswered, like it would after a shutdown.
+    if (m_closing)
+        return false;
+
+    if (!m_input.reserve(m_buffers, bufsz)) {
+        s_log.error("{}: failed to allocate receive buffer", m_socket.to_string());
+        m_socket.shutdown();
+        return false;
+    }
+
+    m_rxbytes += bufsz;
+    s_bytesReceived.inc(bufsz);
+    while (bufsz > 0) {
+        uint8_t* input_ptr;
+        size_t freesz;
+        std::tie(input_ptr, freesz) = m_input.writable();
+
+        size_t chunksz = std::min(bufsz, freesz);
+        memcpy(input_ptr, buf, chunksz);
+        m_input.commit(chunksz);
+
+        buf += chunksz;
+        bufsz -= chunksz;
+    }
+    return true;
+}
+
+bool theme::client_base::resume_read(io_state& state)
+{
+    const net_struct* ns = state.m_read.m_struct;
+    do {
+        // The memory layout is precomputed, so we know where the current field lives without
+        // walking everything we've already read.
+        size_t field = state.m_read.m_field;
+        size_t mempos = ns->m_offsets[field];
+        size_t allocsz = ns->m_offsets[ns->m_size];
+
+        // How much more do we need to read? Everything up to the first variable field is laid out
+        // the same on the wire as it is in memory, so that can be read and decrypted in one go.
+        // Past that, we have to examine the message one field at a time.
+        size_t readsz;
+        if (field < ns->m_fixedcount) {
+            readsz = ns->m_fixedsz - mempos;
+        } else {
+            auto sizes = calc_field_sz(ns, field, state.m_buf.get() + mempos);
+            THEME_ASSERTD(std::get<0>(sizes));
+            readsz = std::get<2>(sizes);
+            if (readsz == (size_t)-1) {
                 // too large of a request...
                 m_socket.shutdown();
                 return false;
             }
-            fixedsz &= std::get<0>(sizes);
-            allocsz += std::get<1>(sizes);
-
-            // If we are into a variable read, we can't read that yet. But, we do want to try to
-            // allocate close to the complete message, so keep counting.
-            if (fixedsz)
-                readsz += std::get<2>(sizes);
+            allocsz = std::max(allocsz, mempos + readsz);
         }
 
         if (!alloc_buf(state, allocsz)) {
@@ -246,98 +394,91 @@ bool theme::client_base::resume_read(io_state& state)
             return false;
         }
 
-        readsz -= std::min(readsz, state.m_read.m_offset);
-        if (readsz > 0) {
-            // All this work just to get a buffer that might be on the stack... Sigh
-            std::unique_ptr<uint8_t[]> heapbuf;
-            uint8_t* buf;
-            if (readsz <= kMaxStackBufSize) {
-                buf = (uint8_t*)alloca(readsz);
-            } else {
-                heapbuf = std::make_unique<uint8_t[]>(readsz);
-                buf = heapbuf.get();
-            }
+        readsz -= state.m_read.m_offset;
+        mempos += state.m_read.m_offset;
 
-            auto result = m_socket.read(readsz, buf);
-            if (!std::get<0>(result)) {
-                if (std::get<1>(result) == (size_t)-1)
-                    m_socket.shutdown();
+        size_t nread = 0;
+        if (readsz > 0) {
+            if (m_input.empty() && !fill_input())
                 return false;
-            }
 
-            // OK, we read something. Now, we need to iterate through the fields we had left to
-            // read and see how far along we got into that... Decrypting the data along the way,
-            // of course. *grumble, grumble*
-            size_t nread = std::get<1>(result);
-            size_t mempos = memsz;
-            size_t wirepos = 0;
-            do {
-                auto sizes = calc_field_sz(state.m_read.m_struct, state.m_read.m_field,
-                                           state.m_buf.get() + mempos);
-                THEME_ASSERTD(std::get<0>(sizes));
-                size_t field_memsz = std::get<1>(sizes);
-                size_t field_wiresz = std::get<2>(sizes);
-
-                // Add offset NOW so that we don't affect the above field inspection...
-                mempos += state.m_read.m_offset;
-
-                // Decrypt smaller of: field size on the wire or read amount remaining
-                int decsz;
-                size_t field_nread = std::min(field_wiresz, nread);
-                THEME_ASSERTD(EVP_DecryptUpdate(m_decrypt.get(),
-                                                state.m_buf.get() + mempos, &decsz,
-                                                buf + wirepos, field_nread) != 0);
-                THEME_ASSERTD(decsz == field_nread);
+            // Take no more than the current field(s) need -- the rest may belong to a pipelined
+            // message that will be decrypted when its turn comes.
+            const uint8_t* buf;
+            std::tie(buf, nread) = m_input.readable();
+            nread = std::min(nread, readsz);
+
+            m_decrypt.apply(state.m_buf.get() + mempos, buf, nread);
+            m_input.consume(nread);
+
+            if (m_captureId != 0)
+                m_captured.append((const char*)state.m_buf.get() + mempos, nread);
+        }
+
+        // Now, see how many fields that completed. If we left off in the middle of a field, we'll
+        // come back around and try to request more data. Ideally we will get EAGAIN and return to
+        // processing other clients -- there might be more data available though.
+        if (field < ns->m_fixedcount) {
+            size_t endpos = mempos + nread;
+            while (state.m_read.m_field < ns->m_fixedcount &&
+                   ns->m_offsets[state.m_read.m_field + 1] <= endpos) {
 #ifdef THEME_PROTOCOL_DEBUG
-                debug_field(state.m_read.m_struct->m_fields[state.m_read.m_field],
-                            state.m_buf.get() + mempos);
+                debug_field(ns->m_fields[state.m_read.m_field],
+                            state.m_buf.get() + ns->m_offsets[state.m_read.m_field]);
 #endif
-
-                nread -= field_nread;
-                wirepos += field_nread;
-
-                // Now, check to see if we left off in the middle of a field.
-                if (field_nread < field_wiresz) {
-                    state.m_read.m_offset += field_nread;
-                    THEME_ASSERTD(nread == 0);
-                    // break out of this processing loop and try to request more data. ideally we
-                    // will get EAGAIN and return to processing other clients -- there might be more
-                    // data available though, so we could keep going as well.
-                    break;
-                } else {
-                    // reset the offset to zero since we read a complete field f'sho
-                    state.m_read.m_field++;
-                    // if we read all the fields, we are done woo
-                    if (state.m_read.m_field == state.m_read.m_struct->m_size) {
-                        THEME_ASSERTD(nread == 0);
-                        return true;
-                    }
-                    state.m_read.m_offset = 0;
-                    mempos += field_memsz;
-                }
-            } while (true);
+                state.m_read.m_field++;
+            }
+            state.m_read.m_offset = endpos - ns->m_offsets[state.m_read.m_field];
+        } else if (nread < readsz) {
+            state.m_read.m_offset += nread;
+        } else {
+#ifdef THEME_PROTOCOL_DEBUG
+            debug_field(ns->m_fields[field], state.m_buf.get() + ns->m_offsets[field]);
+#endif
+            state.m_read.m_field++;
+            state.m_read.m_offset = 0;
         }
+
+        // if we read all the fields, we are done woo
+        if (state.m_read.m_field == ns->m_size)
+            return true;
     } while(true);
 }
 
-std::unique_ptr<uint8_t[]> theme::client_base::handle_read()
+theme::buffer_ptr_t theme::client_base::handle_read()
 {
-    bool complete;
+    if (m_closing)
+        return buffer_ptr_t(nullptr, { nullptr, 0 });
+
     if (!m_read.m_buf) {
 #ifdef THEME_PROTOCOL_DEBUG
         s_log.debug("{}: BEGIN READ '{}'", m_socket.to_string(), m_read.m_read.m_struct->m_name);
 #endif
 
-        complete = resume_read(m_read);
-    } else {
-        complete = resume_read(m_read);
+        // A new message means the handler is done with the last one.
+        flush_capture();
     }
 
-    if (complete) {
+    if (resume_read(m_read)) {
 #ifdef THEME_PROTOCOL_DEBUG
         s_log.debug("{}: END READ '{}'", m_socket.to_string(), m_read.m_read.m_struct->m_name);
 #endif
 
+        s_messagesReceived.inc();
+
+        if (m_captureId != 0)
+            m_capturedAt = std::chrono::steady_clock::now();
+
+        auto it = s_latencies.find(m_read.m_read.m_struct);
+        if (it != s_latencies.end()) {
+            if (m_npending < kMaxPendingReplies) {
+                m_pendingReplies[m_npending++] = { &it->second->m_histogram,
+                                                   std::chrono::steady_clock::now() };
+            } else {
+                s_latencyDropped.inc();
+            }
+        }
+
         // Reset state
         m_read.m_read.m_field = 0;
         m_read.m_read.m_offset = 0;
@@ -349,95 +490,199 @@ std::unique_ptr<uint8_t[]> theme::client_base::handle_read()
     }
 
     // prevents a warning
-    return std::unique_ptr<uint8_t[]>(nullptr);
+    return buffer_ptr_t(nullptr, { nullptr, 0 });
 }
 
 // =================================================================================
 
-bool theme::client_base::resume_write(theme::client_base::io_state& state)
+void theme::client_base::encrypt_output(const uint8_t* buf, size_t bufsz)
 {
-    // Due to encryption, this is a fairly "dumb" send
-    const uint8_t* ptr = state.m_buf.get() + state.m_write.m_bufoffs;
-    size_t sendsz = state.m_bufsz - state.m_write.m_bufoffs;
-
-    // TODO: sendfile()
-    auto result = m_socket.write(sendsz, ptr);
-    if (!std::get<0>(result)) {
-        // error
-        if (std::get<1>(result) == (size_t)-1)
-            m_socket.shutdown();
-        return false;
+    // We still have to buffer in userspace because the wire copy is encrypted, but we can at
+    // least encrypt straight into the output queue. RC4 is a stream cipher, so it doesn't mind
+    // being fed in pieces when the queue wraps around.
+    while (bufsz > 0) {
+        uint8_t* wire_ptr;
+        size_t freesz;
+        std::tie(wire_ptr, freesz) = m_output.writable();
+
+        size_t chunksz = std::min(bufsz, freesz);
+        m_encrypt.apply(wire_ptr, buf, chunksz);
+        m_output.commit(chunksz);
+
+        buf += chunksz;
+        bufsz -= chunksz;
     }
-
-    // how much did we read?
-    state.m_write.m_bufoffs += std::get<1>(result);
-    return state.m_write.m_bufoffs == state.m_bufsz;
 }
 
 void theme::client_base::enqueue_write(const theme::net_struct* const ns, const uint8_t* const buf)
 {
-    io_state state;
-
-    // Bad news old bean. While it would be nice to avoid copying, we need to send out an encrypted
-    // message. That means while we're writing we no longer have access to the decrypted contents.
-    // So, we'll instead perform userspace buffering here. At least the code is cleaner...
-    size_t wiresz = 0;
-    for (size_t i = 0; i < ns->m_size; ++i) {
-        auto result = calc_field_sz(ns, i, buf + wiresz);
+    // The fixed prefix is known up front, so only the variable fields need to be examined.
+    size_t wiresz = ns->m_fixedsz;
+    for (size_t i = ns->m_fixedcount; i < ns->m_size; ++i) {
+        auto result = calc_field_sz(ns, i, buf + ns->m_offsets[i]);
         THEME_ASSERTD(std::get<0>(result));
         wiresz += std::get<2>(result);
     }
 
-    if (!alloc_buf(state, wiresz, true)) {
+    if (!m_output.reserve(m_buffers, wiresz)) {
+        s_log.error("{}: failed to grow output queue current: {x} desired: {x}",
+                    m_socket.to_string(), m_output.size(), wiresz);
         m_socket.shutdown();
         return;
     }
 
 #ifdef THEME_PROTOCOL_DEBUG
     s_log.debug("{}: ENQUEUE WRITE '{}' wiresz:{x}", m_socket.to_string(), ns->m_name,wiresz);
+    for (size_t i = 0; i < ns->m_fixedcount; ++i)
+        debug_field(ns->m_fields[i], buf + ns->m_offsets[i]);
 #endif
 
-    const uint8_t* mem_ptr = buf;
-    uint8_t* wire_ptr = state.m_buf.get();
-    for (size_t i = 0; i < ns->m_size; ++i) {
+    encrypt_output(buf, ns->m_fixedsz);
+    for (size_t i = ns->m_fixedcount; i < ns->m_size; ++i) {
+        const uint8_t* mem_ptr = buf + ns->m_offsets[i];
         auto result = calc_field_sz(ns, i, mem_ptr);
-        THEME_ASSERTD(std::get<0>(result));
-
-        int encsz;
-        EVP_EncryptUpdate(m_encrypt.get(), wire_ptr, &encsz, mem_ptr, std::get<2>(result));
-        THEME_ASSERTD(encsz == std::get<2>(result));
+        encrypt_output(mem_ptr, std::get<2>(result));
 #ifdef THEME_PROTOCOL_DEBUG
         debug_field(ns->m_fields[i], mem_ptr);
 #endif
-
-        mem_ptr += std::get<1>(result);
-        wire_ptr += std::get<2>(result);
     }
 
 #ifdef THEME_PROTOCOL_DEBUG
     s_log.debug("{}: END WRITE '{}'", m_socket.to_string(), ns->m_name);
 #endif
+}
+
+void theme::client_base::enqueue_write(const theme::net_struct* const ns,
+                                       const uint8_t* const buf, size_t bufsz)
+{
+    THEME_ASSERTD(ns->m_fixedcount == ns->m_size && ns->m_fixedsz == bufsz);
+
+    if (!m_output.reserve(m_buffers, bufsz)) {
+        s_log.error("{}: failed to grow output queue current: {x} desired: {x}",
+                    m_socket.to_string(), m_output.size(), bufsz);
+        m_socket.shutdown();
+        return;
+    }
 
-    if (!has_pending_write()) {
-        if (resume_write(state)) {
 #ifdef THEME_PROTOCOL_DEBUG
-            s_log.debug("{}: WROTE '{}' SYNCHRONOUSLY", m_socket.to_string(), ns->m_name);
+    s_log.debug("{}: ENQUEUE WRITE '{}' wiresz:{x}", m_socket.to_string(), ns->m_name, bufsz);
+    for (size_t i = 0; i < ns->m_size; ++i)
+        debug_field(ns->m_fields[i], buf + ns->m_offsets[i]);
+#endif
+
+    encrypt_output(buf, bufsz);
+
+#ifdef THEME_PROTOCOL_DEBUG
+    s_log.debug("{}: END WRITE '{}'", m_socket.to_string(), ns->m_name);
 #endif
-            return;
-        }
-    }
-    m_writes.emplace_back(std::move(state));
 }
 
-bool theme::client_base::handle_write()
+bool theme::client_base::handle_write(size_t limit)
 {
-    if (m_writes.empty())
+    if (m_dispatch) {
+        // The dispatcher takes everything queued so far in one go. Anything queued while it is
+        // busy goes out once it reports back.
+        if (m_sending > 0)
+            return false;
+        if (m_output.empty()) {
+            record_replies();
+            return true;
+        }
+
+        m_sending = m_output.size();
+        if (!m_dispatch->send(m_socket, m_output)) {
+            m_sending = 0;
+            m_socket.shutdown();
+        }
         return false;
+    }
 
-    io_state& state = m_writes.front();
-    if (resume_write(state)) {
-        m_writes.pop_front();
+    iovec iov[2];
+    int iovcnt = m_output.readable(iov);
+    if (iovcnt == 0) {
+        // Whatever was asked of us either was answered already or needed no answer.
+        record_replies();
         return true;
     }
-    return false;
+
+    if (iov[0].iov_len >= limit) {
+        iov[0].iov_len = limit;
+        iovcnt = 1;
+    } else if (iovcnt == 2) {
+        iov[1].iov_len = std::min(iov[1].iov_len, limit - iov[0].iov_len);
+    }
+
+    auto result = m_socket.writev(iov, iovcnt);
+    if (!std::get<0>(result)) {
+        // error
+        if (std::get<1>(result) == (size_t)-1) {
+            s_socketErrors.inc();
+            m_socket.shutdown();
+        }
+        return false;
+    }
+
+#ifdef THEME_PROTOCOL_DEBUG
+    s_log.debug("{}: FLUSHED {x}/{x} bytes", m_socket.to_string(), std::get<1>(result),
+                m_output.size());
+#endif
+    m_txbytes += std::get<1>(result);
+    s_bytesSent.inc(std::get<1>(result));
+    s_sendSize.observe((double)std::get<1>(result));
+    m_output.consume(std::get<1>(result));
+    if (!m_output.empty())
+        return false;
+
+    // Everything that was asked of us before this flush has now been answered.
+    record_replies();
+    return true;
+}
+
+void theme::client_base::sent(size_t bytes)
+{
+    if (bytes == (size_t)-1) {
+        s_socketErrors.inc();
+        m_sending = 0;
+        m_socket.shutdown();
+        return;
+    }
+
+#ifdef THEME_PROTOCOL_DEBUG
+    s_log.debug("{}: FLUSHED {x}/{x} bytes", m_socket.to_string(), bytes, m_sending);
+#endif
+    THEME_ASSERTD(bytes <= m_sending);
+    m_txbytes += bytes;
+    s_bytesSent.inc(bytes);
+    s_sendSize.observe((double)bytes);
+    m_sending -= bytes;
+    if (m_sending > 0 || !m_output.empty())
+        return;
+
+    // Everything that was asked of us before this send has now been answered.
+    record_replies();
+    if (m_closing)
+        m_socket.shutdown();
+}
+
+void theme::client_base::shutdown_after_write()
+{
+    handle_write();
+    if (m_sending > 0)
+        m_closing = true;
+    else
+        m_socket.shutdown();
+}
+
+void theme::client_base::record_replies()
+{
+    if (m_npending == 0)
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < m_npending; ++i) {
+        auto elapsed = now - m_pendingReplies[i].m_received;
+        m_pendingReplies[i].m_latency->record(
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+    m_npending = 0;
 }
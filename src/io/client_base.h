@@ -17,25 +17,30 @@
 #ifndef __IO_CLIENT_BASE_H
 #define __IO_CLIENT_BASE_H
 
+#include "buffer_pool.h"
+#include "rc4.h"
+#include "ring_buffer.h"
 #include "socket.h"
 
-#include <list>
-#include <openssl/ossl_typ.h>
+#include <chrono>
 #include <memory>
+#include <string>
 #include <tuple>
 
-typedef std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> evp_ptr_t;
-
 namespace theme
 {
+    class capture_sink;
+    class latency_histogram;
     class log;
     struct net_field;
     struct net_struct;
+    class poll_dispatch;
 
     class client_base
     {
     protected:
         socket m_socket;
+        buffer_pool& m_buffers;
         static log s_log;
 
     private:
@@ -50,16 +55,10 @@ namespace theme
                     size_t m_field;
                     size_t m_offset;
                 } m_read;
-                struct
-                {
-                    size_t m_bufoffs;
-                    size_t m_fdoffs;
-                    int m_fd;
-                } m_write;
-                uint8_t m_unionbuf[std::max(sizeof(m_read), sizeof(m_write))];
+                uint8_t m_unionbuf[sizeof(m_read)];
             };
             size_t m_bufsz;
-            std::unique_ptr<uint8_t[]> m_buf;
+            buffer_ptr_t m_buf;
 
             io_state()
                 : m_unionbuf(), m_bufsz()
@@ -75,10 +74,54 @@ namespace theme
         };
 
         io_state m_read;
-        std::list<io_state> m_writes;
 
-        evp_ptr_t m_encrypt;
-        evp_ptr_t m_decrypt;
+        /** Raw bytes received from the socket that the current read hasn't consumed yet. */
+        ring_buffer m_input;
+
+        /** Encrypted messages waiting for the socket, in order. */
+        ring_buffer m_output;
+
+        /**
+         * The dispatcher that moves this client's data, if it is one of its streams. Otherwise,
+         * the socket is read and written directly.
+         */
+        poll_dispatch* m_dispatch;
+
+        /** Output handed to m_dispatch that it hasn't reported as sent yet. */
+        size_t m_sending;
+
+        /** Shut the socket down once m_dispatch is done sending. */
+        bool m_closing;
+
+        rc4_stream m_encrypt;
+        rc4_stream m_decrypt;
+
+        uint64_t m_rxbytes;
+        uint64_t m_txbytes;
+
+        /**
+         * Requests that are waiting for their replies to be flushed, for latency tracking.
+         * Requests pipelined beyond this go unmeasured, and are counted as dropped samples.
+         */
+        struct pending_reply
+        {
+            latency_histogram* m_latency;
+            std::chrono::steady_clock::time_point m_received;
+        };
+        static constexpr size_t kMaxPendingReplies = 8;
+        pending_reply m_pendingReplies[kMaxPendingReplies];
+        size_t m_npending;
+
+        /** This connection's ID in the traffic capture, or 0 if it isn't being captured. */
+        uint32_t m_captureId;
+
+        /**
+         * Decrypted bytes of the last message read, for the capture.
+         * Handlers may continue reading a message after it has been handed to them, so it is
+         * held until the next message begins.
+         */
+        std::string m_captured;
+        std::chrono::steady_clock::time_point m_capturedAt;
 
     private:
         bool alloc_buf(io_state& state, size_t requestsz, bool exact=false);
@@ -113,30 +156,109 @@ namespace theme
         size_t extract_integer(const net_field& field, const uint8_t* const buf) const;
 
     private:
+        /**
+         * Refills the receive buffer with a single read from the socket. Streams are filled by
+         * their dispatcher instead, so this never reads from them.
+         * \return Returns true if any data was received.
+         */
+        bool fill_input();
         bool resume_read(io_state& state);
-        bool resume_write(io_state& state);
 
+        void capture(uint8_t type, std::chrono::steady_clock::time_point when,
+                     const uint8_t* buf=nullptr, size_t bufsz=0);
+        void flush_capture();
+
+        /** Records the latency of every request waiting on a reply, which is now on its way. */
+        void record_replies();
+
+        void encrypt_output(const uint8_t* buf, size_t bufsz);
         void enqueue_write(const net_struct* const ns, const uint8_t* const buf);
 
+        /** Queues a message with no variable fields, which is laid out exactly as on the wire. */
+        void enqueue_write(const net_struct* const ns, const uint8_t* const buf, size_t bufsz);
+
     protected:
         /**
          * Handles incoming data on the socket.
          * \return Returns a smart pointer to a completely read message. If no complete message was
          *         read, the smart pointer is empty.
          */
-        std::unique_ptr<uint8_t[]> handle_read();
+        buffer_ptr_t handle_read();
         bool has_pending_read() const { return m_read.m_read.m_struct != nullptr; }
 
-        bool handle_write();
-        bool has_pending_write() const { return !m_writes.empty(); }
+        /**
+         * Flushes as much of the queued output as possible with a single send.
+         * Writes are never sent as they are queued, so this must be called once the current batch
+         * of messages has been written.
+         * \param limit The most bytes to send, for simulating a slow peer.
+         * \return Returns true if the output queue is now empty.
+         */
+        bool handle_write(size_t limit=(size_t)-1);
+        bool has_pending_write() const { return !m_output.empty() || m_sending > 0; }
+
+        /**
+         * Sends whatever output is queued, then shuts the socket down. A dispatcher sends after
+         * the fact, so for streams, the shutdown waits for it and anything more that comes in
+         * is ignored.
+         */
+        void shutdown_after_write();
+
+        /**
+         * Lets \param dispatch move the client's data, once the socket has been added to it with
+         * poll_dispatch::add_stream(). Its receives go to receive(), and its sends are reported
+         * to sent(). A stream ignores handle_write()'s limit, and only has one send underway.
+         */
+        void stream_via(poll_dispatch* dispatch) { m_dispatch = dispatch; }
+
+        /**
+         * Queues bytes the dispatcher received for the next handle_read().
+         * \param bufsz is (size_t)-1 if the receive failed.
+         * \return Returns true if the bytes were queued.
+         */
+        bool receive(const uint8_t* buf, size_t bufsz);
+
+        /** Accounts for progress on a dispatcher send, with \param bytes (size_t)-1 on failure. */
+        void sent(size_t bytes);
+
+        /** Once this much output is queued, the client should stop reading new requests... */
+        static constexpr size_t kWriteHighWater = 64 * 1024;
+        /** ...until the queue drains back down to this size. */
+        static constexpr size_t kWriteLowWater = 16 * 1024;
+
+        bool write_backlogged() const { return m_output.size() + m_sending >= kWriteHighWater; }
+        bool write_drained() const { return m_output.size() + m_sending <= kWriteLowWater; }
+
+        /**
+         * Generates keystream for the messages to come.
+         * Call this once the client's current batch of work is out the door, so that the cipher
+         * work is kept off of the path between a request and its reply.
+         */
+        void refill_keystream()
+        {
+            m_encrypt.refill();
+            m_decrypt.refill();
+        }
+
+        /** Leaves generating keystream for the messages to come to \param batch. */
+        void refill_keystream(rc4_batch& batch)
+        {
+            m_encrypt.refill(batch);
+            m_decrypt.refill(batch);
+        }
+
+        /** Total number of bytes received from the socket. */
+        uint64_t rx_bytes() const { return m_rxbytes; }
+
+        /** Total number of bytes sent to the socket. */
+        uint64_t tx_bytes() const { return m_txbytes; }
 
     protected:
-        client_base(socket& sock);
+        client_base(socket& sock, buffer_pool& buffers);
 
     public:
         client_base(const client_base&) = delete;
         client_base(client_base&&) = delete;
-        virtual ~client_base() = default;
+        virtual ~client_base();
 
     public:
         log& logger() { return s_log; }
@@ -153,12 +275,12 @@ namespace theme
         }
 
         template<typename T>
-        void read(size_t field, std::unique_ptr<uint8_t[]>& buf)
+        void read(size_t field, buffer_ptr_t& buf)
         {
             read(T::net_struct, field, buf);
         }
 
-        void read(const net_struct* const ns, size_t field, std::unique_ptr<uint8_t[]>& buf)
+        void read(const net_struct* const ns, size_t field, buffer_ptr_t& buf)
         {
             m_read.m_read.m_struct = ns;
             if (field != (size_t)-1)
@@ -170,7 +292,10 @@ namespace theme
         template<typename T>
         void write(const T* const msg)
         {
-            write(T::net_struct, (const uint8_t* const)msg);
+            if constexpr (T::fixed_size)
+                enqueue_write(T::net_struct, (const uint8_t* const)msg, sizeof(T));
+            else
+                write(T::net_struct, (const uint8_t* const)msg);
         }
 
         void write(const net_struct* const ns, const uint8_t* const buf)
@@ -179,6 +304,23 @@ namespace theme
         }
 
         void set_crypt_key(size_t keysz, const uint8_t* const key);
+
+    public:
+        /**
+         * Times how long it takes to reply to \param ns.
+         * The clock runs from the moment the message is completely read until the output queue
+         * is next completely flushed. This must be called before any clients exist.
+         */
+        static void track_latency(const net_struct* ns);
+
+        /**
+         * Records the decrypted messages of every client that connects from now on.
+         * Replaces any capture already in progress.
+         */
+        static void start_capture(std::unique_ptr<capture_sink> sink);
+
+        /** Stops capturing. This should only be called once all clients are gone. */
+        static void stop_capture();
     };
 };
 
@@ -0,0 +1,158 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crypto_pool.h"
+#include "poll.h"
+#include "uru_crypt.h"
+
+#include "../core/errors.h"
+#include "../core/log.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// =================================================================================
+
+static theme::log s_log{"CRYPTO"};
+
+// =================================================================================
+
+theme::crypto_pool::completion_queue::completion_queue()
+    : m_fd(-1), m_poll()
+{
+    m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    THEME_ASSERTR_V(m_fd != -1, "eventfd failed {}", strerror(errno));
+}
+
+theme::crypto_pool::completion_queue::~completion_queue()
+{
+    if (m_poll)
+        m_poll->remove_fd(m_fd);
+    if (m_fd != -1)
+        THEME_ASSERTD(close(m_fd) == 0);
+}
+
+bool theme::crypto_pool::completion_queue::attach(theme::poll_dispatch* poll)
+{
+    THEME_ASSERTD(m_poll == nullptr);
+    if (!poll->add_fd(m_fd, poll_dispatch::e_read, this))
+        return false;
+    m_poll = poll;
+    return true;
+}
+
+void theme::crypto_pool::completion_queue::post(std::unique_ptr<crypto_job> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_jobs.emplace_back(std::move(job));
+    }
+
+    uint64_t value = 1;
+    if (::write(m_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        s_log.error("post() failed to signal completion fd {}: {}", m_fd, strerror(errno));
+}
+
+void theme::crypto_pool::completion_queue::handle_events(int, uint32_t)
+{
+    // Reset the eventfd BEFORE grabbing the jobs so that any job posted after the swap is
+    // guaranteed to generate a new edge.
+    uint64_t value;
+    if (::read(m_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        s_log.error("handle_events() failed to read completion fd {}: {}", m_fd, strerror(errno));
+
+    std::vector<std::unique_ptr<crypto_job>> jobs;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        jobs.swap(m_jobs);
+    }
+
+    for (auto& job : jobs) {
+        if (job->m_complete)
+            job->m_complete(*job);
+    }
+}
+
+// =================================================================================
+
+theme::crypto_pool::crypto_pool(const theme::crypto& crypt, size_t threads)
+    : m_crypt(crypt), m_stopping()
+{
+    m_workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+        m_workers.emplace_back(&crypto_pool::work, this);
+}
+
+theme::crypto_pool::~crypto_pool()
+{
+    stop();
+}
+
+void theme::crypto_pool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stopping = true;
+    }
+    m_wakeup.notify_all();
+
+    for (auto& worker : m_workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+}
+
+// =================================================================================
+
+void theme::crypto_pool::execute(theme::crypto_job& job) const
+{
+    job.m_result = m_crypt.make_server_key(*job.m_keys, job.m_ydatasz, job.m_ydata,
+                                           sizeof(job.m_key), job.m_srvSeed, job.m_key);
+}
+
+void theme::crypto_pool::work()
+{
+    do {
+        pending_job pending;
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_wakeup.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+            if (m_stopping)
+                return;
+            pending = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+
+        execute(*pending.m_job);
+        pending.m_queue->post(std::move(pending.m_job));
+    } while (true);
+}
+
+void theme::crypto_pool::submit(std::unique_ptr<theme::crypto_job> job,
+                                theme::crypto_pool::completion_queue& queue)
+{
+    if (m_workers.empty()) {
+        execute(*job);
+        queue.post(std::move(job));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_jobs.push_back({ std::move(job), &queue });
+    }
+    m_wakeup.notify_one();
+}
@@ -0,0 +1,132 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THEME_CRYPTO_POOL_H
+#define __THEME_CRYPTO_POOL_H
+
+#include "poll.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace theme
+{
+    class crypto;
+    class crypto_keys;
+
+    /** A server key agreement that is computed away from the reactor thread. */
+    struct crypto_job final
+    {
+        typedef std::function<void(crypto_job&)> callback_t;
+
+        // Inputs
+        const crypto_keys* m_keys;
+        size_t m_ydatasz;
+        uint8_t m_ydata[64];
+
+        // Outputs
+        bool m_result;
+        uint8_t m_srvSeed[7];
+        uint8_t m_key[7];
+
+        /**
+         * Executed on the reactor thread that submitted the job once the result is ready.
+         * Clear this to cancel the job if its client goes away in the meantime.
+         */
+        callback_t m_complete;
+
+        crypto_job()
+            : m_keys(), m_ydatasz(), m_ydata(), m_result(), m_srvSeed(), m_key()
+        { }
+        crypto_job(const crypto_job&) = delete;
+        crypto_job(crypto_job&&) = delete;
+    };
+
+    class crypto_pool
+    {
+    public:
+        /**
+         * Receives finished jobs for a single reactor.
+         * Workers wake the reactor with an eventfd that is polled alongside its sockets, so
+         * completions are always delivered on the reactor's own thread.
+         */
+        class completion_queue : public poll_handler
+        {
+            int m_fd;
+            poll_dispatch* m_poll;
+            std::mutex m_lock;
+            std::vector<std::unique_ptr<crypto_job>> m_jobs;
+
+            void handle_events(int fd, uint32_t events) override;
+
+            friend class crypto_pool;
+            void post(std::unique_ptr<crypto_job> job);
+
+        public:
+            completion_queue();
+            completion_queue(const completion_queue&) = delete;
+            completion_queue(completion_queue&&) = delete;
+            ~completion_queue();
+
+            bool attach(poll_dispatch* poll);
+        };
+
+    private:
+        struct pending_job
+        {
+            std::unique_ptr<crypto_job> m_job;
+            completion_queue* m_queue;
+        };
+
+        const crypto& m_crypt;
+        std::vector<std::thread> m_workers;
+        std::mutex m_lock;
+        std::condition_variable m_wakeup;
+        std::deque<pending_job> m_jobs;
+        bool m_stopping;
+
+        void execute(crypto_job& job) const;
+        void work();
+
+    public:
+        crypto_pool() = delete;
+        crypto_pool(const crypto_pool&) = delete;
+        crypto_pool(crypto_pool&&) = delete;
+
+        /**
+         * Creates a pool of \param threads workers.
+         * \note With zero workers, jobs are computed inline but still completed asynchronously.
+         */
+        crypto_pool(const crypto& crypt, size_t threads);
+        ~crypto_pool();
+
+        /**
+         * Waits for the workers to finish whatever they are computing and exit.
+         * Jobs that haven't been started stay queued until the pool is destroyed, so clients
+         * holding on to them may still cancel them in the meantime.
+         */
+        void stop();
+
+        void submit(std::unique_ptr<crypto_job> job, completion_queue& queue);
+    };
+};
+
+#endif
@@ -18,52 +18,52 @@
 #include "../core/errors.h"
 #include "../core/log.h"
 
-#include <map>
+#include <algorithm>
 #include <sys/epoll.h>
 #include <unistd.h>
+#include <vector>
 
 // =================================================================================
 
 static theme::log s_log{"EPOLL"};
 
+// Smallest batch of events we'll ever wait for.
+constexpr size_t kMinBatch = 32;
+
+// Shrink the batch after this many consecutive waits that used less than a quarter of it.
+constexpr unsigned kShrinkAfter = 64;
+
 // =================================================================================
 
 namespace theme
 {
-    typedef std::map<int, struct epoll_cb> epoll_cb_map_t;
-
-    struct epoll_cb
-    {
-        pollcb_t m_cb;
-        epoll_cb_map_t::iterator m_iterator;
-
-        epoll_cb() = delete;
-        epoll_cb(const epoll_cb&) = delete;
-        epoll_cb(epoll_cb&& move)
-            : m_cb(std::move(move.m_cb)), m_iterator(std::move(move.m_iterator))
-        { }
-        epoll_cb(pollcb_t cb)
-            : m_cb(std::move(cb))
-        { }
-    };
-
     class epoll_dispatch : public poll_dispatch
     {
         int m_fd;
-        epoll_event m_events[1024]; // problem? [trollface.jpg]
-        epoll_cb_map_t m_callbacks;
+        std::vector<epoll_event> m_events;
+        size_t m_maxBatch;
+        unsigned m_underfull;
+        uint64_t m_waits;
+        uint64_t m_saturated;
+
+        /** Handlers indexed by fd. The kernel hands out the lowest free fd, so this stays dense. */
+        std::vector<poll_handler*> m_handlers;
 
         inline uint32_t xlate_mask_to_epoll(events mask) const;
         inline events xlate_epoll_to_mask(uint32_t events) const;
 
+        void resize_batch(int nevents);
+
     public:
-        epoll_dispatch();
+        epoll_dispatch(size_t max_batch);
         ~epoll_dispatch();
 
-        bool add_fd(int fd, events evmask, pollcb_t cb) override;
+        bool add_fd(int fd, events evmask, poll_handler* handler) override;
         bool remove_fd(int fd) override;
 
         bool dispatch(int timeout=30000) override;
+
+        stats get_stats() const override;
     };
 };
 
@@ -95,9 +95,12 @@ theme::poll_dispatch::events theme::epoll_dispatch::xlate_epoll_to_mask(uint32_t
 
 // =================================================================================
 
-theme::epoll_dispatch::epoll_dispatch()
-    : m_fd(-1)
+theme::epoll_dispatch::epoll_dispatch(size_t max_batch)
+    : m_fd(-1), m_maxBatch(std::max(max_batch, kMinBatch)), m_underfull(), m_waits(),
+      m_saturated()
 {
+    m_events.resize(std::min(m_maxBatch, kMinBatch));
+
     m_fd = epoll_create1(0);
     THEME_ASSERTR_V(m_fd != -1, "epoll_create1 failed {}", strerror(errno));
 }
@@ -108,27 +111,27 @@ theme::epoll_dispatch::~epoll_dispatch()
         THEME_ASSERTD(close(m_fd) == 0);
 }
 
-bool theme::epoll_dispatch::add_fd(int fd, events evmask, pollcb_t cb)
+bool theme::epoll_dispatch::add_fd(int fd, events evmask, poll_handler* handler)
 {
-    auto cbresult = m_callbacks.try_emplace(fd, cb);
-    if (!cbresult.second) {
+    THEME_ASSERTD(fd >= 0 && handler != nullptr);
+    if ((size_t)fd >= m_handlers.size())
+        m_handlers.resize(fd + 1);
+    if (m_handlers[fd]) {
         s_log.warning("add_fd() tried to double-add fd {}", fd);
         return false;
     }
 
-    // This adds the iterator to the cb struct to the struct itself. This is useful for constant
-    // time deletions. And yes, another copy. Get over it.
-    cbresult.first->second.m_iterator = cbresult.first;
-
+    // Stash the fd rather than the handler so that a stale event for an fd that has already been
+    // removed in this batch can't call into a dead handler.
     epoll_event event{};
     event.events = xlate_mask_to_epoll(evmask);
-    event.data.ptr = &cbresult.first->second;
+    event.data.fd = fd;
 
     if (epoll_ctl(m_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
         s_log.warning("add_fd() failed to add fd {}: {}", fd, strerror(errno));
-        m_callbacks.erase(cbresult.first);
         return false;
     }
+    m_handlers[fd] = handler;
     return true;
 }
 
@@ -139,7 +142,8 @@ bool theme::epoll_dispatch::remove_fd(int fd)
         return false;
     }
 
-    m_callbacks.erase(fd);
+    if ((size_t)fd < m_handlers.size())
+        m_handlers[fd] = nullptr;
     return true;
 }
 
@@ -147,7 +151,7 @@ bool theme::epoll_dispatch::remove_fd(int fd)
 
 bool theme::epoll_dispatch::dispatch(int timeout)
 {
-    int result = epoll_wait(m_fd, m_events, std::size(m_events), timeout);
+    int result = epoll_wait(m_fd, m_events.data(), m_events.size(), timeout);
     log::tick();
 
     if (result == -1 && errno == EINTR) {
@@ -157,38 +161,74 @@ bool theme::epoll_dispatch::dispatch(int timeout)
         return false;
     }
 
+    if (result > 0)
+        m_waits++;
+    if ((size_t)result == m_events.size())
+        m_saturated++;
+
     for (int i = 0; i < result; ++i) {
         const auto& event = m_events[i];
         auto events_mask = xlate_epoll_to_mask(event.events);
-        auto cb = (epoll_cb*)event.data.ptr;
+        int fd = event.data.fd;
+
+        // Something earlier in this batch may have removed the fd.
+        poll_handler* handler = m_handlers[fd];
+        if (!handler)
+            continue;
 
         // If the socket hung up on us, that's an implicit removal from the epoll because we
         // give no more shits about it or its data (how dare you hang up on me?!?!?!)
-        // Anyway, go ahead and do this BEFORE the callback so the callback doesn't do something
-        // stupid like lookup the callback in the map.
+        // Anyway, go ahead and do this BEFORE the callback, which is likely to destroy the
+        // handler.
         if (events_mask & events::e_hup) {
-            if (epoll_ctl(m_fd, EPOLL_CTL_DEL, cb->m_iterator->first, nullptr) == -1) {
-                s_log.warning("dispatch() failed to remove HUP'd fd {}: {}", cb->m_iterator->first,
+            if (epoll_ctl(m_fd, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+                s_log.warning("dispatch() failed to remove HUP'd fd {}: {}", fd,
                               strerror(errno));
             }
+            m_handlers[fd] = nullptr;
         }
 
-        if (cb->m_cb)
-            cb->m_cb(cb->m_iterator->first, events_mask);
-
-        // Performance optimization: we already have the iterator, so we can constant-time
-        // delete from the cb map here. Beware this will trigger the deletion of the callback
-        // object, so don't use it anymore.
-        if ((events_mask & events::e_hup))
-            m_callbacks.erase(cb->m_iterator);
+        handler->handle_events(fd, events_mask);
     }
 
+    // Don't resize until we're done with the events.
+    resize_batch(result);
     return true;
 }
 
+void theme::epoll_dispatch::resize_batch(int nevents)
+{
+    size_t batch = m_events.size();
+    if ((size_t)nevents == batch && batch < m_maxBatch) {
+        // A full batch means there were probably more events ready than we asked for.
+        batch = std::min(batch * 2, m_maxBatch);
+        m_underfull = 0;
+    } else if ((size_t)nevents < batch / 4 && batch > kMinBatch) {
+        // Be slow to shrink so that bursty loads don't thrash the allocator.
+        if (++m_underfull < kShrinkAfter)
+            return;
+        batch = std::max(batch / 2, kMinBatch);
+        m_underfull = 0;
+    } else {
+        m_underfull = 0;
+        return;
+    }
+
+    if (batch != m_events.size()) {
+        s_log.debug("resizing event batch from {} to {}", m_events.size(), batch);
+        m_events.resize(batch);
+        m_events.shrink_to_fit();
+    }
+}
+
+theme::poll_dispatch::stats theme::epoll_dispatch::get_stats() const
+{
+    return stats{ m_waits, m_saturated, m_events.size() };
+}
+
 // =================================================================================
 
-std::unique_ptr<theme::poll_dispatch> theme::poll_dispatch::create()
+std::unique_ptr<theme::poll_dispatch> theme::poll_dispatch::create_epoll(size_t max_batch)
 {
-    return std::make_unique<epoll_dispatch>();
+    return std::make_unique<epoll_dispatch>(max_batch);
 }
@@ -0,0 +1,41 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "poll.h"
+#include "theme_config.h"
+
+#include "../core/log.h"
+
+// =================================================================================
+
+static theme::log s_log{"POLL"};
+
+// =================================================================================
+
+std::unique_ptr<theme::poll_dispatch> theme::poll_dispatch::create(backend type, size_t max_batch)
+{
+    if (type == backend::e_uring) {
+#ifdef THEME_HAVE_IO_URING
+        if (auto result = create_uring(max_batch))
+            return result;
+        s_log.warning("io_uring is unavailable on this kernel, falling back to epoll");
+#else
+        s_log.warning("this build does not support io_uring, falling back to epoll");
+#endif
+    }
+
+    return create_epoll(max_batch);
+}
@@ -17,12 +17,52 @@
 #ifndef __IO_POLL_H
 #define __IO_POLL_H
 
-#include <functional>
+#include <cstdint>
 #include <memory>
 
 namespace theme
 {
-    typedef std::function<void(int fd, uint32_t events)> pollcb_t;
+    /**
+     * Receives the events for a file descriptor registered with a poll_dispatch.
+     * The dispatcher doesn't own its handlers -- they must remove themselves before going away.
+     */
+    class poll_handler
+    {
+    public:
+        virtual void handle_events(int fd, uint32_t events) = 0;
+
+    protected:
+        ~poll_handler() = default;
+    };
+
+    class ring_buffer;
+
+    /**
+     * A socket whose data is moved by the dispatcher itself, for dispatchers that
+     * supports_streams(). Rather than being told that the socket is readable or writable, the
+     * handler is handed what was received, and hands over what is to be sent. Hang-ups are
+     * still reported through handle_events().
+     */
+    class stream_handler : public poll_handler
+    {
+    public:
+        /**
+         * Takes bytes received from the socket. \param buf is only valid during the call, and
+         * \param bufsz is (size_t)-1 if the receive failed, in which case a hang-up follows.
+         * \return Returns false to stop receiving until poll_dispatch::resume_recv(). A few more
+         *         receives that were already underway may still arrive.
+         */
+        virtual bool handle_recv(int fd, const uint8_t* buf, size_t bufsz) = 0;
+
+        /**
+         * Reports progress on the last poll_dispatch::send().
+         * \param bytes How much was sent, or (size_t)-1 if the send failed.
+         */
+        virtual void handle_sent(int fd, size_t bytes) = 0;
+
+    protected:
+        ~stream_handler() = default;
+    };
 
     class poll_dispatch
     {
@@ -34,25 +74,84 @@ namespace theme
             e_hup = (1<<2),
         };
 
+        enum class backend
+        {
+            e_epoll,
+
+            /**
+             * io_uring multishot polls. Stream sockets are received into a ring of provided
+             * buffers and sent through the ring where the kernel can, and are otherwise polled
+             * for readiness like epoll. Falls back to epoll if the kernel can't do multishot
+             * polls.
+             */
+            e_uring,
+        };
+
     protected:
         poll_dispatch() { }
 
+    public:
+        struct stats
+        {
+            /** Calls to dispatch() that returned events. */
+            uint64_t m_waits;
+
+            /** Waits that filled the whole batch, meaning more events were likely left pending. */
+            uint64_t m_saturated;
+
+            /** Current number of events collected per wait. */
+            size_t m_batch;
+        };
+
     public:
         poll_dispatch(const poll_dispatch&) = delete;
         poll_dispatch(poll_dispatch&&) = delete;
 
         virtual ~poll_dispatch() = default;
 
-        virtual bool add_fd(int fd, events evmask, pollcb_t cb) = 0;
+        virtual bool add_fd(int fd, events evmask, poll_handler* handler) = 0;
         virtual bool remove_fd(int fd) = 0;
 
+        /** \return Returns true if sockets can be registered with add_stream(). */
+        virtual bool supports_streams() const { return false; }
+
+        /**
+         * Registers a connected socket whose data the dispatcher moves itself. It starts out
+         * receiving, and is removed with remove_fd() like any other.
+         */
+        virtual bool add_stream(int, stream_handler*) { return false; }
+
+        /** Picks receiving back up after stream_handler::handle_recv() asked to stop. */
+        virtual void resume_recv(int) { }
+
+        /**
+         * Takes everything queued in the ring and sends it. The storage is held until the
+         * send completes, even if the socket is removed in the meantime, so the caller is free
+         * to queue more. Only one send may be underway per socket: wait for
+         * stream_handler::handle_sent() to account for all of it before the next.
+         */
+        virtual bool send(int, ring_buffer&) { return false; }
+
         /** Waits for incoming events and executes dispatch callbacks.
          *  Returns: true on success, false on timeout.
          */
         virtual bool dispatch(int timeout=30000) = 0;
 
+        virtual stats get_stats() const = 0;
+
+    private:
+        static std::unique_ptr<poll_dispatch> create_epoll(size_t max_batch);
+        static std::unique_ptr<poll_dispatch> create_uring(size_t max_batch);
+
     public:
-        static std::unique_ptr<poll_dispatch> create();
+        /**
+         * Creates a dispatcher.
+         * \param type The preferred backend. If it isn't available, epoll is used instead.
+         * \param max_batch The most events that will be collected per wait. The batch starts out
+         *                  small and grows toward this when waits keep coming back full.
+         */
+        static std::unique_ptr<poll_dispatch> create(backend type=backend::e_epoll,
+                                                     size_t max_batch=1024);
     };
 };
 
@@ -0,0 +1,302 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rc4.h"
+
+#include "../core/errors.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#   include <immintrin.h>
+#endif
+
+static_assert((theme::rc4_stream::kKeystreamSize & (theme::rc4_stream::kKeystreamSize - 1)) == 0);
+
+// =================================================================================
+
+theme::rc4_stream::~rc4_stream()
+{
+    if (m_batch)
+        m_batch->m_streams[m_batchSlot] = nullptr;
+}
+
+void theme::rc4_stream::set_key(const uint8_t* key, size_t keysz)
+{
+    THEME_ASSERTD(keysz > 0);
+
+    for (size_t i = 0; i < sizeof(m_state); ++i)
+        m_state[i] = (uint8_t)i;
+
+    uint8_t j = 0;
+    for (size_t i = 0; i < sizeof(m_state); ++i) {
+        j += m_state[i] + key[i % keysz];
+        std::swap(m_state[i], m_state[j]);
+    }
+
+    m_x = 0;
+    m_y = 0;
+    m_head = 0;
+    m_avail = 0;
+    m_enabled = true;
+
+    // Keys are only set during the handshake, so there's no hurry.
+    refill();
+}
+
+void theme::rc4_stream::generate(uint8_t* out, size_t outsz)
+{
+    uint8_t x = m_x;
+    uint8_t y = m_y;
+    for (size_t i = 0; i < outsz; ++i) {
+        x++;
+        uint8_t sx = m_state[x];
+        y += sx;
+        uint8_t sy = m_state[y];
+        m_state[x] = sy;
+        m_state[y] = sx;
+        out[i] = m_state[(uint8_t)(sx + sy)];
+    }
+    m_x = x;
+    m_y = y;
+}
+
+void theme::rc4_stream::refill()
+{
+    if (!m_enabled)
+        return;
+
+    while (m_avail < kKeystreamSize) {
+        size_t count = free_run();
+        generate(m_keystream + tail(), count);
+        m_avail += count;
+    }
+}
+
+void theme::rc4_stream::refill(rc4_batch& batch)
+{
+    if (m_enabled && m_avail < kKeystreamSize && !m_batch)
+        batch.add(*this);
+}
+
+void theme::rc4_stream::apply(uint8_t* out, const uint8_t* in, size_t bufsz)
+{
+    if (!m_enabled) {
+        if (out != in)
+            memmove(out, in, bufsz);
+        return;
+    }
+
+    while (bufsz > 0) {
+        // Ran dry, so this client is busier than the idle refills can keep up with. Messages
+        // larger than the ring just go through it a ring's worth at a time.
+        if (m_avail == 0)
+            refill();
+
+        size_t count = std::min({ bufsz, m_avail, kKeystreamSize - m_head });
+        xor_bytes(out, in, m_keystream + m_head, count);
+        m_head = (m_head + count) & (kKeystreamSize - 1);
+        m_avail -= count;
+
+        out += count;
+        in += count;
+        bufsz -= count;
+    }
+}
+
+// =================================================================================
+
+theme::rc4_batch::~rc4_batch()
+{
+    for (rc4_stream* stream : m_streams) {
+        if (stream)
+            stream->m_batch = nullptr;
+    }
+}
+
+void theme::rc4_batch::add(rc4_stream& stream)
+{
+    stream.m_batch = this;
+    stream.m_batchSlot = m_streams.size();
+    m_streams.push_back(&stream);
+}
+
+namespace theme
+{
+    /** One stream's PRGA state while it is being stepped alongside others. */
+    struct rc4_lane
+    {
+        uint8_t* m_state;
+        uint8_t* m_out;
+        uint32_t m_x;
+        uint32_t m_y;
+
+        void load(rc4_stream& stream)
+        {
+            m_state = stream.m_state;
+            m_out = stream.m_keystream + stream.tail();
+            m_x = stream.m_x;
+            m_y = stream.m_y;
+        }
+
+        void store(rc4_stream& stream, size_t count) const
+        {
+            stream.m_x = (uint8_t)m_x;
+            stream.m_y = (uint8_t)m_y;
+            stream.m_avail += count;
+        }
+
+        void step(size_t i)
+        {
+            m_x = (m_x + 1) & 0xFF;
+            uint32_t sx = m_state[m_x];
+            m_y = (m_y + sx) & 0xFF;
+            uint32_t sy = m_state[m_y];
+            m_state[m_x] = sy;
+            m_state[m_y] = sx;
+            m_out[i] = m_state[(sx + sy) & 0xFF];
+        }
+    };
+
+    /**
+     * A fixed number of lanes, each one its own member rather than an array element so that
+     * the compiler can keep all of them in registers.
+     */
+    template<size_t _Lanes>
+    struct rc4_lanes
+    {
+        rc4_lane m_lane;
+        rc4_lanes<_Lanes - 1> m_rest;
+
+        void load(rc4_stream** streams)
+        {
+            m_lane.load(*streams[0]);
+            m_rest.load(streams + 1);
+        }
+
+        void store(rc4_stream** streams, size_t count) const
+        {
+            m_lane.store(*streams[0], count);
+            m_rest.store(streams + 1, count);
+        }
+
+        void step(size_t i)
+        {
+            m_lane.step(i);
+            m_rest.step(i);
+        }
+    };
+
+    template<>
+    struct rc4_lanes<0>
+    {
+        void load(rc4_stream**) { }
+        void store(rc4_stream**, size_t) const { }
+        void step(size_t) { }
+    };
+};
+
+template<size_t _Lanes>
+void theme::rc4_batch::generate_lanes(rc4_stream** streams, size_t count)
+{
+    rc4_lanes<_Lanes> lanes;
+    lanes.load(streams);
+    for (size_t i = 0; i < count; ++i)
+        lanes.step(i);
+    lanes.store(streams, count);
+}
+
+void theme::rc4_batch::run()
+{
+    rc4_stream* lanes[kLanes];
+    size_t active = 0;
+    size_t next = 0;
+
+    for (;;) {
+        // Keep every lane busy for as long as there are streams left to hand out.
+        while (active < kLanes && next < m_streams.size()) {
+            rc4_stream* stream = m_streams[next++];
+            if (!stream)
+                continue;
+            stream->m_batch = nullptr;
+            if (stream->m_enabled && stream->m_avail < rc4_stream::kKeystreamSize)
+                lanes[active++] = stream;
+        }
+        if (active == 0)
+            break;
+
+        // Nothing to interleave with, so the plain loop is as good as it gets.
+        if (active == 1) {
+            lanes[0]->refill();
+            active = 0;
+            continue;
+        }
+
+        // Step every lane until one of the rings is full or wraps around. Full streams are
+        // swapped out, and wrapped ones pick up at the start of their ring next time.
+        size_t count = rc4_stream::kKeystreamSize;
+        for (size_t l = 0; l < active; ++l)
+            count = std::min(count, lanes[l]->free_run());
+
+        static_assert(kLanes == 4);
+        switch (active) {
+        case 2: generate_lanes<2>(lanes, count); break;
+        case 3: generate_lanes<3>(lanes, count); break;
+        case 4: generate_lanes<4>(lanes, count); break;
+        }
+
+        size_t keep = 0;
+        for (size_t l = 0; l < active; ++l) {
+            if (lanes[l]->m_avail < rc4_stream::kKeystreamSize)
+                lanes[keep++] = lanes[l];
+        }
+        active = keep;
+    }
+
+    m_streams.clear();
+}
+
+// =================================================================================
+
+void theme::rc4_stream::xor_bytes(uint8_t* out, const uint8_t* in, const uint8_t* keystream,
+                                  size_t bufsz)
+{
+    // Every load in a step happens before its store, so out may alias in.
+#if defined(__AVX2__)
+    for (; bufsz >= 32; bufsz -= 32, out += 32, in += 32, keystream += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i*)in);
+        __m256i key = _mm256_loadu_si256((const __m256i*)keystream);
+        _mm256_storeu_si256((__m256i*)out, _mm256_xor_si256(data, key));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; bufsz >= 16; bufsz -= 16, out += 16, in += 16, keystream += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)in);
+        __m128i key = _mm_loadu_si128((const __m128i*)keystream);
+        _mm_storeu_si128((__m128i*)out, _mm_xor_si128(data, key));
+    }
+#endif
+    for (; bufsz >= 8; bufsz -= 8, out += 8, in += 8, keystream += 8) {
+        uint64_t data, key;
+        memcpy(&data, in, sizeof(data));
+        memcpy(&key, keystream, sizeof(key));
+        data ^= key;
+        memcpy(out, &data, sizeof(data));
+    }
+    for (; bufsz > 0; --bufsz)
+        *out++ = *in++ ^ *keystream++;
+}
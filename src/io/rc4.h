@@ -0,0 +1,144 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IO_RC4_H
+#define __IO_RC4_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace theme
+{
+    class rc4_batch;
+    struct rc4_lane;
+
+    /**
+     * One direction of a client's RC4 stream.
+     * The keystream doesn't depend on the data, so it is generated ahead of time into a small
+     * ring whenever the client has nothing better to do. Encrypting and decrypting are then just
+     * an XOR against the ring, which is cheap even for the one and two byte fields that make up
+     * most messages. Until a key is set, data passes through untouched.
+     */
+    class rc4_stream
+    {
+    public:
+        /** Bytes of keystream kept on hand. Must be a power of two. */
+        static constexpr size_t kKeystreamSize = 256;
+
+    private:
+        alignas(32) uint8_t m_keystream[kKeystreamSize];
+        uint8_t m_state[256];
+        uint8_t m_x;
+        uint8_t m_y;
+        bool m_enabled;
+
+        /** Position of the next unused keystream byte in the ring. */
+        size_t m_head;
+        size_t m_avail;
+
+        /** The batch this stream is waiting in for a refill, if any. */
+        rc4_batch* m_batch;
+        size_t m_batchSlot;
+
+        friend class rc4_batch;
+        friend struct rc4_lane;
+
+    private:
+        void generate(uint8_t* out, size_t outsz);
+
+        /** Position in the ring where the next generated keystream byte goes. */
+        size_t tail() const { return (m_head + m_avail) & (kKeystreamSize - 1); }
+
+        /** Bytes that can be generated from tail() before the ring is full or wraps around. */
+        size_t free_run() const
+        {
+            size_t tail = this->tail();
+            return m_avail == kKeystreamSize ? 0 : (tail < m_head ? m_head : kKeystreamSize) - tail;
+        }
+
+    public:
+        rc4_stream()
+            : m_x(), m_y(), m_enabled(), m_head(), m_avail(), m_batch(), m_batchSlot()
+        { }
+        rc4_stream(const rc4_stream&) = delete;
+        rc4_stream(rc4_stream&&) = delete;
+        ~rc4_stream();
+
+    public:
+        void set_key(const uint8_t* key, size_t keysz);
+        bool enabled() const { return m_enabled; }
+
+        /** Tops up the keystream ring so that the next kKeystreamSize bytes are free. */
+        void refill();
+
+        /** Tops up the keystream ring the next time \param batch runs. */
+        void refill(rc4_batch& batch);
+
+        /**
+         * Encrypts or decrypts \param bufsz bytes of \param in into \param out.
+         * The two may be the same buffer.
+         */
+        void apply(uint8_t* out, const uint8_t* in, size_t bufsz);
+
+    public:
+        /** XORs \param bufsz bytes of \param in with \param keystream into \param out. */
+        static void xor_bytes(uint8_t* out, const uint8_t* in, const uint8_t* keystream,
+                              size_t bufsz);
+    };
+
+    /**
+     * Refills many streams' keystream rings at once.
+     * Each RC4 step depends on the one before it, so a single stream spends most of its time
+     * waiting on S-box loads. Streams are independent of each other, though, so running a few
+     * of them in lockstep keeps that many loads in flight at a time. A reactor queues up the
+     * streams its clients drained while handling events and refills them all in one go
+     * afterward. Streams that go away before then take themselves out of the queue.
+     */
+    class rc4_batch
+    {
+    public:
+        /**
+         * Number of streams that are stepped together. Much past this, x86-64 runs out of
+         * registers to hold them all and it gets slower again.
+         */
+        static constexpr size_t kLanes = 4;
+
+    private:
+        std::vector<rc4_stream*> m_streams;
+
+        template<size_t _Lanes>
+        static void generate_lanes(rc4_stream** streams, size_t count);
+
+        friend class rc4_stream;
+        void add(rc4_stream& stream);
+
+    public:
+        rc4_batch() = default;
+        rc4_batch(const rc4_batch&) = delete;
+        rc4_batch(rc4_batch&&) = delete;
+        ~rc4_batch();
+
+    public:
+        bool empty() const { return m_streams.empty(); }
+        size_t size() const { return m_streams.size(); }
+
+        /** Refills every queued stream and empties the queue. */
+        void run();
+    };
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ring_buffer.h"
+#include "../core/errors.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/uio.h>
+#include <utility>
+
+// =================================================================================
+
+bool theme::ring_buffer::reserve(theme::buffer_pool& pool, size_t bytes)
+{
+    if (m_capacity - m_size >= bytes)
+        return true;
+
+    size_t capacity = std::max(m_capacity, buffer_pool::kSizeClasses[0]);
+    while (capacity - m_size < bytes)
+        capacity <<= 1;
+
+    buffer_ptr_t buf = pool.alloc(capacity);
+    if (!buf)
+        return false;
+
+    // Linearize the old contents at the front of the new storage.
+    if (m_size > 0) {
+        size_t first = std::min(m_size, m_capacity - m_head);
+        memcpy(buf.get(), m_buf.get() + m_head, first);
+        memcpy(buf.get() + first, m_buf.get(), m_size - first);
+    }
+
+    m_buf = std::move(buf);
+    m_capacity = capacity;
+    m_head = 0;
+    return true;
+}
+
+std::tuple<uint8_t*, size_t> theme::ring_buffer::writable()
+{
+    size_t tail = (m_head + m_size) & mask();
+    size_t free = m_capacity - m_size;
+    return std::make_tuple(m_buf.get() + tail, std::min(free, m_capacity - tail));
+}
+
+void theme::ring_buffer::commit(size_t bytes)
+{
+    THEME_ASSERTD(m_size + bytes <= m_capacity);
+    m_size += bytes;
+}
+
+// =================================================================================
+
+int theme::ring_buffer::readable(iovec (&iov)[2]) const
+{
+    if (m_size == 0)
+        return 0;
+
+    size_t first = std::min(m_size, m_capacity - m_head);
+    iov[0].iov_base = m_buf.get() + m_head;
+    iov[0].iov_len = first;
+    if (first == m_size)
+        return 1;
+
+    iov[1].iov_base = m_buf.get();
+    iov[1].iov_len = m_size - first;
+    return 2;
+}
+
+std::tuple<const uint8_t*, size_t> theme::ring_buffer::readable() const
+{
+    if (m_size == 0)
+        return std::make_tuple(nullptr, 0);
+    return std::make_tuple(m_buf.get() + m_head, std::min(m_size, m_capacity - m_head));
+}
+
+void theme::ring_buffer::consume(size_t bytes)
+{
+    THEME_ASSERTD(bytes <= m_size);
+    m_size -= bytes;
+    if (m_size == 0) {
+        // Give the storage back to the pool while we have nothing to say.
+        shrink();
+    } else {
+        m_head = (m_head + bytes) & mask();
+    }
+}
+
+void theme::ring_buffer::shrink()
+{
+    if (m_size == 0) {
+        m_buf.reset();
+        m_capacity = 0;
+        m_head = 0;
+    }
+}
+
+void theme::ring_buffer::swap(theme::ring_buffer& other)
+{
+    std::swap(m_buf, other.m_buf);
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_head, other.m_head);
+    std::swap(m_size, other.m_size);
+}
@@ -0,0 +1,81 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IO_RING_BUFFER_H
+#define __IO_RING_BUFFER_H
+
+#include "buffer_pool.h"
+
+#include <tuple>
+
+struct iovec;
+
+namespace theme
+{
+    /**
+     * A contiguous byte FIFO whose storage is drawn from a buffer_pool.
+     * The storage is only held while there is data in the ring, so idle clients don't pin
+     * any memory. The capacity is always a power of two.
+     */
+    class ring_buffer
+    {
+        buffer_ptr_t m_buf;
+        size_t m_capacity;
+        size_t m_head;
+        size_t m_size;
+
+        size_t mask() const { return m_capacity - 1; }
+
+    public:
+        ring_buffer()
+            : m_buf(nullptr, { nullptr, 0 }), m_capacity(), m_head(), m_size()
+        { }
+        ring_buffer(const ring_buffer&) = delete;
+        ring_buffer(ring_buffer&&) = delete;
+
+    public:
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        /** Ensures that at least \param bytes can be appended without reallocating. */
+        bool reserve(buffer_pool& pool, size_t bytes);
+
+        /**
+         * Returns the contiguous free space at the tail of the ring.
+         * After filling some of it, call commit() with the number of bytes written.
+         */
+        std::tuple<uint8_t*, size_t> writable();
+        void commit(size_t bytes);
+
+        /**
+         * Fills in up to two iovecs that describe the queued data, in order.
+         * \return The number of iovecs used.
+         */
+        int readable(iovec (&iov)[2]) const;
+
+        /** Returns the contiguous run of queued data at the head of the ring. */
+        std::tuple<const uint8_t*, size_t> readable() const;
+        void consume(size_t bytes);
+
+        /** Gives the storage back to the pool if the ring is empty. */
+        void shrink();
+
+        /** Trades contents, storage and all, with \param other. */
+        void swap(ring_buffer& other);
+    };
+};
+
+#endif
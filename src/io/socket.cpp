@@ -50,7 +50,7 @@ theme::socket::~socket()
 
 // =================================================================================
 
-bool theme::socket::bind(const char* addr, uint16_t port)
+bool theme::socket::bind(const char* addr, uint16_t port, bool reuseport)
 {
     s_log.info("bind() using host: {} port: {}", addr, port);
 
@@ -71,14 +71,21 @@ bool theme::socket::bind(const char* addr, uint16_t port)
         return false;
     }
 
-    for (addrinfo* it = addrListPtr; it != nullptr; it = addrListPtr->ai_next) {
+    for (addrinfo* it = addrListPtr; it != nullptr; it = it->ai_next) {
         int fd = ::socket(it->ai_family, (it->ai_socktype | SOCK_NONBLOCK), it->ai_protocol);
         if (fd == -1)
             continue;
 
+        // These only have an effect if they are set before the socket is bound.
+        if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &SOCK_YES, sizeof(SOCK_YES)) != 0)
+            s_log.warning("bind() failed to set SO_REUSEADDR");
+        if (reuseport && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &SOCK_YES, sizeof(SOCK_YES)) != 0) {
+            s_log.error("bind() failed to set SO_REUSEPORT: {}", strerror(errno));
+            THEME_ASSERTD(close(fd) == 0);
+            continue;
+        }
+
         if (::bind(fd, it->ai_addr, it->ai_addrlen) == 0) {
-            if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &SOCK_YES, sizeof(SOCK_YES)) != 0)
-                s_log.warning("bind() failed to set SO_REUSEADDR");
             s_log.debug("bind() success!");
             setfd(fd, it->ai_addr);
             return true;
@@ -102,7 +109,7 @@ bool theme::socket::listen(int backlog)
     return true;
 }
 
-bool theme::socket::accept(theme::socket& client)
+bool theme::socket::accept(theme::socket& client, sockaddr_storage* remote)
 {
     sockaddr_t addr{};
     socklen_t len = sizeof(addr);
@@ -116,9 +123,54 @@ bool theme::socket::accept(theme::socket& client)
     }
 
     client.setfd(result, (sockaddr*)&addr);
+    if (remote)
+        *remote = addr.m_storage;
     return true;
 }
 
+bool theme::socket::connect(const char* addr, uint16_t port)
+{
+    addrinfo info{};
+    info.ai_family = AF_INET;
+    info.ai_socktype = SOCK_STREAM;
+
+    char portstr[64];
+    snprintf(portstr, sizeof(portstr), "%i", port);
+    portstr[sizeof(portstr)-1] = 0;
+
+    addrinfoptr_t addrList{ nullptr, [](addrinfo* x) { if (x) freeaddrinfo(x); } };
+    addrinfo* addrListPtr = addrList.get();
+    if (getaddrinfo(addr, portstr, &info, &addrListPtr) < 0) {
+        s_log.error("connect() getaddrinfo() failed {}", strerror(errno));
+        return false;
+    }
+    addrList.reset(addrListPtr);
+
+    for (addrinfo* it = addrListPtr; it != nullptr; it = it->ai_next) {
+        int fd = ::socket(it->ai_family, (it->ai_socktype | SOCK_NONBLOCK), it->ai_protocol);
+        if (fd == -1)
+            continue;
+
+        if (::connect(fd, it->ai_addr, it->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            setfd(fd, it->ai_addr);
+            return true;
+        } else {
+            s_log.debug("connect() to {}/{} failed: {}", addr, port, strerror(errno));
+            THEME_ASSERTD(close(fd) == 0);
+        }
+    }
+    return false;
+}
+
+int theme::socket::get_error() const
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (::getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        return errno;
+    return error;
+}
+
 bool theme::socket::shutdown()
 {
     if (::shutdown(m_fd, SHUT_RDWR) == -1) {
@@ -143,7 +195,9 @@ std::tuple<bool, size_t> theme::socket::read(size_t bufsz, uint8_t* const buf)
 
 std::tuple<bool, size_t> theme::socket::write(size_t bufsz, const uint8_t* const buf)
 {
-    ssize_t nwrite = ::write(m_fd, buf, bufsz);
+    // Peers love to reset the connection while we still have a reply in flight. Don't let that
+    // SIGPIPE the whole daemon.
+    ssize_t nwrite = ::send(m_fd, buf, bufsz, MSG_NOSIGNAL);
     if (nwrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         return std::make_tuple(false, 0);
     } else if (nwrite == -1) {
@@ -154,6 +208,23 @@ std::tuple<bool, size_t> theme::socket::write(size_t bufsz, const uint8_t* const
     }
 }
 
+std::tuple<bool, size_t> theme::socket::writev(const iovec* iov, int iovcnt)
+{
+    msghdr msg{};
+    msg.msg_iov = (iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t nwrite = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+    if (nwrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return std::make_tuple(false, 0);
+    } else if (nwrite == -1) {
+        s_log.warning("{}: writev failed on fd {}: {}", m_addr, m_fd, strerror(errno));
+        return std::make_tuple(false, -1);
+    } else {
+        return std::make_tuple(true, (size_t)nwrite);
+    }
+}
+
 // =================================================================================
 
 void theme::socket::setfd(int fd)
@@ -22,6 +22,7 @@
 
 struct iovec;
 struct sockaddr;
+struct sockaddr_storage;
 
 namespace theme
 {
@@ -51,12 +52,24 @@ namespace theme
         ~socket();
 
     public:
-        bool bind(const char* addr, uint16_t port);
+        bool bind(const char* addr, uint16_t port, bool reuseport=false);
         bool listen(int backlog=10);
-        bool accept(socket& client);
+        /**
+         * Accepts a pending connection.
+         * \param addr If non-null, receives the address of the remote endpoint.
+         */
+        bool accept(socket& client, sockaddr_storage* addr=nullptr);
+        /**
+         * Starts connecting to a remote host.
+         * The socket is non-blocking, so the connection is only established once the socket
+         * becomes writable. Check for errors with get_error() at that point.
+         */
+        bool connect(const char* addr, uint16_t port);
+        int get_error() const;
         bool shutdown();
         std::tuple<bool, size_t> read(size_t bufsz, uint8_t* const buf);
         std::tuple<bool, size_t> write(size_t bufsz, const uint8_t* const buf);
+        std::tuple<bool, size_t> writev(const iovec* iov, int iovcnt);
 
         void setfd(int fd);
         void setfd(int fd, sockaddr* addr);
@@ -0,0 +1,171 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timer_wheel.h"
+#include "../core/errors.h"
+
+#include <algorithm>
+
+// =================================================================================
+
+void theme::timer::link(theme::timer& head)
+{
+    m_prev = head.m_prev;
+    m_next = &head;
+    head.m_prev->m_next = this;
+    head.m_prev = this;
+}
+
+void theme::timer::cancel()
+{
+    if (m_next) {
+        m_prev->m_next = m_next;
+        m_next->m_prev = m_prev;
+        m_prev = nullptr;
+        m_next = nullptr;
+    }
+}
+
+// =================================================================================
+
+theme::timer_wheel::timer_wheel(clock_t::time_point epoch)
+    : m_epoch(epoch), m_now()
+{
+    // Each slot is the sentinel of a circular list.
+    for (auto& level : m_slots) {
+        for (timer& head : level) {
+            head.m_prev = &head;
+            head.m_next = &head;
+        }
+    }
+}
+
+theme::timer_wheel::~timer_wheel()
+{
+    // Don't leave anyone pointing at a dead sentinel.
+    for (auto& level : m_slots) {
+        for (timer& head : level) {
+            while (!head.empty())
+                head.m_next->cancel();
+        }
+    }
+}
+
+// =================================================================================
+
+uint64_t theme::timer_wheel::ticks(clock_t::time_point when) const
+{
+    return (when - m_epoch) / kTick;
+}
+
+void theme::timer_wheel::insert(theme::timer& t)
+{
+    // Timers that are already late go in the slot that is up next.
+    t.m_expires = std::max(t.m_expires, m_now);
+
+    size_t level = 0;
+    uint64_t delta = t.m_expires - m_now;
+    while (level + 1 < kLevels && delta >= ((uint64_t)1 << (kLevelBits * (level + 1))))
+        level++;
+
+    // Anything further out than the wheel can represent just waits at the far end.
+    uint64_t range = (uint64_t)1 << (kLevelBits * kLevels);
+    if (delta >= range)
+        t.m_expires = m_now + range - 1;
+
+    size_t slot = (t.m_expires >> (kLevelBits * level)) & (kSlots - 1);
+    t.link(m_slots[level][slot]);
+}
+
+size_t theme::timer_wheel::cascade(size_t level)
+{
+    size_t slot = (m_now >> (kLevelBits * level)) & (kSlots - 1);
+    timer& head = m_slots[level][slot];
+
+    // Everything in this slot is now close enough to be sorted into the lower levels.
+    while (!head.empty()) {
+        timer& t = *head.m_next;
+        t.cancel();
+        insert(t);
+    }
+    return slot;
+}
+
+void theme::timer_wheel::schedule(theme::timer& t, std::chrono::milliseconds delay,
+                                  clock_t::time_point now)
+{
+    THEME_ASSERTD(t.m_handler != nullptr);
+    t.cancel();
+
+    // Round up so that timers never fire early.
+    auto when = now + delay;
+    t.m_expires = ticks(when) + 1;
+    insert(t);
+}
+
+void theme::timer_wheel::advance(clock_t::time_point now)
+{
+    uint64_t target = ticks(now);
+    for (; m_now <= target; ++m_now) {
+        size_t slot = m_now & (kSlots - 1);
+        if (slot == 0) {
+            for (size_t level = 1; level < kLevels; ++level) {
+                if (cascade(level) != 0)
+                    break;
+            }
+        }
+
+        // Handlers are free to reschedule themselves or cancel each other, so pull the timers
+        // off of the wheel one at a time.
+        timer& head = m_slots[0][slot];
+        while (!head.empty()) {
+            timer& t = *head.m_next;
+            t.cancel();
+            t.m_handler->handle_timeout(t);
+        }
+    }
+}
+
+int theme::timer_wheel::next_timeout(int limit, clock_t::time_point now) const
+{
+    // Anything less than a full revolution away sits on the lowest level, which may be past the
+    // point where the level wraps around, so look at every slot.
+    uint64_t next = UINT64_MAX;
+    for (uint64_t tick = m_now; tick < m_now + kSlots; ++tick) {
+        if (!m_slots[0][tick & (kSlots - 1)].empty()) {
+            next = tick;
+            break;
+        }
+    }
+
+    // The higher levels cascade down when the lowest one wraps, and may hold timers due before
+    // anything found above, so we need to be awake for that.
+    uint64_t wrap = m_now + kSlots - (m_now & (kSlots - 1));
+    if (next > wrap) {
+        for (size_t level = 1; level < kLevels; ++level) {
+            if (std::any_of(std::begin(m_slots[level]), std::end(m_slots[level]),
+                            [](const timer& head) { return !head.empty(); })) {
+                next = wrap;
+                break;
+            }
+        }
+    }
+    if (next == UINT64_MAX)
+        return limit;
+
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(m_epoch + next * kTick - now);
+    return (int)std::clamp<int64_t>(delay.count(), 0, limit);
+}
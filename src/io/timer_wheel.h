@@ -0,0 +1,116 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IO_TIMER_WHEEL_H
+#define __IO_TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace theme
+{
+    class timer;
+
+    /** Receives the expiration of a timer. */
+    class timer_handler
+    {
+    public:
+        virtual void handle_timeout(timer& t) = 0;
+
+    protected:
+        ~timer_handler() = default;
+    };
+
+    /**
+     * An intrusive timer that can be scheduled on a timer_wheel.
+     * Cancelling is O(1) and doesn't need the wheel, so it is safe to let a timer die while armed.
+     */
+    class timer final
+    {
+        timer* m_prev;
+        timer* m_next;
+        uint64_t m_expires;
+        timer_handler* m_handler;
+
+        friend class timer_wheel;
+        void link(timer& head);
+        bool empty() const { return m_next == this; }
+
+    public:
+        timer(timer_handler* handler=nullptr)
+            : m_prev(), m_next(), m_expires(), m_handler(handler)
+        { }
+        timer(const timer&) = delete;
+        timer(timer&&) = delete;
+        ~timer() { cancel(); }
+
+    public:
+        bool armed() const { return m_next != nullptr; }
+        void cancel();
+    };
+
+    /**
+     * A hierarchical timing wheel.
+     * Scheduling and cancelling are O(1) no matter how many timers are armed, which keeps a
+     * deadline on every client affordable. Like the rest of a reactor, this is NOT thread safe.
+     */
+    class timer_wheel
+    {
+    public:
+        typedef std::chrono::steady_clock clock_t;
+
+        /** The wheel's resolution. Timers may fire up to one tick late. */
+        static constexpr std::chrono::milliseconds kTick{100};
+
+    private:
+        static constexpr size_t kLevelBits = 6;
+        static constexpr size_t kSlots = 1 << kLevelBits;
+        static constexpr size_t kLevels = 4;
+
+        timer m_slots[kLevels][kSlots];
+        clock_t::time_point m_epoch;
+
+        /** The next tick to be processed. */
+        uint64_t m_now;
+
+        uint64_t ticks(clock_t::time_point when) const;
+        void insert(timer& t);
+        size_t cascade(size_t level);
+
+    public:
+        timer_wheel(clock_t::time_point epoch=clock_t::now());
+        timer_wheel(const timer_wheel&) = delete;
+        timer_wheel(timer_wheel&&) = delete;
+        ~timer_wheel();
+
+    public:
+        /** (Re)schedules a timer to expire after \param delay. */
+        void schedule(timer& t, std::chrono::milliseconds delay,
+                      clock_t::time_point now=clock_t::now());
+
+        /** Fires every timer that has expired by \param now. */
+        void advance(clock_t::time_point now=clock_t::now());
+
+        /**
+         * Determines how long the dispatcher may sleep without making a timer late.
+         * \return Returns the number of milliseconds, clamped to \param limit.
+         */
+        int next_timeout(int limit, clock_t::time_point now=clock_t::now()) const;
+    };
+};
+
+#endif
@@ -0,0 +1,815 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "poll.h"
+#include "ring_buffer.h"
+#include "../core/errors.h"
+#include "../core/log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <liburing.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// =================================================================================
+
+static theme::log s_log{"URING"};
+
+// Marks completions for our own poll removals and cancellations, which nobody cares about.
+constexpr uint64_t kIgnoreCompletion = UINT64_MAX;
+
+// Marks the receive probe, which may complete behind ignored completions from the poll probe.
+constexpr uint64_t kProbeCompletion = UINT64_MAX - 1;
+
+// Stream sockets receive into a ring of buffers this size, which the kernel picks from.
+constexpr uint16_t kRecvBufferGroup = 0;
+constexpr size_t kRecvBufferSize = 4096;
+
+// =================================================================================
+
+namespace theme
+{
+    /**
+     * A backend on top of io_uring multishot polls and, where the kernel can, multishot receives.
+     * Plain fds are polled for readiness like epoll, with registrations, re-arms, and removals
+     * riding along with the wait instead of each costing an epoll_ctl() syscall. Stream sockets
+     * skip readiness altogether: the kernel receives into a ring of buffers we provide and sends
+     * what we hand it, so the data moves without a read() or writev() per event.
+     */
+    class uring_dispatch : public poll_dispatch
+    {
+        /** What a submission was for, which is stashed in its user data beside the fd. */
+        enum operation : uint32_t
+        {
+            e_poll,
+            e_recv,
+            e_send,
+        };
+
+        struct stream
+        {
+            stream_handler* m_handler;
+            int m_fd;
+            uint32_t m_generation;
+
+            /** A multishot receive is armed. */
+            bool m_recving;
+
+            /** The handler asked to stop receiving. */
+            bool m_paused;
+
+            /** While paused, a poll watches for hang-ups in place of the receive. */
+            bool m_watching;
+
+            /** Output the kernel is sending from, and the message describing it. */
+            ring_buffer m_sending;
+            msghdr m_msg;
+            iovec m_iov[2];
+        };
+
+        struct slot
+        {
+            poll_handler* m_handler;
+            uint32_t m_generation;
+            uint32_t m_mask;
+            std::unique_ptr<stream> m_stream;
+        };
+
+        struct completion
+        {
+            uint64_t m_data;
+            int32_t m_result;
+            uint32_t m_flags;
+        };
+
+        io_uring m_ring;
+        bool m_ready;
+
+        /**
+         * Handlers indexed by fd. Each registration gets a new generation, which is stashed in
+         * the poll's user data so that completions from a previous owner of the fd are dropped.
+         */
+        std::vector<slot> m_handlers;
+        uint32_t m_generation;
+
+        /** Streams that were removed while the kernel was still sending from them. */
+        std::vector<std::unique_ptr<stream>> m_retired;
+
+        /** Provided buffers for stream receives. Null if the kernel can't do them. */
+        io_uring_buf_ring* m_recvRing;
+        size_t m_recvRingsz;
+        std::unique_ptr<uint8_t[]> m_recvBufs;
+        unsigned m_nrecvBufs;
+
+        std::vector<completion> m_completions;
+        uint64_t m_waits;
+        uint64_t m_saturated;
+
+        inline uint32_t xlate_mask_to_poll(events mask) const;
+        inline events xlate_poll_to_mask(uint32_t events) const;
+
+        static uint64_t make_data(int fd, uint32_t generation, operation op)
+        {
+            return ((uint64_t)generation << 32) | ((uint64_t)op << 30) | (uint32_t)fd;
+        }
+
+        bool probe();
+        bool probe_streams(unsigned nbufs);
+        io_uring_sqe* get_sqe();
+        void arm(int fd, const slot& s);
+        void disarm(int fd, const slot& s);
+        void cancel(uint64_t data);
+        io_uring_sqe* arm_recv(stream& st);
+        void watch(stream& st);
+        void unwatch(stream& st);
+        void submit_send(stream& st);
+        void recycle(uint16_t bid);
+
+        /** Drops everything registered for \param fd, leaving in-flight sends to finish. */
+        void release(int fd, slot& s);
+
+        void complete_poll(int fd, uint32_t generation, const completion& c);
+        void complete_recv(int fd, uint32_t generation, const completion& c);
+        void complete_send(int fd, uint32_t generation, const completion& c);
+
+        /** Reports a hang-up, which is an implicit removal like it is with epoll. */
+        void hangup(int fd, uint32_t generation);
+
+    public:
+        uring_dispatch(size_t max_batch);
+        ~uring_dispatch();
+
+        bool ready() const { return m_ready; }
+
+        bool add_fd(int fd, events evmask, poll_handler* handler) override;
+        bool remove_fd(int fd) override;
+
+        bool supports_streams() const override { return m_recvRing != nullptr; }
+        bool add_stream(int fd, stream_handler* handler) override;
+        void resume_recv(int fd) override;
+        bool send(int fd, ring_buffer& data) override;
+
+        bool dispatch(int timeout=30000) override;
+
+        stats get_stats() const override;
+    };
+};
+
+// =================================================================================
+
+uint32_t theme::uring_dispatch::xlate_mask_to_poll(events mask) const
+{
+    uint32_t poll_events = 0;
+    if (mask & events::e_read)
+        poll_events |= POLLIN;
+    if (mask & events::e_write)
+        poll_events |= POLLOUT;
+    if (mask & events::e_hup)
+        poll_events |= POLLRDHUP | POLLHUP;
+    return poll_events;
+}
+
+theme::poll_dispatch::events theme::uring_dispatch::xlate_poll_to_mask(uint32_t events) const
+{
+    uint32_t mask = 0;
+    if (events & POLLIN)
+        mask |= events::e_read;
+    if (events & POLLOUT)
+        mask |= events::e_write;
+    if (events & POLLRDHUP || events & POLLHUP || events & POLLERR)
+        mask |= events::e_hup;
+    return (poll_dispatch::events)mask;
+}
+
+// =================================================================================
+
+theme::uring_dispatch::uring_dispatch(size_t max_batch)
+    : m_ring(), m_ready(), m_generation(), m_recvRing(), m_recvRingsz(), m_nrecvBufs(),
+      m_waits(), m_saturated()
+{
+    io_uring_params params{};
+    int result = io_uring_queue_init_params(std::clamp(max_batch, (size_t)64, (size_t)4096),
+                                            &m_ring, &params);
+    if (result < 0) {
+        s_log.debug("io_uring_queue_init_params() failed: {}", strerror(-result));
+        return;
+    }
+
+    // Waiting with a timeout needs the extended enter arguments.
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !probe()) {
+        s_log.debug("kernel io_uring is too old (features {x})", params.features);
+        io_uring_queue_exit(&m_ring);
+        return;
+    }
+
+    // Streams are a bonus. Without them, everything is polled.
+    if (!probe_streams(params.sq_entries))
+        s_log.debug("kernel io_uring can't receive into provided buffers, polling all sockets");
+
+    m_completions.resize(params.cq_entries);
+    m_ready = true;
+}
+
+theme::uring_dispatch::~uring_dispatch()
+{
+    if (m_ready)
+        io_uring_queue_exit(&m_ring);
+    if (m_recvRing)
+        munmap(m_recvRing, m_recvRingsz);
+}
+
+// =================================================================================
+
+bool theme::uring_dispatch::probe()
+{
+    io_uring_probe* ops = io_uring_get_probe_ring(&m_ring);
+    if (!ops)
+        return false;
+    bool supported = io_uring_opcode_supported(ops, IORING_OP_POLL_ADD) &&
+                     io_uring_opcode_supported(ops, IORING_OP_POLL_REMOVE);
+    io_uring_free_probe(ops);
+    if (!supported)
+        return false;
+
+    // Multishot is a flag on IORING_OP_POLL_ADD with no opcode or feature bit of its own, so
+    // the only way to know is to try one on an eventfd that is already readable. Older kernels
+    // either reject the flag or complete the poll for good.
+    int fd = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        s_log.debug("eventfd() failed: {}", strerror(errno));
+        return false;
+    }
+
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+    sqe->user_data = kIgnoreCompletion;
+
+    io_uring_cqe* cqe;
+    int result = io_uring_submit_and_wait(&m_ring, 1);
+    if (result >= 0)
+        result = io_uring_wait_cqe(&m_ring, &cqe);
+    if (result < 0) {
+        s_log.debug("multishot poll probe failed: {}", strerror(-result));
+        close(fd);
+        return false;
+    }
+    bool multishot = cqe->res >= 0 && (cqe->flags & IORING_CQE_F_MORE);
+    io_uring_cqe_seen(&m_ring, cqe);
+
+    // The poll (if it is still armed) and its removal complete as ignored completions in the
+    // first dispatch().
+    if (multishot) {
+        sqe = get_sqe();
+        io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, nullptr, 0, 0);
+        sqe->addr = kIgnoreCompletion;
+        sqe->user_data = kIgnoreCompletion;
+    }
+    close(fd);
+    return multishot;
+}
+
+bool theme::uring_dispatch::probe_streams(unsigned nbufs)
+{
+    io_uring_probe* ops = io_uring_get_probe_ring(&m_ring);
+    if (!ops)
+        return false;
+    bool supported = io_uring_opcode_supported(ops, IORING_OP_RECV) &&
+                     io_uring_opcode_supported(ops, IORING_OP_SENDMSG) &&
+                     io_uring_opcode_supported(ops, IORING_OP_ASYNC_CANCEL);
+    io_uring_free_probe(ops);
+    if (!supported)
+        return false;
+
+    // The ring of provided buffers has to be page aligned, so it gets its own mapping.
+    size_t ringsz = nbufs * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, ringsz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        s_log.debug("mmap() failed: {}", strerror(errno));
+        return false;
+    }
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (uintptr_t)ring;
+    reg.ring_entries = nbufs;
+    reg.bgid = kRecvBufferGroup;
+    int result = io_uring_register_buf_ring(&m_ring, &reg, 0);
+    if (result < 0) {
+        s_log.debug("io_uring_register_buf_ring() failed: {}", strerror(-result));
+        munmap(ring, ringsz);
+        return false;
+    }
+
+    m_recvRing = (io_uring_buf_ring*)ring;
+    m_recvRingsz = ringsz;
+    m_recvBufs = std::make_unique<uint8_t[]>(nbufs * kRecvBufferSize);
+    m_nrecvBufs = nbufs;
+    for (unsigned i = 0; i < nbufs; ++i)
+        recycle(i);
+
+    // Like multishot polls, multishot receives are only a flag, so try one on a socket that
+    // already has something to read.
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        s_log.debug("socketpair() failed: {}", strerror(errno));
+        return false;
+    }
+
+    bool multishot = false;
+    if (::send(fds[1], "", 1, MSG_NOSIGNAL) == 1) {
+        stream probe{};
+        probe.m_fd = fds[0];
+        arm_recv(probe)->user_data = kProbeCompletion;
+
+        io_uring_cqe* cqe;
+        result = io_uring_submit_and_wait(&m_ring, 1);
+        while (result >= 0) {
+            result = io_uring_wait_cqe(&m_ring, &cqe);
+            if (result < 0 || cqe->user_data == kProbeCompletion)
+                break;
+            io_uring_cqe_seen(&m_ring, cqe);
+        }
+        if (result >= 0) {
+            multishot = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) &&
+                        (cqe->flags & IORING_CQE_F_BUFFER);
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            io_uring_cqe_seen(&m_ring, cqe);
+        }
+    }
+
+    // Hanging up ends the receive (if it is still armed) with a completion that the first
+    // dispatch() skips.
+    close(fds[0]);
+    close(fds[1]);
+    if (!multishot) {
+        m_recvBufs.reset();
+        m_nrecvBufs = 0;
+        io_uring_unregister_buf_ring(&m_ring, kRecvBufferGroup);
+        munmap(m_recvRing, m_recvRingsz);
+        m_recvRing = nullptr;
+    }
+    return multishot;
+}
+
+// =================================================================================
+
+io_uring_sqe* theme::uring_dispatch::get_sqe()
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    if (!sqe) {
+        // The submission queue is full, so push what we have to the kernel early.
+        io_uring_submit(&m_ring);
+        sqe = io_uring_get_sqe(&m_ring);
+        THEME_ASSERTR(sqe != nullptr);
+    }
+    return sqe;
+}
+
+void theme::uring_dispatch::arm(int fd, const slot& s)
+{
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_poll_multishot(sqe, fd, s.m_mask);
+    sqe->user_data = make_data(fd, s.m_generation, e_poll);
+}
+
+void theme::uring_dispatch::disarm(int fd, const slot& s)
+{
+    // io_uring_prep_poll_remove() changed its signature between liburing releases.
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, nullptr, 0, 0);
+    sqe->addr = make_data(fd, s.m_generation, e_poll);
+    sqe->user_data = kIgnoreCompletion;
+}
+
+void theme::uring_dispatch::cancel(uint64_t data)
+{
+    // As has io_uring_prep_cancel().
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_rw(IORING_OP_ASYNC_CANCEL, sqe, -1, nullptr, 0, 0);
+    sqe->addr = data;
+    sqe->user_data = kIgnoreCompletion;
+}
+
+io_uring_sqe* theme::uring_dispatch::arm_recv(stream& st)
+{
+    // The multishot receive helper is newer than the flag, so set it up by hand.
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_rw(IORING_OP_RECV, sqe, st.m_fd, nullptr, 0, 0);
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kRecvBufferGroup;
+    sqe->user_data = make_data(st.m_fd, st.m_generation, e_recv);
+    st.m_recving = true;
+    return sqe;
+}
+
+void theme::uring_dispatch::watch(stream& st)
+{
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_poll_multishot(sqe, st.m_fd, POLLRDHUP | POLLHUP);
+    sqe->user_data = make_data(st.m_fd, st.m_generation, e_poll);
+    st.m_watching = true;
+}
+
+void theme::uring_dispatch::unwatch(stream& st)
+{
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, nullptr, 0, 0);
+    sqe->addr = make_data(st.m_fd, st.m_generation, e_poll);
+    sqe->user_data = kIgnoreCompletion;
+    st.m_watching = false;
+}
+
+void theme::uring_dispatch::submit_send(stream& st)
+{
+    // The message only has to live until it is submitted, but the data has to live until the
+    // send completes, which is why the stream holds on to it.
+    int iovcnt = st.m_sending.readable(st.m_iov);
+    st.m_msg = {};
+    st.m_msg.msg_iov = st.m_iov;
+    st.m_msg.msg_iovlen = iovcnt;
+
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_sendmsg(sqe, st.m_fd, &st.m_msg, MSG_NOSIGNAL);
+    sqe->user_data = make_data(st.m_fd, st.m_generation, e_send);
+}
+
+void theme::uring_dispatch::recycle(uint16_t bid)
+{
+    io_uring_buf_ring_add(m_recvRing, m_recvBufs.get() + bid * kRecvBufferSize, kRecvBufferSize,
+                          bid, m_nrecvBufs - 1, 0);
+    io_uring_buf_ring_advance(m_recvRing, 1);
+}
+
+// =================================================================================
+
+bool theme::uring_dispatch::add_fd(int fd, events evmask, poll_handler* handler)
+{
+    THEME_ASSERTD(fd >= 0 && fd < (1 << 30) && handler != nullptr);
+    if ((size_t)fd >= m_handlers.size())
+        m_handlers.resize(fd + 1);
+    if (m_handlers[fd].m_handler) {
+        s_log.warning("add_fd() tried to double-add fd {}", fd);
+        return false;
+    }
+
+    // The poll isn't submitted until the next dispatch(), so any errors adding it will show up
+    // as a hang-up.
+    slot& s = m_handlers[fd];
+    s.m_handler = handler;
+    s.m_generation = ++m_generation;
+    s.m_mask = xlate_mask_to_poll(evmask);
+    arm(fd, s);
+    return true;
+}
+
+bool theme::uring_dispatch::add_stream(int fd, stream_handler* handler)
+{
+    THEME_ASSERTD(fd >= 0 && fd < (1 << 30) && handler != nullptr);
+    if (!supports_streams())
+        return false;
+    if ((size_t)fd >= m_handlers.size())
+        m_handlers.resize(fd + 1);
+    if (m_handlers[fd].m_handler) {
+        s_log.warning("add_stream() tried to double-add fd {}", fd);
+        return false;
+    }
+
+    // Like polls, a receive that can't be set up shows up as a hang-up.
+    slot& s = m_handlers[fd];
+    s.m_handler = handler;
+    s.m_generation = ++m_generation;
+    s.m_mask = 0;
+    s.m_stream = std::make_unique<stream>();
+    s.m_stream->m_handler = handler;
+    s.m_stream->m_fd = fd;
+    s.m_stream->m_generation = s.m_generation;
+    arm_recv(*s.m_stream);
+    return true;
+}
+
+void theme::uring_dispatch::release(int fd, slot& s)
+{
+    if (stream* st = s.m_stream.get()) {
+        if (st->m_recving)
+            cancel(make_data(fd, st->m_generation, e_recv));
+        if (st->m_watching)
+            unwatch(*st);
+
+        // The kernel may still be reading what we gave it to send, so that has to stick
+        // around until the send completes. Don't wait on a peer that isn't listening, though.
+        if (!st->m_sending.empty()) {
+            cancel(make_data(fd, st->m_generation, e_send));
+            m_retired.emplace_back(std::move(s.m_stream));
+        }
+        s.m_stream.reset();
+    } else {
+        disarm(fd, s);
+    }
+    s.m_handler = nullptr;
+}
+
+bool theme::uring_dispatch::remove_fd(int fd)
+{
+    if ((size_t)fd >= m_handlers.size() || !m_handlers[fd].m_handler) {
+        s_log.warning("remove_fd() tried to remove unknown fd {}", fd);
+        return false;
+    }
+
+    release(fd, m_handlers[fd]);
+    return true;
+}
+
+void theme::uring_dispatch::resume_recv(int fd)
+{
+    if ((size_t)fd >= m_handlers.size() || !m_handlers[fd].m_stream) {
+        s_log.warning("resume_recv() tried to resume unknown stream fd {}", fd);
+        return;
+    }
+
+    // If the receive hasn't been cancelled yet, it can just keep going.
+    stream& st = *m_handlers[fd].m_stream;
+    if (!st.m_paused)
+        return;
+    st.m_paused = false;
+    if (st.m_watching)
+        unwatch(st);
+    if (!st.m_recving)
+        arm_recv(st);
+}
+
+bool theme::uring_dispatch::send(int fd, ring_buffer& data)
+{
+    if ((size_t)fd >= m_handlers.size() || !m_handlers[fd].m_stream) {
+        s_log.warning("send() tried to send to unknown stream fd {}", fd);
+        return false;
+    }
+
+    stream& st = *m_handlers[fd].m_stream;
+    THEME_ASSERTD(st.m_sending.empty() && !data.empty());
+    st.m_sending.swap(data);
+    submit_send(st);
+    return true;
+}
+
+// =================================================================================
+
+bool theme::uring_dispatch::dispatch(int timeout)
+{
+    // Any polls added or removed since last time go to the kernel with the wait.
+    __kernel_timespec ts{ timeout / 1000, (timeout % 1000) * 1000000 };
+    io_uring_cqe* cqe;
+    int result = io_uring_submit_and_wait_timeout(&m_ring, &cqe, 1, timeout < 0 ? nullptr : &ts,
+                                                  nullptr);
+    log::tick();
+
+    if (result == -ETIME || result == -EINTR) {
+        return false;
+    } else if (result < 0) {
+        THEME_ASSERTR_V(false, "io_uring_submit_and_wait_timeout() failed: {}", strerror(-result));
+        return false;
+    }
+
+    // Copy the completions out so that handlers are free to queue new submissions.
+    size_t ncompletions = 0;
+    unsigned head;
+    io_uring_for_each_cqe(&m_ring, head, cqe) {
+        if (ncompletions == m_completions.size())
+            break;
+        m_completions[ncompletions++] = { cqe->user_data, cqe->res, cqe->flags };
+    }
+    io_uring_cq_advance(&m_ring, ncompletions);
+
+    if (ncompletions > 0)
+        m_waits++;
+    if (ncompletions == m_completions.size())
+        m_saturated++;
+
+    for (size_t i = 0; i < ncompletions; ++i) {
+        const completion& c = m_completions[i];
+        if (c.m_data == kIgnoreCompletion || c.m_data == kProbeCompletion) {
+            if (c.m_flags & IORING_CQE_F_BUFFER)
+                recycle(c.m_flags >> IORING_CQE_BUFFER_SHIFT);
+            continue;
+        }
+
+        int fd = (int)(c.m_data & ((1 << 30) - 1));
+        uint32_t generation = (uint32_t)(c.m_data >> 32);
+        switch ((operation)((c.m_data >> 30) & 3)) {
+        case e_poll:
+            complete_poll(fd, generation, c);
+            break;
+        case e_recv:
+            complete_recv(fd, generation, c);
+            break;
+        case e_send:
+            complete_send(fd, generation, c);
+            break;
+        }
+    }
+
+    return true;
+}
+
+void theme::uring_dispatch::hangup(int fd, uint32_t generation)
+{
+    slot& s = m_handlers[fd];
+    if (!s.m_handler || s.m_generation != generation)
+        return;
+
+    // Take care of the removal BEFORE the callback, which is likely to destroy the handler.
+    poll_handler* handler = s.m_handler;
+    release(fd, s);
+    handler->handle_events(fd, events::e_hup);
+}
+
+void theme::uring_dispatch::complete_poll(int fd, uint32_t generation, const completion& c)
+{
+    // Completions from a poll that has since been removed are stale.
+    if ((size_t)fd >= m_handlers.size())
+        return;
+    const slot& s = m_handlers[fd];
+    if (!s.m_handler || s.m_generation != generation)
+        return;
+
+    if (s.m_stream) {
+        // A paused stream's hang-up watch. Once the stream resumes, the watch is stale.
+        stream& st = *s.m_stream;
+        if (!st.m_watching)
+            return;
+        if (c.m_result < 0) {
+            s_log.warning("dispatch() poll failed on fd {}: {}", fd, strerror(-c.m_result));
+            hangup(fd, generation);
+        } else if (xlate_poll_to_mask(c.m_result) & events::e_hup) {
+            hangup(fd, generation);
+        } else if (!(c.m_flags & IORING_CQE_F_MORE)) {
+            watch(st);
+        }
+        return;
+    }
+
+    events events_mask;
+    if (c.m_result < 0) {
+        s_log.warning("dispatch() poll failed on fd {}: {}", fd, strerror(-c.m_result));
+        events_mask = events::e_hup;
+    } else {
+        events_mask = xlate_poll_to_mask(c.m_result);
+    }
+
+    // Like epoll, a hang-up is an implicit removal. If the poll is still armed, that removes it.
+    bool more = c.m_flags & IORING_CQE_F_MORE;
+    if (events_mask & events::e_hup) {
+        if (more) {
+            hangup(fd, generation);
+        } else {
+            poll_handler* handler = s.m_handler;
+            m_handlers[fd].m_handler = nullptr;
+            handler->handle_events(fd, events_mask);
+        }
+        return;
+    }
+
+    s.m_handler->handle_events(fd, events_mask);
+
+    // The kernel may end a multishot poll at any time (eg if the CQ overflowed), so we need
+    // to re-arm it if the handler is still around.
+    if (!more) {
+        const slot& cur = m_handlers[fd];
+        if (cur.m_handler && cur.m_generation == generation)
+            arm(fd, cur);
+    }
+}
+
+void theme::uring_dispatch::complete_recv(int fd, uint32_t generation, const completion& c)
+{
+    // Whatever happens, the buffer goes back to the kernel once we're done with it.
+    const uint8_t* buf = nullptr;
+    int bid = -1;
+    if (c.m_flags & IORING_CQE_F_BUFFER) {
+        bid = c.m_flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = m_recvBufs.get() + bid * kRecvBufferSize;
+    }
+
+    auto live = [this, fd, generation]() -> stream* {
+        if ((size_t)fd >= m_handlers.size())
+            return nullptr;
+        const slot& s = m_handlers[fd];
+        if (!s.m_handler || s.m_generation != generation)
+            return nullptr;
+        return s.m_stream.get();
+    };
+
+    stream* st = live();
+    if (!st) {
+        if (bid >= 0)
+            recycle(bid);
+        return;
+    }
+    if (!(c.m_flags & IORING_CQE_F_MORE))
+        st->m_recving = false;
+
+    if (c.m_result > 0) {
+        bool keep = st->m_handler->handle_recv(fd, buf, c.m_result);
+        if (bid >= 0)
+            recycle(bid);
+
+        // The handler may well have gone away in the meantime.
+        st = live();
+        if (!st) {
+            return;
+        } else if (!keep && !st->m_paused) {
+            // Leave the rest in the socket, like an unread socket under epoll would. That means
+            // nothing is receiving to notice a hang-up, though, so poll for one instead.
+            st->m_paused = true;
+            if (st->m_recving)
+                cancel(make_data(fd, generation, e_recv));
+            watch(*st);
+        } else if (!st->m_recving && !st->m_paused) {
+            // The kernel may end a multishot receive at any time, just like a poll.
+            arm_recv(*st);
+        }
+        return;
+    }
+
+    if (bid >= 0)
+        recycle(bid);
+    if (c.m_result == -ENOBUFS || c.m_result == -ECANCELED) {
+        // Either we ran out of buffers, which have been given back by now, or we cancelled the
+        // receive for a pause that may already be over.
+        if (!st->m_recving && !st->m_paused)
+            arm_recv(*st);
+        return;
+    }
+
+    if (c.m_result < 0) {
+        s_log.warning("dispatch() recv failed on fd {}: {}", fd, strerror(-c.m_result));
+        st->m_handler->handle_recv(fd, nullptr, (size_t)-1);
+    }
+
+    // The peer hung up, or the socket is broken. Either way, the receive is over.
+    hangup(fd, generation);
+}
+
+void theme::uring_dispatch::complete_send(int fd, uint32_t generation, const completion& c)
+{
+    stream* st = nullptr;
+    if ((size_t)fd < m_handlers.size() && m_handlers[fd].m_stream &&
+        m_handlers[fd].m_generation == generation) {
+        st = m_handlers[fd].m_stream.get();
+    } else {
+        // Nobody is listening anymore, so the stream's output can finally go away.
+        auto it = std::find_if(m_retired.begin(), m_retired.end(), [fd, generation](const auto& r) {
+            return r->m_fd == fd && r->m_generation == generation;
+        });
+        if (it != m_retired.end())
+            m_retired.erase(it);
+        return;
+    }
+
+    if (c.m_result < 0) {
+        s_log.warning("dispatch() send failed on fd {}: {}", fd, strerror(-c.m_result));
+        st->m_sending.consume(st->m_sending.size());
+        st->m_handler->handle_sent(fd, (size_t)-1);
+        return;
+    }
+
+    // Sends can come up short, just like writev(), so keep going until it's all out.
+    st->m_sending.consume(c.m_result);
+    if (!st->m_sending.empty())
+        submit_send(*st);
+    st->m_handler->handle_sent(fd, c.m_result);
+}
+
+theme::poll_dispatch::stats theme::uring_dispatch::get_stats() const
+{
+    return stats{ m_waits, m_saturated, m_completions.size() };
+}
+
+// =================================================================================
+
+std::unique_ptr<theme::poll_dispatch> theme::poll_dispatch::create_uring(size_t max_batch)
+{
+    auto result = std::make_unique<uring_dispatch>(max_batch);
+    if (!result->ready())
+        return nullptr;
+    return result;
+}
@@ -18,6 +18,7 @@
 #include "../core/config_parser.h"
 #include "../core/errors.h"
 
+#include <cstring>
 #include <openssl/bn.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -50,8 +51,32 @@ inline BIGNUM* theme::crypto_ctx::bignum() const
 
 // ============================================================================
 
+theme::crypto_keys::~crypto_keys()
+{
+    BN_MONT_CTX_free(m_mont);
+    BN_clear_free(m_k);
+    BN_free(m_n);
+}
+
+theme::crypto_keys& theme::crypto_keys::operator =(theme::crypto_keys&& move)
+{
+    std::swap(m_k, move.m_k);
+    std::swap(m_n, move.m_n);
+    std::swap(m_mont, move.m_mont);
+    return *this;
+}
+
+// ============================================================================
+
+BN_CTX* theme::crypto::thread_ctx()
+{
+    static thread_local std::unique_ptr<BN_CTX, void(*)(BN_CTX*)> ctx{ BN_CTX_new(), BN_CTX_free };
+    return ctx.get();
+}
+
+// ============================================================================
+
 theme::crypto::crypto()
-    : m_ctx(BN_CTX_new())
 {
     static bool init = false;
     THEME_ASSERTR(!init);
@@ -63,7 +88,6 @@ theme::crypto::crypto()
 
 theme::crypto::~crypto()
 {
-    BN_CTX_free(m_ctx);
     EVP_cleanup();
 }
 
@@ -90,7 +114,7 @@ std::tuple<ST::string, ST::string, ST::string> theme::crypto::generate_keys(uint
         // Compute the client key (N/KA)
         // X = g**K%N
         BN_set_word(g, g_value);
-        BN_mod_exp(x, g, k, n, m_ctx);
+        BN_mod_exp(x, g, k, n, ctx);
 
         // Store the keys
         BN_bn2bin(k, k_key);
@@ -117,12 +141,11 @@ BIGNUM* theme::crypto::load_key(const ST::string& key) const
 
 // ============================================================================
 
-std::tuple<bool, BIGNUM*, BIGNUM*> theme::crypto::load_keys(const theme::config_parser& config,
-                                                            const ST::string& section) const
+std::tuple<bool, theme::crypto_keys> theme::crypto::load_keys(const theme::config_parser& config,
+                                                              const ST::string& section) const
 {
     bool result = true;
-    BIGNUM* k;
-    BIGNUM* n;
+    crypto_keys keys;
 
     ST::string kstr = config.get<const ST::string&>(section, "crypt_k"_st);
     ST::string nstr = config.get<const ST::string&>(section, "crypt_n"_st);
@@ -131,15 +154,24 @@ std::tuple<bool, BIGNUM*, BIGNUM*> theme::crypto::load_keys(const theme::config_
         std::tie(kstr, nstr, xstr) = generate_keys(config.get<unsigned int>(section, "crypt_g"_st));
         result = false;
     }
-    k = load_key(kstr);
-    n = load_key(nstr);
+    keys.m_k = load_key(kstr);
+    keys.m_n = load_key(nstr);
+
+    // K is the private exponent, so make sure nobody can time it.
+    BN_set_flags(keys.m_k, BN_FLG_CONSTTIME);
 
-    return std::make_tuple(result, k, n);
+    keys.m_mont = BN_MONT_CTX_new();
+    {
+        auto ctx = begin_calculation();
+        THEME_ASSERTR(BN_MONT_CTX_set(keys.m_mont, keys.m_n, ctx) == 1);
+    }
+
+    return std::make_tuple(result, std::move(keys));
 }
 
 // ============================================================================
 
-bool theme::crypto::make_server_key(BIGNUM* k, BIGNUM* n, size_t cli_seedsz,
+bool theme::crypto::make_server_key(const theme::crypto_keys& keys, size_t cli_seedsz,
                                     const uint8_t* const y_data, size_t keysz,
                                     uint8_t* srv_seed, uint8_t* key) const
 {
@@ -153,7 +185,8 @@ bool theme::crypto::make_server_key(BIGNUM* k, BIGNUM* n, size_t cli_seedsz,
         BIGNUM* seed = ctx.bignum();
 
         BN_lebin2bn(y_data, cli_seedsz, y);
-        BN_mod_exp(seed, y, k, n, ctx);
+        if (BN_mod_exp_mont_consttime(seed, y, keys.m_k, keys.m_n, ctx, keys.m_mont) != 1)
+            return false;
         BN_bn2lebinpad(seed, cli_seed, sizeof(cli_seed));
         RAND_bytes(srv_seed, keysz);
     }
@@ -161,3 +194,32 @@ bool theme::crypto::make_server_key(BIGNUM* k, BIGNUM* n, size_t cli_seedsz,
         key[i] = cli_seed[i] ^ srv_seed[i];
     return true;
 }
+
+bool theme::crypto::make_client_key(uint32_t g_value, const BIGNUM* n, const BIGNUM* x,
+                                    size_t y_datasz, uint8_t* y_data,
+                                    size_t keysz, uint8_t* cli_seed) const
+{
+    if (y_datasz != kKeySize || keysz > kKeySize)
+        return false;
+
+    uint8_t seed[kKeySize];
+    {
+        auto ctx = begin_calculation();
+        BIGNUM* g = ctx.bignum();
+        BIGNUM* b = ctx.bignum();
+        BIGNUM* y = ctx.bignum();
+        BIGNUM* s = ctx.bignum();
+
+        // The server raises Y = g**b%N to its private K, which matches X**b%N = g**(K*b)%N.
+        BN_set_word(g, g_value);
+        if (BN_rand(b, kKeySize * 8, BN_RAND_TOP_ANY, BN_RAND_BOTTOM_ANY) != 1)
+            return false;
+        if (BN_mod_exp(y, g, b, n, ctx) != 1 || BN_mod_exp(s, x, b, n, ctx) != 1)
+            return false;
+
+        BN_bn2lebinpad(y, y_data, kKeySize);
+        BN_bn2lebinpad(s, seed, sizeof(seed));
+    }
+    memcpy(cli_seed, seed, keysz);
+    return true;
+}
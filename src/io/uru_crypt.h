@@ -48,25 +48,73 @@ namespace theme
         operator BN_CTX*() const { return m_ctx; }
     };
 
+    /**
+     * A loaded private/public keypair.
+     * The Montgomery form of N is precomputed once when the keys are loaded, so that each
+     * handshake only has to pay for the exponentiation itself.
+     */
+    class crypto_keys
+    {
+        BIGNUM* m_k;
+        BIGNUM* m_n;
+        BN_MONT_CTX* m_mont;
+
+        friend class crypto;
+
+    public:
+        crypto_keys()
+            : m_k(), m_n(), m_mont()
+        { }
+        crypto_keys(const crypto_keys&) = delete;
+        crypto_keys(crypto_keys&& move)
+            : m_k(move.m_k), m_n(move.m_n), m_mont(move.m_mont)
+        {
+            move.m_k = nullptr;
+            move.m_n = nullptr;
+            move.m_mont = nullptr;
+        }
+
+        ~crypto_keys();
+
+        crypto_keys& operator =(const crypto_keys&) = delete;
+        crypto_keys& operator =(crypto_keys&& move);
+
+        const BIGNUM* k() const { return m_k; }
+        const BIGNUM* n() const { return m_n; }
+        const BN_MONT_CTX* mont() const { return m_mont; }
+    };
+
     class crypto
     {
-        BN_CTX* m_ctx;
+        /** BN_CTX is not thread safe, so each thread that does math gets its own. */
+        static BN_CTX* thread_ctx();
 
     public:
         crypto();
         ~crypto();
 
-        crypto_ctx begin_calculation() const { return crypto_ctx(m_ctx); }
+        crypto_ctx begin_calculation() const { return crypto_ctx(thread_ctx()); }
 
         std::tuple<ST::string, ST::string, ST::string> generate_keys(uint32_t g_value) const;
-        bool make_server_key(BIGNUM* k, BIGNUM* n, size_t cli_seedsz,
+        bool make_server_key(const crypto_keys& keys, size_t cli_seedsz,
                              const uint8_t* const y_data, size_t keysz,
                              uint8_t* srv_seed, uint8_t* key) const;
 
+        /**
+         * Performs the client's half of the key agreement, as plClient does.
+         * \param g_value, n, x The server's published key.
+         * \param y_data Receives the 64 byte value to send to the server.
+         * \param cli_seed Receives the first \param keysz bytes of the shared secret, which are
+         *                 combined with the server's seed to form the session key.
+         */
+        bool make_client_key(uint32_t g_value, const BIGNUM* n, const BIGNUM* x,
+                             size_t y_datasz, uint8_t* y_data,
+                             size_t keysz, uint8_t* cli_seed) const;
+
 
         BIGNUM* load_key(const ST::string& key) const;
-        std::tuple<bool, BIGNUM*, BIGNUM*> load_keys(const class config_parser& config,
-                                                     const ST::string& section) const;
+        std::tuple<bool, crypto_keys> load_keys(const class config_parser& config,
+                                                const ST::string& section) const;
     };
 };
 
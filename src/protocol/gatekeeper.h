@@ -50,4 +50,8 @@ namespace theme
 #include "gatekeeper.inl"
 #include "protocol_structs_end.inl"
 
+#include "protocol_messages_begin.inl"
+#include "gatekeeper.inl"
+#include "protocol_messages_end.inl"
+
 #endif
@@ -14,6 +14,8 @@
  *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+THEME_NET_MESSAGES_BEGIN(gatekeeper, cli2srv)
+
 THEME_NET_STRUCT_BEGIN(gatekeeper, pingRequest)
     THEME_NET_FIELD_UINT16(type)
     THEME_NET_FIELD_UINT32(pingTime)
@@ -32,8 +34,12 @@ THEME_NET_STRUCT_BEGIN(gatekeeper, authSrvRequest)
     THEME_NET_FIELD_UINT32(transId)
 THEME_NET_STRUCT_END(gatekeeper, authSrvRequest)
 
+THEME_NET_MESSAGES_END(gatekeeper, cli2srv)
+
 // =================================================================================
 
+THEME_NET_MESSAGES_BEGIN(gatekeeper, srv2cli)
+
 THEME_NET_STRUCT_BEGIN(gatekeeper, pingReply)
     THEME_NET_FIELD_UINT16(type)
     THEME_NET_FIELD_UINT32(pingTime)
@@ -52,3 +58,5 @@ THEME_NET_STRUCT_BEGIN(gatekeeper, authSrvReply)
     THEME_NET_FIELD_UINT32(transId)
     THEME_NET_FIELD_STRING_UTF16(address, 24)
 THEME_NET_STRUCT_END(gatekeeper, authSrvReply)
+
+THEME_NET_MESSAGES_END(gatekeeper, srv2cli)
@@ -19,16 +19,14 @@
 #include "../core/uuid.h"
 #include "net_struct.h"
 
+#include <algorithm>
 #include <iostream>
 
 // =================================================================================
 
 size_t theme::net_struct_calcsz(const net_struct* msg, size_t idx)
 {
-    size_t size = 0;
-    for (size_t i = 0; i < msg->m_size && i < idx; ++i)
-        size += msg->m_fields[i].m_elementsz * msg->m_fields[i].m_count;
-    return size;
+    return msg->m_offsets[std::min(msg->m_size, idx)];
 }
 
 static const char* _get_data_type_str(theme::net_field::data_type type)
@@ -59,7 +57,7 @@ void theme::net_struct_print(const net_struct* msg, std::ostream& stream)
     for (size_t i = 0; i < msg->m_size; ++i) {
         const char* type = _get_data_type_str(msg->m_fields[i].m_type);
         stream << "    -> " << msg->m_fields[i].m_name << " ";
-        stream << "[TYPE: '" << _get_data_type_str(msg->m_fields[i].m_type) << "'] ";
+        stream << "[TYPE: '" << type << "'] ";
         stream << std::endl;
     }
     stream << "--- END   NETSTRUCT ---" << std::endl;
@@ -107,6 +105,12 @@ void theme::net_msg_print(const net_struct* msg, const void* data, std::ostream&
             break;
         case net_field::data_type::e_uuid:
             stream << "        - DATA: '" << ((theme::uuid*)datap)->as_string().c_str() << "'" << std::endl;
+            break;
+        case net_field::data_type::e_blob:
+        case net_field::data_type::e_buffer:
+        case net_field::data_type::e_buffer_redundant:
+            // Not worth dumping.
+            break;
         }
 
         offset += msg->m_fields[i].m_elementsz * msg->m_fields[i].m_count;
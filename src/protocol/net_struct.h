@@ -17,6 +17,9 @@
 #ifndef __PROTOCOL_NET_STRUCT_H
 #define __PROTOCOL_NET_STRUCT_H
 
+#include "../core/errors.h"
+
+#include <array>
 #include <cstdint>
 #include <iosfwd>
 
@@ -59,6 +62,128 @@ namespace theme
         const char* m_name;
         size_t m_size;
         const net_field* m_fields;
+
+        /** Offset of each field in the memory representation, followed by the total size. */
+        const size_t* m_offsets;
+
+        /** Number of leading fields whose wire size is known without examining the message. */
+        size_t m_fixedcount;
+
+        /** Size of the leading fixed fields. These are laid out identically on the wire. */
+        size_t m_fixedsz;
+    };
+
+    /** Determines if the wire size of a field is independent of the message contents. */
+    constexpr bool net_field_is_fixed(const net_field& field)
+    {
+        switch (field.m_type) {
+        case net_field::data_type::e_buffer:
+        case net_field::data_type::e_buffer_redundant:
+        case net_field::data_type::e_string_utf16:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    template<size_t _Sz>
+    constexpr std::array<size_t, _Sz + 1> net_struct_offsets(const net_field(&fields)[_Sz])
+    {
+        std::array<size_t, _Sz + 1> result{};
+        for (size_t i = 0; i < _Sz; ++i)
+            result[i + 1] = result[i] + fields[i].m_elementsz * fields[i].m_count;
+        return result;
+    }
+
+    template<size_t _Sz>
+    constexpr size_t net_struct_fixedcount(const net_field(&fields)[_Sz])
+    {
+        size_t i = 0;
+        while (i < _Sz && net_field_is_fixed(fields[i]))
+            ++i;
+        return i;
+    }
+
+    /**
+     * A message one side of a protocol can send: how to read it off the wire, and what
+     * \p _Handler does with it once it has been read.
+     * \p _Handler provides the dispatch_t function pointer type and a static
+     * `dispatch<_Msg>()` template with that signature for each message type.
+     */
+    template<typename _Handler>
+    struct net_dispatch_entry final
+    {
+        uint16_t m_id;
+        const net_struct* m_struct;
+        typename _Handler::dispatch_t m_dispatch;
+    };
+
+    /**
+     * Messages indexed by their type ID, so that looking up what to do with an incoming message
+     * is a single array access. These are generated for each protocol by the
+     * THEME_NET_MESSAGES_BEGIN() sections of its .inl.
+     * \p _Size is one past the highest ID in the table; IDs between that no message uses
+     * are left empty.
+     */
+    template<typename _Handler, size_t _Size>
+    class net_dispatch_table final
+    {
+    public:
+        typedef net_dispatch_entry<_Handler> entry_t;
+
+    private:
+        std::array<entry_t, _Size> m_entries;
+
+    public:
+        /**
+         * Places each of \param entries at the index of its type ID. IDs must be unique and
+         * below \p _Size. The tables are meant to be constexpr, where a violation fails to
+         * compile.
+         */
+        template<size_t _Count>
+        constexpr net_dispatch_table(const entry_t(&entries)[_Count])
+            : m_entries()
+        {
+            for (const entry_t& entry : entries) {
+                THEME_ASSERTR(entry.m_id < _Size);
+                THEME_ASSERTR(m_entries[entry.m_id].m_struct == nullptr);
+                m_entries[entry.m_id] = entry;
+            }
+        }
+
+        constexpr size_t size() const { return _Size; }
+
+        /** \return Returns the entry for message type \param id, or nullptr if it is unknown. */
+        constexpr const entry_t* find(uint16_t id) const
+        {
+            if (id >= _Size || !m_entries[id].m_struct)
+                return nullptr;
+            return &m_entries[id];
+        }
+    };
+
+    template<typename _Handler>
+    struct net_dispatch final
+    {
+        typedef net_dispatch_entry<_Handler> entry_t;
+
+        template<typename _Msg>
+        static constexpr entry_t entry()
+        {
+            return { _Msg::id(), _Msg::net_struct, &_Handler::template dispatch<_Msg> };
+        }
+
+        /** \return Returns the table size needed to hold \param entries, one past the highest ID. */
+        template<size_t _Count>
+        static constexpr size_t span(const entry_t(&entries)[_Count])
+        {
+            size_t result = 0;
+            for (const entry_t& entry : entries) {
+                if (entry.m_id >= result)
+                    result = entry.m_id + 1;
+            }
+            return result;
+        }
     };
 
     size_t net_struct_calcsz(const net_struct*, size_t idx=-1);
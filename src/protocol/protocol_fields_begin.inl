@@ -16,10 +16,13 @@
 
 #define THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) \
     namespace theme { namespace protocol { namespace _fields { \
-        static const theme::net_field protocol_name##_##msg_name[] = {
+        inline constexpr theme::net_field protocol_name##_##msg_name[] = {
 
 #define THEME_NET_STRUCT_BEGIN(protocol_name, msg_name) THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name)
 
+#define THEME_NET_MESSAGES_BEGIN(protocol_name, direction)
+#define THEME_NET_MESSAGES_END(protocol_name, direction)
+
 #define THEME_NET_FIELD_BLOB(name, size) \
     { theme::net_field::data_type::e_blob, #name, 1, size },
 
@@ -51,8 +54,18 @@
     }; \
     }; }; }; \
     \
+    namespace theme { namespace protocol { namespace _layouts { \
+        inline constexpr auto protocol_name##_##msg_name = \
+            theme::net_struct_offsets(theme::protocol::_fields::protocol_name##_##msg_name); \
+        inline constexpr size_t protocol_name##_##msg_name##_fixedcount = \
+            theme::net_struct_fixedcount(theme::protocol::_fields::protocol_name##_##msg_name); \
+    }; }; }; \
+    \
     namespace theme { namespace protocol { namespace _net_structs { \
-        const theme::net_struct protocol_name##_##msg_name =\
+        inline const theme::net_struct protocol_name##_##msg_name =\
             { #protocol_name "_" #msg_name, std::size(theme::protocol::_fields::protocol_name##_##msg_name), \
-              theme::protocol::_fields::protocol_name##_##msg_name }; \
+              theme::protocol::_fields::protocol_name##_##msg_name, \
+              theme::protocol::_layouts::protocol_name##_##msg_name.data(), \
+              theme::protocol::_layouts::protocol_name##_##msg_name##_fixedcount, \
+              theme::protocol::_layouts::protocol_name##_##msg_name[theme::protocol::_layouts::protocol_name##_##msg_name##_fixedcount] }; \
     }; }; };
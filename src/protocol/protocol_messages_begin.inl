@@ -0,0 +1,48 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Each THEME_NET_MESSAGES_BEGIN() section becomes a function template returning the section's
+// net_dispatch_table for a given handler, e.g. theme::protocol::gatekeeper::cli2srv<handler_t>().
+// Only messages with an ID may appear in a section, and structs outside of one are skipped.
+// The table is sized by the section's highest ID, so IDs needn't be dense.
+
+#define THEME_NET_MESSAGES_BEGIN(protocol_name, direction) \
+    namespace theme { namespace protocol { namespace protocol_name { \
+        template<typename _Handler> \
+        constexpr auto direction() \
+        { \
+            typedef theme::net_dispatch<_Handler> dispatch_t; \
+            constexpr typename dispatch_t::entry_t entries[] = {
+
+#define THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name)
+#define THEME_NET_STRUCT_BEGIN(protocol_name, msg_name) \
+                dispatch_t::template entry<theme::protocol::protocol_name##_##msg_name>(),
+
+#define THEME_NET_FIELD_BLOB(name, size)
+#define THEME_NET_FIELD_BUFFER(name)
+#define THEME_NET_FIELD_BUFFER_REDUNDANT(name)
+#define THEME_NET_FIELD_UINT8(name)
+#define THEME_NET_FIELD_UINT16(name)
+#define THEME_NET_FIELD_UINT32(name)
+#define THEME_NET_FIELD_STRING_UTF16(name, size)
+#define THEME_NET_FIELD_UUID(name)
+#define THEME_NET_STRUCT_END(protocol_name, msg_name)
+
+#define THEME_NET_MESSAGES_END(protocol_name, direction) \
+            }; \
+            return theme::net_dispatch_table<_Handler, dispatch_t::span(entries)>(entries); \
+        } \
+    }; }; };
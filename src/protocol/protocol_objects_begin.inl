@@ -14,11 +14,11 @@
  *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) \
-    const theme::net_struct* theme::protocol::protocol_name##_##msg_name::net_struct = &theme::protocol::_net_structs::protocol_name##_##msg_name;
-#define THEME_NET_STRUCT_BEGIN(protocol_name, msg_name) THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name)
-
 // noops
+#define THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) ;
+#define THEME_NET_STRUCT_BEGIN(protocol_name, msg_name) ;
+#define THEME_NET_MESSAGES_BEGIN(protocol_name, direction) ;
+#define THEME_NET_MESSAGES_END(protocol_name, direction) ;
 #define THEME_NET_FIELD_BLOB(name, size) ;
 #define THEME_NET_FIELD_BUFFER(name) ;
 #define THEME_NET_FIELD_BUFFER_REDUNDANT(name) ;
@@ -27,4 +27,6 @@
 #define THEME_NET_FIELD_UINT32(name) ;
 #define THEME_NET_FIELD_STRING_UTF16(name, size) ;
 #define THEME_NET_FIELD_UUID(name) ;
-#define THEME_NET_STRUCT_END(protocol_name, msg_name) ;
+#define THEME_NET_STRUCT_END(protocol_name, msg_name) \
+    static_assert(sizeof(theme::protocol::protocol_name##_##msg_name) == theme::protocol::_layouts::protocol_name##_##msg_name.back(), \
+                  "precomputed layout of " #protocol_name "_" #msg_name " does not match the struct");
@@ -16,6 +16,8 @@
 
 #undef THEME_NET_STRUCT_BEGIN_COMMON
 #undef THEME_NET_STRUCT_BEGIN
+#undef THEME_NET_MESSAGES_BEGIN
+#undef THEME_NET_MESSAGES_END
 #undef THEME_NET_FIELD_BLOB
 #undef THEME_NET_FIELD_BUFFER
 #undef THEME_NET_FIELD_BUFFER_REDUNDANT
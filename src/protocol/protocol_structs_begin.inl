@@ -19,7 +19,14 @@
 #define THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) \
     namespace theme { namespace protocol { \
         struct protocol_name##_##msg_name final { \
-            static const theme::net_struct* net_struct; \
+            static constexpr const theme::net_struct* net_struct = \
+                &theme::protocol::_net_structs::protocol_name##_##msg_name; \
+            static constexpr bool fixed_size = \
+                theme::protocol::_layouts::protocol_name##_##msg_name##_fixedcount == \
+                std::size(theme::protocol::_fields::protocol_name##_##msg_name); \
+
+#define THEME_NET_MESSAGES_BEGIN(protocol_name, direction)
+#define THEME_NET_MESSAGES_END(protocol_name, direction)
 
 #define THEME_NET_STRUCT_BEGIN(protocol_name, msg_name) \
     THEME_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) \
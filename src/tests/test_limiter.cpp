@@ -0,0 +1,179 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../daemon/limiter.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+
+using namespace std::chrono_literals;
+
+// =================================================================================
+
+namespace
+{
+    theme::connection_limiter::source source4(const char* ip)
+    {
+        sockaddr_storage addr{};
+        auto& in = (sockaddr_in&)addr;
+        in.sin_family = AF_INET;
+        inet_pton(AF_INET, ip, &in.sin_addr);
+        return theme::connection_limiter::get_source(addr);
+    }
+
+    theme::connection_limiter::source source6(const char* ip)
+    {
+        sockaddr_storage addr{};
+        auto& in6 = (sockaddr_in6&)addr;
+        in6.sin6_family = AF_INET6;
+        inet_pton(AF_INET6, ip, &in6.sin6_addr);
+        return theme::connection_limiter::get_source(addr);
+    }
+
+    constexpr theme::connection_limiter::limits kUnlimited{ 0, 0 };
+};
+
+// =================================================================================
+
+TEST(limiter, sources)
+{
+    auto a = source4("10.0.0.1"), b = source4("10.0.0.2"), c = source4("10.0.1.1");
+    EXPECT_FALSE(a.m_host == b.m_host);
+    EXPECT_TRUE(a.m_network == b.m_network);
+    EXPECT_FALSE(a.m_network == c.m_network);
+
+    auto d = source6("2001:db8:0:1::1"), e = source6("2001:db8:0:1::2"), f = source6("2001:db8:0:2::1");
+    EXPECT_TRUE(d.m_host == e.m_host);
+    EXPECT_FALSE(d.m_host == f.m_host);
+    EXPECT_TRUE(d.m_network == f.m_network);
+}
+
+TEST(limiter, unlimited)
+{
+    theme::connection_limiter limiter(kUnlimited, kUnlimited);
+    auto src = source4("10.0.0.1");
+    auto now = theme::connection_limiter::clock_t::now();
+    for (int i = 0; i < 1000; ++i)
+        ASSERT_TRUE(limiter.admit(src, now));
+}
+
+TEST(limiter, max_conns)
+{
+    theme::connection_limiter limiter({ 2, 0 }, kUnlimited);
+    auto src = source4("10.0.0.1");
+    auto now = theme::connection_limiter::clock_t::now();
+    EXPECT_TRUE(limiter.admit(src, now));
+    EXPECT_TRUE(limiter.admit(src, now));
+    EXPECT_FALSE(limiter.admit(src, now));
+    EXPECT_TRUE(limiter.admit(source4("10.0.0.2"), now));
+
+    limiter.release(src);
+    EXPECT_TRUE(limiter.admit(src, now));
+    EXPECT_FALSE(limiter.admit(src, now));
+}
+
+TEST(limiter, rate_bursts_to_max_conns)
+{
+    theme::connection_limiter limiter({ 4, 1 }, kUnlimited);
+    auto src = source4("10.0.0.1");
+    auto now = theme::connection_limiter::clock_t::now();
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(limiter.admit(src, now));
+        limiter.release(src);
+    }
+    EXPECT_FALSE(limiter.admit(src, now));
+    EXPECT_FALSE(limiter.admit(src, now + 500ms));
+    EXPECT_TRUE(limiter.admit(src, now + 1s));
+    EXPECT_FALSE(limiter.admit(src, now + 1s));
+}
+
+TEST(limiter, rate_with_unlimited_conns)
+{
+    // With no connection limit, the bucket holds one second's worth of connections.
+    theme::connection_limiter limiter({ 0, 5 }, { 0, 20 });
+    auto src = source4("10.0.0.1");
+    auto now = theme::connection_limiter::clock_t::now();
+    for (int i = 0; i < 5; ++i)
+        ASSERT_TRUE(limiter.admit(src, now));
+    EXPECT_FALSE(limiter.admit(src, now));
+
+    // Idling doesn't earn more than the burst.
+    now += 10s;
+    for (int i = 0; i < 5; ++i)
+        ASSERT_TRUE(limiter.admit(src, now));
+    EXPECT_FALSE(limiter.admit(src, now));
+
+    // The network's bucket is separate.
+    EXPECT_TRUE(limiter.admit(source4("10.0.0.2"), now));
+}
+
+TEST(limiter, rejection_is_free)
+{
+    theme::connection_limiter limiter({ 0, 2 }, { 1, 0 });
+    auto a = source4("10.0.0.1");
+    auto b = source4("10.0.0.2");
+    auto now = theme::connection_limiter::clock_t::now();
+    EXPECT_TRUE(limiter.admit(b, now));
+
+    // Turned away by the network, so none of a's tokens are spent.
+    for (int i = 0; i < 10; ++i)
+        EXPECT_FALSE(limiter.admit(a, now));
+    limiter.release(b);
+    EXPECT_TRUE(limiter.admit(a, now));
+    limiter.release(a);
+    EXPECT_TRUE(limiter.admit(a, now));
+}
+
+TEST(limiter, prune_without_rates)
+{
+    // Buckets that never refill must still be swept out once their sources go idle.
+    for (auto lim : { std::make_pair(kUnlimited, kUnlimited),
+                      std::make_pair(theme::connection_limiter::limits{ 4, 0 }, kUnlimited),
+                      std::make_pair(kUnlimited, theme::connection_limiter::limits{ 64, 0 }) }) {
+        theme::connection_limiter limiter(lim.first, lim.second);
+        auto now = theme::connection_limiter::clock_t::now();
+        for (uint32_t i = 0; i < 20000; ++i) {
+            sockaddr_storage addr{};
+            auto& in = (sockaddr_in&)addr;
+            in.sin_family = AF_INET;
+            in.sin_addr.s_addr = htonl(0x0B000000 + i * 97);
+            auto src = theme::connection_limiter::get_source(addr);
+            ASSERT_TRUE(limiter.admit(src, now));
+            limiter.release(src);
+        }
+        EXPECT_LT(limiter.size(), 2048);
+    }
+}
+
+TEST(limiter, prune_keeps_spent_accounts)
+{
+    theme::connection_limiter limiter({ 0, 1 }, kUnlimited);
+    auto src = source4("10.0.0.1");
+    auto now = theme::connection_limiter::clock_t::now();
+    ASSERT_TRUE(limiter.admit(src, now));
+    limiter.release(src);
+
+    // Enough other hosts to sweep the table. The first host is idle but its bucket is empty.
+    for (uint32_t i = 0; i < 2048; ++i) {
+        sockaddr_storage addr{};
+        auto& in = (sockaddr_in&)addr;
+        in.sin_family = AF_INET;
+        in.sin_addr.s_addr = htonl(0x0B000000 + i);
+        ASSERT_TRUE(limiter.admit(theme::connection_limiter::get_source(addr), now));
+    }
+    EXPECT_FALSE(limiter.admit(src, now));
+    EXPECT_TRUE(limiter.admit(src, now + 1s));
+}
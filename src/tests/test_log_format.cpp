@@ -0,0 +1,110 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../core/log_format.h"
+
+#include <gtest/gtest.h>
+#include <string_theory/format>
+
+// =================================================================================
+
+namespace
+{
+    template<typename... _Args>
+    std::string format(const char* fmt, const _Args&... args)
+    {
+        uint8_t buf[256];
+        theme::log_args record(buf, sizeof(buf));
+        record.add_all(args...);
+
+        std::string result;
+        theme::log_args::format(result, fmt, buf, record.size());
+        return result;
+    }
+
+    /** Deferred lines must read the same as lines formatted immediately by string_theory. */
+    template<typename... _Args>
+    void expect_same(const char* fmt, const _Args&... args)
+    {
+        EXPECT_EQ(format(fmt, args...), ST::format(fmt, args...).c_str()) << fmt;
+    }
+};
+
+// =================================================================================
+
+TEST(log_format, escapes)
+{
+    EXPECT_EQ(format("{{}", 1), "{}");
+    EXPECT_EQ(format("{{{}}}", 1), "{1}}");
+    EXPECT_EQ(format("}}"), "}}");
+    EXPECT_EQ(format("a}b{}c", 2), "a}b2c");
+}
+
+TEST(log_format, integers)
+{
+    EXPECT_EQ(format("{} {} {}", -5, 7u, (int64_t)INT64_MIN), "-5 7 -9223372036854775808");
+    EXPECT_EQ(format("{x} {X} {o} {b}", 255, 255, 8, 5), "ff FF 10 101");
+    EXPECT_EQ(format("{04} {<4}| {>4} {+}", 7, 7, 7, 7), "0007 7   |    7 +7");
+    EXPECT_EQ(format("{04}", -7), "-007");
+    EXPECT_EQ(format("{_*6}", 42), "****42");
+    EXPECT_EQ(format("{x} {b}", -255, (int8_t)-2), "-ff -10");
+}
+
+TEST(log_format, others)
+{
+    EXPECT_EQ(format("{.2f} {.3}", 1.5, 2.0), "1.50 2");
+    EXPECT_EQ(format("{} {}", true, 'x'), "true x");
+    EXPECT_EQ(format("[{}] [{6}] [{>6}]", "abc", "abc", "abc"), "[abc] [abc   ] [   abc]");
+    EXPECT_EQ(format("{}", (const char*)nullptr), "(null)");
+}
+
+TEST(log_format, matches_string_theory)
+{
+    expect_same("{{}", 1);
+    expect_same("{{{}}}", 1);
+    expect_same("}}");
+    expect_same("a}b{}c", 2);
+
+    expect_same("{} {} {}", -5, 7u, (int64_t)INT64_MIN);
+    expect_same("{} {}", (uint64_t)UINT64_MAX, (int16_t)-300);
+    expect_same("{x} {X} {o} {b}", 255, 255, 8, 5);
+    expect_same("{x} {X}", -255, (uint64_t)0xDEADBEEFCAFEULL);
+    expect_same("{04} {<4}| {>4} {+}", 7, 7, 7, 7);
+    expect_same("{04} {+04} {08x}", -7, 7, 0xBEEF);
+    expect_same("{_*6} {_*<6}| {_ 3}", 42, 42, 1234);
+
+    expect_same("{.2f} {.3}", 1.5, 2.0);
+    expect_same("{} {f} {e} {E}", 0.1, 1.25, 12345.678, 0.00042);
+    expect_same("{.1f} {10.3f} {<10.1e}|", 2.25, -3.14159, 1e10);
+    expect_same("{} {.3} {+.2f}", 1.0f / 3.0f, 100000000.0, 1.0);
+
+    expect_same("{} {}", true, false);
+    expect_same("{} {3}|", 'x', 'y');
+    expect_same("[{}] [{6}] [{>6}] [{_-6}]", "abc", "abc", "abc", "abc");
+    expect_same("{}{}", ST::string("abc"), "");
+}
+
+TEST(log_format, missing_arguments)
+{
+    EXPECT_EQ(format("{} {}", 1), "1 {?}");
+
+    // Arguments that don't fit are dropped rather than overrunning the buffer.
+    uint8_t buf[12];
+    theme::log_args record(buf, sizeof(buf));
+    record.add_all(1, 2);
+    std::string result;
+    theme::log_args::format(result, "{} {}", buf, record.size());
+    EXPECT_EQ(result, "1 {?}");
+}
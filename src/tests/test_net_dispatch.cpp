@@ -0,0 +1,73 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../protocol/net_struct.h"
+
+#include <gtest/gtest.h>
+
+// =================================================================================
+
+namespace
+{
+    struct handler
+    {
+        typedef int (*dispatch_t)();
+
+        template<typename _Msg>
+        static int dispatch() { return _Msg::id(); }
+    };
+
+    template<uint16_t _Id>
+    struct message
+    {
+        static constexpr theme::net_struct s_struct{ "message", 0, nullptr, nullptr, 0, 0 };
+        static constexpr const theme::net_struct* net_struct = &s_struct;
+        static constexpr uint16_t id() { return _Id; }
+    };
+
+    // Built the same way as a THEME_NET_MESSAGES_BEGIN() section, with gaps in its IDs.
+    constexpr auto sparse()
+    {
+        typedef theme::net_dispatch<handler> dispatch_t;
+        constexpr typename dispatch_t::entry_t entries[] = {
+            dispatch_t::entry<message<20>>(),
+            dispatch_t::entry<message<0>>(),
+            dispatch_t::entry<message<11>>(),
+            dispatch_t::entry<message<10>>(),
+        };
+        return theme::net_dispatch_table<handler, dispatch_t::span(entries)>(entries);
+    }
+
+    constexpr auto s_sparse = sparse();
+    static_assert(s_sparse.size() == 21);
+    static_assert(s_sparse.find(10)->m_struct == message<10>::net_struct);
+    static_assert(s_sparse.find(12) == nullptr);
+};
+
+// =================================================================================
+
+TEST(net_dispatch, sparse_ids)
+{
+    for (uint16_t id = 0; id < 32; ++id) {
+        const auto* entry = s_sparse.find(id);
+        if (id == 0 || id == 10 || id == 11 || id == 20) {
+            ASSERT_NE(entry, nullptr) << id;
+            EXPECT_EQ(entry->m_id, id);
+            EXPECT_EQ(entry->m_dispatch(), id);
+        } else {
+            EXPECT_EQ(entry, nullptr) << id;
+        }
+    }
+}
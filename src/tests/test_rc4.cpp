@@ -0,0 +1,212 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../io/rc4.h"
+
+#include <cstring>
+#include <gtest/gtest.h>
+#include <memory>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   include <openssl/provider.h>
+#endif
+#include <random>
+#include <string>
+#include <vector>
+
+// =================================================================================
+
+namespace
+{
+    std::vector<uint8_t> apply(theme::rc4_stream& stream, const std::string& in)
+    {
+        std::vector<uint8_t> out(in.size());
+        stream.apply(out.data(), (const uint8_t*)in.data(), in.size());
+        return out;
+    }
+
+    /** OpenSSL's RC4, as the reference. */
+    class evp_rc4
+    {
+        std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> m_ctx;
+
+    public:
+        evp_rc4(const uint8_t* key, size_t keysz)
+            : m_ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free)
+        {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            // RC4 was banished to the legacy provider in OpenSSL 3.
+            static OSSL_PROVIDER* legacy = OSSL_PROVIDER_load(nullptr, "legacy");
+            static OSSL_PROVIDER* defaults = OSSL_PROVIDER_load(nullptr, "default");
+            (void)legacy;
+            (void)defaults;
+#endif
+            if (!EVP_EncryptInit_ex(m_ctx.get(), EVP_rc4(), nullptr, nullptr, nullptr) ||
+                !EVP_CIPHER_CTX_set_key_length(m_ctx.get(), (int)keysz) ||
+                !EVP_EncryptInit_ex(m_ctx.get(), nullptr, nullptr, key, nullptr))
+                m_ctx.reset();
+        }
+
+        bool ready() const { return m_ctx != nullptr; }
+
+        void apply(uint8_t* out, const uint8_t* in, size_t bufsz)
+        {
+            int outsz;
+            EVP_EncryptUpdate(m_ctx.get(), out, &outsz, in, (int)bufsz);
+        }
+    };
+
+    /** A stream keyed with \param seed, along with a matching reference and its own data. */
+    struct keyed_stream
+    {
+        uint8_t m_key[16];
+        theme::rc4_stream m_stream;
+        std::unique_ptr<evp_rc4> m_reference;
+
+        keyed_stream(uint32_t seed)
+        {
+            std::mt19937 rng(seed);
+            for (uint8_t& b : m_key)
+                b = (uint8_t)rng();
+            m_stream.set_key(m_key, sizeof(m_key));
+            m_reference = std::make_unique<evp_rc4>(m_key, sizeof(m_key));
+        }
+
+        /** Runs \param bufsz bytes through both, and checks that they agree. */
+        ::testing::AssertionResult check(size_t bufsz, std::mt19937& rng)
+        {
+            std::vector<uint8_t> in(bufsz), out(bufsz), expected(bufsz);
+            for (uint8_t& b : in)
+                b = (uint8_t)rng();
+            m_stream.apply(out.data(), in.data(), bufsz);
+            m_reference->apply(expected.data(), in.data(), bufsz);
+            if (out != expected)
+                return ::testing::AssertionFailure() << "mismatch in " << bufsz << " bytes";
+            return ::testing::AssertionSuccess();
+        }
+    };
+};
+
+// =================================================================================
+
+TEST(rc4, known_answers)
+{
+    // Test vectors from Wikipedia and RFC 6229.
+    theme::rc4_stream a;
+    a.set_key((const uint8_t*)"Key", 3);
+    EXPECT_EQ(apply(a, "Plaintext"),
+              (std::vector<uint8_t>{ 0xBB, 0xF3, 0x16, 0xE8, 0xD9, 0x40, 0xAF, 0x0A, 0xD3 }));
+
+    theme::rc4_stream b;
+    b.set_key((const uint8_t*)"Wiki", 4);
+    EXPECT_EQ(apply(b, "pedia"), (std::vector<uint8_t>{ 0x10, 0x21, 0xBF, 0x04, 0x20 }));
+
+    theme::rc4_stream c;
+    c.set_key((const uint8_t*)"Secret", 6);
+    EXPECT_EQ(apply(c, "Attack at dawn"),
+              (std::vector<uint8_t>{ 0x45, 0xA0, 0x1F, 0x64, 0x5F, 0xC3, 0x5B, 0x38, 0x35, 0x52,
+                                     0x54, 0x4B, 0x9B, 0xF5 }));
+
+    // Past the end of the keystream ring.
+    const uint8_t key[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    theme::rc4_stream d;
+    d.set_key(key, sizeof(key));
+    std::vector<uint8_t> zeroes(1552);
+    d.apply(zeroes.data(), zeroes.data(), zeroes.size());
+    EXPECT_EQ(std::vector<uint8_t>(zeroes.begin(), zeroes.begin() + 16),
+              (std::vector<uint8_t>{ 0xB2, 0x39, 0x63, 0x05, 0xF0, 0x3D, 0xC0, 0x27, 0xCC, 0xC3,
+                                     0x52, 0x4A, 0x0A, 0x11, 0x18, 0xA8 }));
+    EXPECT_EQ(std::vector<uint8_t>(zeroes.begin() + 1536, zeroes.end()),
+              (std::vector<uint8_t>{ 0xD8, 0x72, 0x9D, 0xB4, 0x18, 0x82, 0x25, 0x9B, 0xEE, 0x4F,
+                                     0x82, 0x53, 0x25, 0xF5, 0xA1, 0x30 }));
+}
+
+TEST(rc4, passthrough_without_key)
+{
+    theme::rc4_stream stream;
+    EXPECT_FALSE(stream.enabled());
+    EXPECT_EQ(apply(stream, "abc"), (std::vector<uint8_t>{ 'a', 'b', 'c' }));
+}
+
+TEST(rc4, xor_bytes)
+{
+    // Every length around the vector widths, at every alignment.
+    alignas(32) uint8_t in[160], keystream[160], out[160];
+    for (size_t i = 0; i < sizeof(in); ++i) {
+        in[i] = (uint8_t)(i * 7);
+        keystream[i] = (uint8_t)(i * 13 + 1);
+    }
+    for (size_t offset = 0; offset < 32; ++offset) {
+        for (size_t len = 0; len + offset <= 128; ++len) {
+            memset(out, 0, sizeof(out));
+            theme::rc4_stream::xor_bytes(out + offset, in + offset, keystream + offset, len);
+            for (size_t i = 0; i < sizeof(out); ++i) {
+                uint8_t expected = (i >= offset && i < offset + len) ? in[i] ^ keystream[i] : 0;
+                ASSERT_EQ(out[i], expected) << "offset " << offset << ", len " << len;
+            }
+        }
+    }
+}
+
+TEST(rc4, matches_evp)
+{
+    std::mt19937 rng(1);
+    keyed_stream ks(1);
+    if (!ks.m_reference->ready())
+        GTEST_SKIP() << "OpenSSL has no RC4";
+
+    // Sizes from single bytes up to several trips around the ring, refilling along the way.
+    for (int i = 0; i < 2000; ++i) {
+        size_t bufsz = (i % 7 == 0) ? rng() % 2048 : rng() % 8;
+        ASSERT_TRUE(ks.check(bufsz, rng));
+        if (i % 3 == 0)
+            ks.m_stream.refill();
+    }
+}
+
+TEST(rc4, batch_matches_evp)
+{
+    std::mt19937 rng(2);
+    if (!keyed_stream(0).m_reference->ready())
+        GTEST_SKIP() << "OpenSSL has no RC4";
+
+    // Not a multiple of the lane count, so that the leftovers take the narrower paths.
+    constexpr size_t kStreams = theme::rc4_batch::kLanes * 4 + 3;
+    std::vector<std::unique_ptr<keyed_stream>> streams;
+    for (size_t i = 0; i < kStreams; ++i)
+        streams.emplace_back(std::make_unique<keyed_stream>((uint32_t)i + 100));
+
+    theme::rc4_batch batch;
+    for (int round = 0; round < 200; ++round) {
+        for (auto& ks : streams) {
+            size_t bufsz = rng() % 3 == 0 ? rng() % 600 : rng() % 40;
+            ASSERT_TRUE(ks->check(bufsz, rng)) << "round " << round;
+
+            // Some streams sit out a round or get queued twice.
+            if (rng() % 4 != 0)
+                ks->m_stream.refill(batch);
+            if (rng() % 8 == 0)
+                ks->m_stream.refill(batch);
+        }
+
+        // Streams that go away while queued must take themselves out.
+        if (round % 50 == 49) {
+            streams.erase(streams.begin());
+            streams.emplace_back(std::make_unique<keyed_stream>((uint32_t)round));
+        }
+        batch.run();
+        EXPECT_TRUE(batch.empty());
+    }
+}
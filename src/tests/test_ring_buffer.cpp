@@ -0,0 +1,170 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../io/ring_buffer.h"
+
+#include <cstring>
+#include <gtest/gtest.h>
+#include <random>
+#include <sys/uio.h>
+#include <vector>
+
+// =================================================================================
+
+namespace
+{
+    void push(theme::ring_buffer& ring, theme::buffer_pool& pool, const uint8_t* data, size_t size)
+    {
+        ASSERT_TRUE(ring.reserve(pool, size));
+        while (size > 0) {
+            auto [buf, avail] = ring.writable();
+            size_t len = std::min(avail, size);
+            ASSERT_GT(len, 0);
+            memcpy(buf, data, len);
+            ring.commit(len);
+            data += len;
+            size -= len;
+        }
+    }
+
+    std::vector<uint8_t> peek(const theme::ring_buffer& ring)
+    {
+        iovec iov[2];
+        int iovcnt = ring.readable(iov);
+        std::vector<uint8_t> result;
+        for (int i = 0; i < iovcnt; ++i) {
+            auto base = (const uint8_t*)iov[i].iov_base;
+            result.insert(result.end(), base, base + iov[i].iov_len);
+        }
+        return result;
+    }
+};
+
+// =================================================================================
+
+TEST(ring_buffer, empty)
+{
+    theme::ring_buffer ring;
+    iovec iov[2];
+    EXPECT_TRUE(ring.empty());
+    EXPECT_EQ(ring.readable(iov), 0);
+    EXPECT_EQ(std::get<0>(ring.readable()), nullptr);
+}
+
+TEST(ring_buffer, wraps_around)
+{
+    theme::buffer_pool pool;
+    theme::ring_buffer ring;
+    std::vector<uint8_t> data(48);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (uint8_t)i;
+
+    // 64 bytes of storage: fill most of it, drain some, and write across the end.
+    push(ring, pool, data.data(), 48);
+    ring.consume(40);
+    push(ring, pool, data.data(), 48);
+    EXPECT_EQ(ring.size(), 56);
+
+    iovec iov[2];
+    ASSERT_EQ(ring.readable(iov), 2);
+    EXPECT_EQ(iov[0].iov_len, 24);
+    EXPECT_EQ(iov[1].iov_len, 32);
+    EXPECT_EQ(std::get<1>(ring.readable()), 24);
+
+    std::vector<uint8_t> expected(data.begin() + 40, data.end());
+    expected.insert(expected.end(), data.begin(), data.end());
+    EXPECT_EQ(peek(ring), expected);
+}
+
+TEST(ring_buffer, grows_in_order)
+{
+    theme::buffer_pool pool;
+    theme::ring_buffer ring;
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (uint8_t)(i * 3);
+
+    // Growing while wrapped has to linearize the contents.
+    push(ring, pool, data.data(), 48);
+    ring.consume(40);
+    push(ring, pool, data.data(), 48);
+    push(ring, pool, data.data(), 1000);
+
+    std::vector<uint8_t> expected(data.begin() + 40, data.begin() + 48);
+    expected.insert(expected.end(), data.begin(), data.begin() + 48);
+    expected.insert(expected.end(), data.begin(), data.end());
+    EXPECT_EQ(peek(ring), expected);
+}
+
+TEST(ring_buffer, releases_storage_when_drained)
+{
+    theme::buffer_pool pool;
+    theme::ring_buffer ring;
+    uint8_t data[100]{};
+    push(ring, pool, data, sizeof(data));
+    ring.consume(sizeof(data));
+    EXPECT_TRUE(ring.empty());
+
+    // With no storage, nothing can be written until more is reserved.
+    EXPECT_EQ(std::get<1>(ring.writable()), 0);
+    push(ring, pool, data, 10);
+    EXPECT_EQ(ring.size(), 10);
+}
+
+TEST(ring_buffer, swap_moves_storage)
+{
+    theme::buffer_pool pool;
+    theme::ring_buffer ring, other;
+    const uint8_t data[] = { 1, 2, 3, 4, 5 };
+    push(ring, pool, data, sizeof(data));
+    ring.consume(2);
+    const uint8_t* storage = std::get<0>(ring.readable());
+
+    // Whatever is in flight from the old storage stays put while the ring takes new writes.
+    ring.swap(other);
+    EXPECT_TRUE(ring.empty());
+    EXPECT_EQ(std::get<0>(other.readable()), storage);
+    EXPECT_EQ(peek(other), std::vector<uint8_t>({ 3, 4, 5 }));
+
+    push(ring, pool, data, 1);
+    EXPECT_EQ(peek(ring), std::vector<uint8_t>({ 1 }));
+    EXPECT_EQ(peek(other), std::vector<uint8_t>({ 3, 4, 5 }));
+}
+
+TEST(ring_buffer, fifo)
+{
+    theme::buffer_pool pool;
+    theme::ring_buffer ring;
+    std::mt19937 rng(5);
+    std::vector<uint8_t> expected;
+    uint8_t next = 0;
+    for (int i = 0; i < 10000; ++i) {
+        if (rng() % 2) {
+            uint8_t data[300];
+            size_t size = rng() % sizeof(data);
+            for (size_t j = 0; j < size; ++j)
+                data[j] = next++;
+            push(ring, pool, data, size);
+            expected.insert(expected.end(), data, data + size);
+        } else if (!expected.empty()) {
+            size_t size = rng() % (expected.size() + 1);
+            ASSERT_EQ(peek(ring), expected);
+            ring.consume(size);
+            expected.erase(expected.begin(), expected.begin() + size);
+        }
+        ASSERT_EQ(ring.size(), expected.size());
+    }
+    EXPECT_EQ(peek(ring), expected);
+}
@@ -0,0 +1,131 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../core/slab.h"
+
+#include <gtest/gtest.h>
+#include <stdexcept>
+
+// =================================================================================
+
+namespace
+{
+    struct tracked
+    {
+        static int s_live;
+        int m_value;
+
+        tracked(int value) : m_value(value) { s_live++; }
+        ~tracked() { s_live--; }
+    };
+    int tracked::s_live = 0;
+
+    struct throws
+    {
+        throws(bool fail)
+        {
+            if (fail)
+                throw std::runtime_error("nope");
+        }
+    };
+};
+
+// =================================================================================
+
+TEST(slab, emplace_get_erase)
+{
+    theme::slab<tracked, 4> s;
+    auto [a, pa] = s.emplace(1);
+    auto [b, pb] = s.emplace(2);
+    EXPECT_EQ(s.size(), 2);
+    EXPECT_EQ(s.get(a), pa);
+    EXPECT_EQ(s.get(b)->m_value, 2);
+
+    s.erase(a);
+    EXPECT_EQ(s.get(a), nullptr);
+    EXPECT_EQ(s.size(), 1);
+    EXPECT_EQ(tracked::s_live, 1);
+
+    // Erasing twice, or something that was never there, does nothing.
+    s.erase(a);
+    s.erase(theme::slab_handle{ 1000, 1 });
+    EXPECT_EQ(s.size(), 1);
+    EXPECT_EQ(s.get(theme::slab_handle{ 1000, 1 }), nullptr);
+
+    s.clear();
+    EXPECT_TRUE(s.empty());
+    EXPECT_EQ(tracked::s_live, 0);
+}
+
+TEST(slab, stale_handles)
+{
+    theme::slab<tracked, 4> s;
+    auto a = s.emplace(1).first;
+    s.erase(a);
+
+    // The slot is reused, but the old handle doesn't find the new tenant.
+    auto b = s.emplace(2).first;
+    EXPECT_EQ(a.m_index, b.m_index);
+    EXPECT_NE(a, b);
+    EXPECT_EQ(s.get(a), nullptr);
+    EXPECT_EQ(s.get(b)->m_value, 2);
+
+    s.erase(a);
+    EXPECT_EQ(s.get(b)->m_value, 2);
+}
+
+TEST(slab, objects_stay_put)
+{
+    theme::slab<tracked, 4> s;
+    std::vector<std::pair<theme::slab_handle, tracked*>> objects;
+    for (int i = 0; i < 100; ++i)
+        objects.push_back(s.emplace(i));
+    EXPECT_EQ(s.capacity(), 100);
+
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(s.get(objects[i].first), objects[i].second);
+        EXPECT_EQ(objects[i].second->m_value, i);
+    }
+
+    int expected = 0;
+    s.for_each([&](theme::slab_handle handle, tracked& t) {
+        EXPECT_EQ(handle, objects[expected].first);
+        EXPECT_EQ(t.m_value, expected++);
+    });
+    EXPECT_EQ(expected, 100);
+}
+
+TEST(slab, constructor_throws)
+{
+    theme::slab<throws, 4> s;
+    EXPECT_THROW(s.emplace(true), std::runtime_error);
+    EXPECT_TRUE(s.empty());
+
+    // The slot went back on the free list without a live generation.
+    auto h = s.emplace(false).first;
+    EXPECT_EQ(h.m_index, 0);
+    EXPECT_NE(s.get(h), nullptr);
+    EXPECT_EQ(s.capacity(), 4);
+}
+
+TEST(slab, destroyed_with_slab)
+{
+    {
+        theme::slab<tracked, 4> s;
+        for (int i = 0; i < 10; ++i)
+            s.emplace(i);
+    }
+    EXPECT_EQ(tracked::s_live, 0);
+}
@@ -0,0 +1,136 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../io/timer_wheel.h"
+
+#include <gtest/gtest.h>
+
+using namespace std::chrono_literals;
+
+// =================================================================================
+
+namespace
+{
+    struct counting_handler : public theme::timer_handler
+    {
+        int m_fired{};
+
+        void handle_timeout(theme::timer&) override { m_fired++; }
+    };
+
+    class timer_wheel_test : public ::testing::Test
+    {
+    protected:
+        theme::timer_wheel::clock_t::time_point m_epoch{ theme::timer_wheel::clock_t::now() };
+        theme::timer_wheel m_wheel{ m_epoch };
+        counting_handler m_handler;
+    };
+};
+
+// =================================================================================
+
+TEST_F(timer_wheel_test, fires_after_delay)
+{
+    theme::timer t(&m_handler);
+    m_wheel.schedule(t, 250ms, m_epoch);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch), 300);
+
+    m_wheel.advance(m_epoch + 299ms);
+    EXPECT_EQ(m_handler.m_fired, 0);
+    EXPECT_TRUE(t.armed());
+
+    m_wheel.advance(m_epoch + 300ms);
+    EXPECT_EQ(m_handler.m_fired, 1);
+    EXPECT_FALSE(t.armed());
+}
+
+TEST_F(timer_wheel_test, idle_uses_limit)
+{
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch), 30000);
+    m_wheel.advance(m_epoch + 5900ms);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch + 5900ms), 30000);
+}
+
+TEST_F(timer_wheel_test, cancel)
+{
+    theme::timer t(&m_handler);
+    m_wheel.schedule(t, 100ms, m_epoch);
+    t.cancel();
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch), 30000);
+
+    m_wheel.advance(m_epoch + 1s);
+    EXPECT_EQ(m_handler.m_fired, 0);
+}
+
+TEST_F(timer_wheel_test, lowest_level_past_wrap)
+{
+    // At tick 60, a one second timer lands in slot 6 of the lowest level, after it wraps.
+    m_wheel.advance(m_epoch + 5900ms);
+    theme::timer t(&m_handler);
+    m_wheel.schedule(t, 1s, m_epoch + 5900ms);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch + 5900ms), 1100);
+
+    m_wheel.advance(m_epoch + 6900ms);
+    EXPECT_EQ(m_handler.m_fired, 0);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch + 6900ms), 100);
+
+    m_wheel.advance(m_epoch + 7000ms);
+    EXPECT_EQ(m_handler.m_fired, 1);
+}
+
+TEST_F(timer_wheel_test, cascade)
+{
+    // Far enough out to start on the second level.
+    theme::timer t(&m_handler);
+    m_wheel.schedule(t, 10s, m_epoch);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch), 6400);
+
+    m_wheel.advance(m_epoch + 6400ms);
+    EXPECT_EQ(m_handler.m_fired, 0);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch + 6400ms), 3700);
+
+    m_wheel.advance(m_epoch + 10s);
+    EXPECT_EQ(m_handler.m_fired, 0);
+    m_wheel.advance(m_epoch + 10100ms);
+    EXPECT_EQ(m_handler.m_fired, 1);
+}
+
+TEST_F(timer_wheel_test, cascade_before_lowest_level)
+{
+    // The second level timer is due at tick 66, so we must wake at the wrap to cascade it even
+    // though the lowest level has a timer in slot 6.
+    theme::timer early(&m_handler), late(&m_handler);
+    m_wheel.schedule(early, 6500ms, m_epoch);
+    m_wheel.advance(m_epoch + 5900ms);
+    m_wheel.schedule(late, 1s, m_epoch + 5900ms);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch + 5900ms), 500);
+
+    m_wheel.advance(m_epoch + 6400ms);
+    EXPECT_EQ(m_wheel.next_timeout(30000, m_epoch + 6400ms), 200);
+    m_wheel.advance(m_epoch + 6600ms);
+    EXPECT_EQ(m_handler.m_fired, 1);
+    EXPECT_FALSE(early.armed());
+    EXPECT_TRUE(late.armed());
+}
+
+TEST_F(timer_wheel_test, destroyed_while_armed)
+{
+    {
+        theme::timer t(&m_handler);
+        m_wheel.schedule(t, 100ms, m_epoch);
+    }
+    m_wheel.advance(m_epoch + 1s);
+    EXPECT_EQ(m_handler.m_fired, 0);
+}
@@ -0,0 +1,876 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gflags/gflags.h>
+
+#include "../core/config_parser.h"
+#include "../core/log.h"
+#include "../core/metrics.h"
+#include "../core/slab.h"
+#include "../io/buffer_pool.h"
+#include "../io/client_base.h"
+#include "../io/poll.h"
+#include "../io/timer_wheel.h"
+#include "../io/uru_crypt.h"
+#include "../protocol/common.h"
+#include "../protocol/gatekeeper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <openssl/bn.h>
+#include <random>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using namespace ST::literals;
+
+// =================================================================================
+
+DEFINE_string(host, "127.0.0.1", "Address of the GateKeeper to load");
+DEFINE_int32(port, 14617, "Port of the GateKeeper to load");
+DEFINE_string(config_path, "theme.ini", "ThemeSrv configuration to read the gate keys from");
+
+DEFINE_int32(connections, 1000, "Number of connections to hold open (see the GateKeeper's "
+                                "lobby connection limits)");
+DEFINE_int32(threads, 1, "Number of load generating threads");
+DEFINE_int32(connect_rate, 0, "New connections per second, or 0 to open them all at once");
+DEFINE_bool(reconnect, true, "Replace connections as they close");
+DEFINE_int32(duration, 30, "Length of the test, in seconds");
+DEFINE_int32(report_interval, 5, "Seconds between progress reports, or 0 for only the summary");
+
+DEFINE_string(mix, "ping:8,filesrv:1,authsrv:1", "Weighted mix of requests to send");
+DEFINE_int32(ping_payload, 0, "Bytes of payload in each ping");
+DEFINE_int32(rate, 0, "Requests per second to send no matter how the server keeps up (open "
+                      "loop), or 0 to send the next request when a reply arrives (closed loop)");
+DEFINE_int32(outstanding, 1, "Requests each connection keeps in flight in closed loop mode");
+
+DEFINE_double(slow_clients, 0.0, "Fraction of connections that trickle out their requests");
+DEFINE_int32(slow_bytes, 1, "Bytes a slow client sends at a time");
+DEFINE_int32(slow_interval, 100, "Milliseconds between a slow client's sends");
+DEFINE_double(hangups, 0.0, "Fraction of connections that reset at a random point, including "
+                            "in the middle of the handshake or a request");
+
+DEFINE_int32(build_id, 918, "Build ID to send in the connection header");
+DEFINE_int32(build_type, 50, "Build type to send in the connection header");
+DEFINE_int32(branch_id, 1, "Branch ID to send in the connection header");
+
+// =================================================================================
+
+static theme::log s_log{"LOADGEN"};
+
+// These mirror encrypted_handler's.
+enum
+{
+    e_c2s_connect,
+    e_s2c_encrypt,
+};
+
+// Connections that hang up do so within the first this many bytes, which covers the connection
+// header, the handshake, and a handful of requests.
+constexpr uint64_t kHangupWindow = 256;
+
+// Clients may not send buffers any larger than this.
+constexpr int32_t kMaxPingPayload = 1024;
+
+typedef std::chrono::steady_clock steady_clock;
+
+// After a failed connection, wait this long before trying again rather than hammering a server
+// that isn't there.
+constexpr auto kConnectBackoff = std::chrono::milliseconds(100);
+
+// =================================================================================
+
+enum request_kind
+{
+    e_ping,
+    e_fileSrv,
+    e_authSrv,
+    e_numRequestKinds,
+};
+
+struct request_stats
+{
+    const char* m_name;
+    theme::counter m_sent;
+    theme::counter m_replies;
+    theme::latency_histogram m_latency;
+
+    request_stats(const char* name, const char* labels)
+        : m_name(name),
+          m_sent("theme_loadgen_requests_total", "Requests sent", labels),
+          m_replies("theme_loadgen_replies_total", "Replies received", labels),
+          m_latency("theme_loadgen_reply_latency_seconds", "Time from sending a request to its reply",
+                    labels)
+    { }
+};
+
+static request_stats s_requests[e_numRequestKinds] = {
+    { "ping", "type=\"ping\"" },
+    { "filesrv", "type=\"filesrv\"" },
+    { "authsrv", "type=\"authsrv\"" },
+};
+
+static theme::counter s_connects{"theme_loadgen_connects_total", "Connections attempted"};
+static theme::counter s_connectFailures{"theme_loadgen_connect_failures_total",
+                                        "Connections that could not be established"};
+static theme::counter s_handshakes{"theme_loadgen_handshakes_total",
+                                   "Encryption handshakes completed"};
+static theme::counter s_disconnects{"theme_loadgen_disconnects_total",
+                                    "Established connections closed by the server"};
+static theme::counter s_hangups{"theme_loadgen_hangups_total", "Connections deliberately reset"};
+static theme::counter s_errors{"theme_loadgen_errors_total",
+                               "Connections dropped for a malformed or unexpected reply"};
+static theme::counter s_dropped{"theme_loadgen_dropped_total",
+                                "Open loop requests that had no established connection to go to"};
+static theme::gauge s_established{"theme_loadgen_established", "Connections past the handshake"};
+static theme::latency_histogram s_connectLatency{"theme_loadgen_connect_latency_seconds",
+                                                 "Time to establish a TCP connection"};
+static theme::latency_histogram s_handshakeLatency{"theme_loadgen_handshake_latency_seconds",
+                                                   "Time from connecting to the session key"};
+
+// =================================================================================
+
+/** The server's published key, as would be found in plClient's server.ini. */
+struct server_key
+{
+    uint32_t m_g;
+    BIGNUM* m_n;
+    BIGNUM* m_x;
+};
+
+static const theme::crypto* s_crypto;
+static server_key s_key;
+static uint32_t s_mix[e_numRequestKinds];
+static std::atomic<bool> s_running{true};
+
+static const theme::config_item s_config[] = {
+    THEME_CONFIG_STR("gate", "crypt_n", "", "Public Key")
+    THEME_CONFIG_STR("gate", "crypt_x", "", "Shared Key")
+    THEME_CONFIG_INT("gate", "crypt_g", 4, "Base Value")
+};
+
+// The client's half of the key agreement is sent as a bare blob after the encrypt header.
+static const theme::net_field s_ydataField{ theme::net_field::data_type::e_blob, "ydata", 1, 64 };
+static const size_t s_ydataOffsets[] = { 0, 64 };
+static const theme::net_struct s_ydataMsg{ "ydata", 1, &s_ydataField, s_ydataOffsets, 1, 64 };
+
+// =================================================================================
+
+namespace theme
+{
+    class load_worker;
+
+    /** A fake plClient talking to the GateKeeper. */
+    class load_client : public client_base, public poll_handler, public timer_handler
+    {
+        enum class state
+        {
+            e_connecting,
+            e_handshaking,
+            e_established,
+        };
+
+        struct pending_request
+        {
+            uint32_t m_transId;
+            request_kind m_kind;
+            steady_clock::time_point m_sent;
+        };
+
+        load_worker& m_worker;
+        slab_handle m_handle;
+        state m_state;
+        bool m_polling;
+        bool m_wantHeader;
+
+        /** Index in the worker's list of established connections. */
+        size_t m_index;
+
+        /** Sends are trickled out on a timer instead of all at once. */
+        bool m_slow;
+        timer m_trickle;
+
+        /** The connection is reset once this many bytes have been sent, if non-zero. */
+        uint64_t m_hangupAfter;
+
+        steady_clock::time_point m_start;
+        uint8_t m_cliSeed[7];
+        uint32_t m_transId;
+        std::deque<pending_request> m_pending;
+
+        friend class load_worker;
+
+        bool start_handshake();
+        bool handle_message(buffer_ptr_t& buf);
+        bool handle_encrypt(buffer_ptr_t& buf);
+        bool handle_reply(buffer_ptr_t& buf);
+
+        /**
+         * Sends as much queued output as the client's persona allows.
+         * \return Returns false if the client hung up and has been destroyed.
+         */
+        bool send(size_t limit=(size_t)-1);
+
+    public:
+        load_client(load_worker& worker, socket& sock, bool slow, uint64_t hangup_after);
+        ~load_client();
+
+        size_t outstanding() const { return m_pending.size(); }
+
+        void send_request(request_kind kind, steady_clock::time_point when);
+
+        /** \return Returns false if the client hung up and has been destroyed. */
+        bool flush();
+
+        void handle_events(int fd, uint32_t events) override;
+        void handle_timeout(timer& t) override;
+    };
+
+    /** One thread's worth of connections, run like a reactor. */
+    class load_worker
+    {
+        std::unique_ptr<poll_dispatch> m_poll;
+        timer_wheel m_timers;
+        buffer_pool m_buffers;
+        slab<load_client> m_clients;
+        std::vector<load_client*> m_established;
+
+        std::mt19937 m_rng;
+        std::discrete_distribution<int> m_mix;
+        std::uniform_real_distribution<double> m_chance;
+        std::uniform_int_distribution<uint64_t> m_hangupPoint;
+
+        size_t m_target;
+        double m_rate;
+        double m_connectRate;
+
+        steady_clock::time_point m_start;
+        steady_clock::time_point m_retryAt;
+        uint64_t m_opened;
+        uint64_t m_scheduled;
+        size_t m_next;
+
+        std::vector<uint8_t> m_ping;
+        std::thread m_thread;
+
+        void open_connections(steady_clock::time_point now);
+        void send_scheduled(steady_clock::time_point now);
+        void run();
+
+    public:
+        load_worker(size_t index, size_t target, double rate, double connect_rate);
+        load_worker(const load_worker&) = delete;
+        load_worker(load_worker&&) = delete;
+
+        poll_dispatch* poll() { return m_poll.get(); }
+        timer_wheel& timers() { return m_timers; }
+        buffer_pool& buffers() { return m_buffers; }
+
+        request_kind next_request() { return (request_kind)m_mix(m_rng); }
+
+        /** A ping request in its memory representation, with the configured payload. */
+        std::vector<uint8_t>& ping_buffer() { return m_ping; }
+
+        void add_established(load_client& cli);
+        void remove_established(load_client& cli);
+        void close(load_client& cli) { m_clients.erase(cli.m_handle); }
+
+        /** Holds off on opening more connections for a little while. */
+        void connect_failed();
+
+        void start() { m_thread = std::thread(&load_worker::run, this); }
+        void join() { m_thread.join(); }
+    };
+};
+
+// =================================================================================
+
+theme::load_client::load_client(theme::load_worker& worker, theme::socket& sock, bool slow,
+                                uint64_t hangup_after)
+    : client_base(sock, worker.buffers()), m_worker(worker), m_handle(),
+      m_state(state::e_connecting), m_polling(), m_wantHeader(), m_index((size_t)-1),
+      m_slow(slow), m_trickle(this), m_hangupAfter(hangup_after),
+      m_start(steady_clock::now()), m_cliSeed(), m_transId()
+{
+    constexpr uint32_t events = poll_dispatch::e_read | poll_dispatch::e_write | poll_dispatch::e_hup;
+    if (worker.poll()->add_fd(m_socket, (poll_dispatch::events)events, this))
+        m_polling = true;
+}
+
+theme::load_client::~load_client()
+{
+    if (m_polling)
+        m_worker.poll()->remove_fd(m_socket);
+    if (m_state == state::e_established) {
+        m_worker.remove_established(*this);
+        s_established.dec();
+    }
+}
+
+// =================================================================================
+
+bool theme::load_client::start_handshake()
+{
+    // The GateKeeper doesn't care about the token that follows the header, but plClient sends it.
+    uint8_t connect[sizeof(protocol::common_connection_header) + 16]{};
+    auto header = (protocol::common_connection_header*)connect;
+    header->set_connType(protocol::e_protocolCli2Gate);
+    header->set_msgsz(sizeof(protocol::common_connection_header) - sizeof(uint32_t));
+    header->set_buildId(FLAGS_build_id);
+    header->set_buildType(FLAGS_build_type);
+    header->set_branchId(FLAGS_branch_id);
+    header->set_bufsz(sizeof(connect) - sizeof(protocol::common_connection_header));
+    write(protocol::common_connection_header::net_struct, connect);
+
+    uint8_t y_data[64];
+    if (!s_crypto->make_client_key(s_key.m_g, s_key.m_n, s_key.m_x, sizeof(y_data), y_data,
+                                   sizeof(m_cliSeed), m_cliSeed)) {
+        s_log.error("{}: failed to compute the client key", m_socket.to_string());
+        return false;
+    }
+
+    protocol::common_encrypt_header encrypt;
+    encrypt.set_msgId(e_c2s_connect);
+    encrypt.set_bufsz(sizeof(encrypt) + sizeof(y_data));
+    write(&encrypt);
+    write(&s_ydataMsg, y_data);
+
+    // The server's seed comes back in the clear.
+    read<protocol::common_encrypt_s2c>();
+    m_state = state::e_handshaking;
+    m_start = steady_clock::now();
+    return true;
+}
+
+bool theme::load_client::handle_message(theme::buffer_ptr_t& buf)
+{
+    switch (m_state) {
+    case state::e_handshaking:
+        return handle_encrypt(buf);
+    case state::e_established:
+        return handle_reply(buf);
+    default:
+        return false;
+    }
+}
+
+bool theme::load_client::handle_encrypt(theme::buffer_ptr_t& buf)
+{
+    auto reply = (const protocol::common_encrypt_s2c*)buf.get();
+    if (reply->get_msgId() != e_s2c_encrypt || reply->get_bufsz() != sizeof(*reply)) {
+        s_log.error("{}: bad encryption reply {} ({} bytes)", m_socket.to_string(),
+                    reply->get_msgId(), reply->get_bufsz());
+        return false;
+    }
+
+    uint8_t key[sizeof(m_cliSeed)];
+    static_assert(sizeof(key) == sizeof(reply->m_srvSeed));
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = m_cliSeed[i] ^ reply->m_srvSeed[i];
+    set_crypt_key(sizeof(key), key);
+
+    auto elapsed = steady_clock::now() - m_start;
+    s_handshakeLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    s_handshakes.inc();
+    s_established.inc();
+    m_state = state::e_established;
+    m_worker.add_established(*this);
+
+    m_wantHeader = true;
+    read<protocol::common_msg_std_header>();
+
+    if (FLAGS_rate == 0) {
+        auto now = steady_clock::now();
+        for (int32_t i = 0; i < FLAGS_outstanding; ++i)
+            send_request(m_worker.next_request(), now);
+    }
+    return true;
+}
+
+bool theme::load_client::handle_reply(theme::buffer_ptr_t& buf)
+{
+    auto header = (const protocol::common_msg_std_header*)buf.get();
+    if (m_wantHeader) {
+        const net_struct* ns;
+        switch (header->get_type()) {
+        case protocol::gatekeeper::e_pingReply:
+            ns = protocol::gatekeeper_pingReply::net_struct;
+            break;
+        case protocol::gatekeeper::e_fileSrvReply:
+            ns = protocol::gatekeeper_fileSrvReply::net_struct;
+            break;
+        case protocol::gatekeeper::e_authSrvReply:
+            ns = protocol::gatekeeper_authSrvReply::net_struct;
+            break;
+        default:
+            s_log.error("{}: unknown reply {x}", m_socket.to_string(), header->get_type());
+            return false;
+        }
+
+        m_wantHeader = false;
+        read(ns, 1, buf);
+        return true;
+    }
+
+    uint32_t transId;
+    if (header->get_type() == protocol::gatekeeper::e_pingReply)
+        transId = ((const protocol::gatekeeper_pingReply*)buf.get())->get_transId();
+    else
+        transId = ((const protocol::gatekeeper_fileSrvReply*)buf.get())->get_transId();
+
+    // The GateKeeper answers in order, so the reply must be for our oldest request.
+    if (m_pending.empty() || m_pending.front().m_transId != transId) {
+        s_log.error("{}: unexpected reply to transaction {}", m_socket.to_string(), transId);
+        return false;
+    }
+
+    const pending_request& req = m_pending.front();
+    auto elapsed = steady_clock::now() - req.m_sent;
+    s_requests[req.m_kind].m_replies.inc();
+    s_requests[req.m_kind].m_latency.record(
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    m_pending.pop_front();
+
+    m_wantHeader = true;
+    read<protocol::common_msg_std_header>();
+
+    if (FLAGS_rate == 0)
+        send_request(m_worker.next_request(), steady_clock::now());
+    return true;
+}
+
+// =================================================================================
+
+void theme::load_client::send_request(request_kind kind, steady_clock::time_point when)
+{
+    uint32_t transId = ++m_transId;
+    switch (kind) {
+    case e_ping:
+    {
+        std::vector<uint8_t>& buf = m_worker.ping_buffer();
+        auto req = (protocol::gatekeeper_pingRequest*)buf.data();
+        req->set_pingTime((uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            when.time_since_epoch()).count());
+        req->set_transId(transId);
+        write(protocol::gatekeeper_pingRequest::net_struct, buf.data());
+        break;
+    }
+    case e_fileSrv:
+    {
+        protocol::gatekeeper_fileSrvRequest req;
+        req.set_type(req.id());
+        req.set_transId(transId);
+        req.set_isPatcher(0);
+        write(&req);
+        break;
+    }
+    case e_authSrv:
+    {
+        protocol::gatekeeper_authSrvRequest req;
+        req.set_type(req.id());
+        req.set_transId(transId);
+        write(&req);
+        break;
+    }
+    default:
+        return;
+    }
+
+    m_pending.push_back({ transId, kind, when });
+    s_requests[kind].m_sent.inc();
+}
+
+bool theme::load_client::flush()
+{
+    if (m_slow) {
+        if (has_pending_write() && !m_trickle.armed())
+            m_worker.timers().schedule(m_trickle, std::chrono::milliseconds(FLAGS_slow_interval));
+        return true;
+    }
+    return send();
+}
+
+bool theme::load_client::send(size_t limit)
+{
+    if (m_hangupAfter != 0)
+        limit = std::min<uint64_t>(limit, m_hangupAfter - tx_bytes());
+    handle_write(limit);
+
+    if (m_hangupAfter != 0 && tx_bytes() >= m_hangupAfter) {
+        // Reset the connection rather than closing it gracefully, like a client that crashed.
+        linger lin{ 1, 0 };
+        setsockopt(m_socket, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+        s_hangups.inc();
+        m_worker.close(*this);
+        return false;
+    }
+    return true;
+}
+
+// =================================================================================
+
+void theme::load_client::handle_events(int, uint32_t events)
+{
+    if (events & poll_dispatch::e_hup) {
+        m_polling = false;
+        if (m_state == state::e_connecting)
+            m_worker.connect_failed();
+        else
+            s_disconnects.inc();
+        m_worker.close(*this);
+        return;
+    }
+
+    if (m_state == state::e_connecting) {
+        if (!(events & poll_dispatch::e_write))
+            return;
+
+        int error = m_socket.get_error();
+        if (error != 0) {
+            s_log.debug("{}: connect failed: {}", m_socket.to_string(), strerror(error));
+            m_worker.connect_failed();
+            m_worker.close(*this);
+            return;
+        }
+
+        auto elapsed = steady_clock::now() - m_start;
+        s_connectLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        if (!start_handshake()) {
+            m_worker.close(*this);
+            return;
+        }
+    }
+
+    if ((events & poll_dispatch::e_read) && has_pending_read()) {
+        while (auto buf = handle_read()) {
+            if (!handle_message(buf)) {
+                s_errors.inc();
+                m_worker.close(*this);
+                return;
+            }
+        }
+    }
+
+    if (flush())
+        refill_keystream();
+}
+
+void theme::load_client::handle_timeout(theme::timer&)
+{
+    if (send(FLAGS_slow_bytes))
+        flush();
+}
+
+// =================================================================================
+
+theme::load_worker::load_worker(size_t index, size_t target, double rate, double connect_rate)
+    : m_poll(poll_dispatch::create()), m_rng(std::random_device()() + index),
+      m_mix(std::begin(s_mix), std::end(s_mix)), m_chance(0.0, 1.0),
+      m_hangupPoint(1, kHangupWindow), m_target(target), m_rate(rate),
+      m_connectRate(connect_rate), m_opened(), m_scheduled(), m_next()
+{
+    m_ping.resize(sizeof(protocol::gatekeeper_pingRequest) + FLAGS_ping_payload, 0x5A);
+    auto ping = (protocol::gatekeeper_pingRequest*)m_ping.data();
+    ping->set_type(ping->id());
+    ping->set_payloadsz(FLAGS_ping_payload);
+}
+
+void theme::load_worker::add_established(theme::load_client& cli)
+{
+    cli.m_index = m_established.size();
+    m_established.push_back(&cli);
+}
+
+void theme::load_worker::remove_established(theme::load_client& cli)
+{
+    THEME_ASSERTD(cli.m_index < m_established.size() && m_established[cli.m_index] == &cli);
+    m_established.back()->m_index = cli.m_index;
+    m_established[cli.m_index] = m_established.back();
+    m_established.pop_back();
+    cli.m_index = (size_t)-1;
+}
+
+void theme::load_worker::connect_failed()
+{
+    s_connectFailures.inc();
+    m_retryAt = steady_clock::now() + kConnectBackoff;
+}
+
+void theme::load_worker::open_connections(steady_clock::time_point now)
+{
+    if (now < m_retryAt)
+        return;
+
+    double elapsed = std::chrono::duration<double>(now - m_start).count();
+    while (m_clients.size() < m_target && (FLAGS_reconnect || m_opened < m_target)) {
+        if (m_connectRate > 0.0 && m_opened >= elapsed * m_connectRate)
+            break;
+
+        m_opened++;
+        s_connects.inc();
+
+        socket sock;
+        if (!sock.connect(FLAGS_host.c_str(), FLAGS_port)) {
+            connect_failed();
+            break;
+        }
+
+        bool slow = m_chance(m_rng) < FLAGS_slow_clients;
+        uint64_t hangup = (m_chance(m_rng) < FLAGS_hangups) ? m_hangupPoint(m_rng) : 0;
+        auto [handle, cli] = m_clients.emplace(*this, sock, slow, hangup);
+        cli->m_handle = handle;
+    }
+}
+
+void theme::load_worker::send_scheduled(steady_clock::time_point now)
+{
+    double elapsed = std::chrono::duration<double>(now - m_start).count();
+    uint64_t due = (uint64_t)(elapsed * m_rate);
+    for (; m_scheduled < due; ++m_scheduled) {
+        if (m_established.empty()) {
+            s_dropped.inc();
+            continue;
+        }
+
+        // Time the request from when it was due, not from when we got around to it, so that a
+        // stalled server can't hide its latency by slowing us down.
+        auto when = m_start + std::chrono::duration_cast<steady_clock::duration>(
+            std::chrono::duration<double>(m_scheduled / m_rate));
+        load_client* cli = m_established[m_next++ % m_established.size()];
+        cli->send_request(next_request(), when);
+        cli->flush();
+    }
+}
+
+void theme::load_worker::run()
+{
+    m_start = steady_clock::now();
+    while (s_running.load(std::memory_order_relaxed)) {
+        auto now = steady_clock::now();
+        open_connections(now);
+        if (m_rate > 0.0)
+            send_scheduled(now);
+
+        // Open loop requests and paced connections need a finer clock than the timer wheel.
+        int timeout = m_timers.next_timeout(100);
+        if (m_rate > 0.0 || m_clients.size() < m_target)
+            timeout = std::min(timeout, 1);
+        m_poll->dispatch(timeout);
+        m_timers.advance();
+    }
+    m_clients.clear();
+}
+
+// =================================================================================
+
+static bool parse_mix(const std::string& mix)
+{
+    std::fill(std::begin(s_mix), std::end(s_mix), 0);
+    size_t pos = 0;
+    while (pos < mix.size()) {
+        size_t end = mix.find(',', pos);
+        if (end == std::string::npos)
+            end = mix.size();
+        std::string item = mix.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        uint32_t weight = (colon == std::string::npos) ? 1 : strtoul(item.c_str() + colon + 1, nullptr, 10);
+
+        auto it = std::find_if(std::begin(s_requests), std::end(s_requests),
+                               [&name](const request_stats& req) { return name == req.m_name; });
+        if (it == std::end(s_requests)) {
+            fprintf(stderr, "unknown request type '%s' in --mix\n", name.c_str());
+            return false;
+        }
+        s_mix[it - std::begin(s_requests)] = weight;
+    }
+
+    if (std::all_of(std::begin(s_mix), std::end(s_mix), [](uint32_t w) { return w == 0; })) {
+        fprintf(stderr, "--mix doesn't include any requests\n");
+        return false;
+    }
+    return true;
+}
+
+static bool load_server_key(const theme::crypto& crypt)
+{
+    theme::config_parser config(s_config);
+    if (!config.read(FLAGS_config_path.c_str())) {
+        fprintf(stderr, "%s: unable to read the configuration\n", FLAGS_config_path.c_str());
+        return false;
+    }
+
+    const ST::string& n = config.get<const ST::string&>("gate", "crypt_n");
+    const ST::string& x = config.get<const ST::string&>("gate", "crypt_x");
+    if (n.empty() || x.empty()) {
+        fprintf(stderr, "%s: no gate keys configured, run theme_daemon with --generate_keys\n",
+                FLAGS_config_path.c_str());
+        return false;
+    }
+
+    s_key.m_g = config.get<unsigned int>("gate", "crypt_g");
+    s_key.m_n = crypt.load_key(n);
+    s_key.m_x = crypt.load_key(x);
+    return true;
+}
+
+static void print_report(const char* title, double seconds, int64_t established,
+                         const std::vector<theme::latency_histogram::snapshot>& snaps,
+                         const std::vector<uint64_t>& sent, const std::vector<uint64_t>& replies)
+{
+    printf("%s (%.1fs): established %lld, connects %llu, connect failures %llu, handshakes %llu, "
+           "disconnects %llu, hangups %llu, errors %llu, dropped %llu\n",
+           title, seconds, (long long)established,
+           (unsigned long long)s_connects.value(), (unsigned long long)s_connectFailures.value(),
+           (unsigned long long)s_handshakes.value(), (unsigned long long)s_disconnects.value(),
+           (unsigned long long)s_hangups.value(), (unsigned long long)s_errors.value(),
+           (unsigned long long)s_dropped.value());
+    printf("  %-10s %10s %10s %10s %10s %10s %10s\n", "", "sent/s", "replies/s", "p50 us",
+           "p99 us", "p999 us", "max us");
+
+    auto print_row = [seconds](const char* name, const theme::latency_histogram::snapshot& snap,
+                               double sent, double replies) {
+        printf("  %-10s %10.1f %10.1f %10llu %10llu %10llu %10llu\n", name, sent / seconds,
+               replies / seconds, (unsigned long long)snap.percentile(0.5),
+               (unsigned long long)snap.percentile(0.99), (unsigned long long)snap.percentile(0.999),
+               (unsigned long long)snap.max());
+    };
+    print_row("connect", snaps[e_numRequestKinds], 0.0, snaps[e_numRequestKinds].m_count);
+    print_row("handshake", snaps[e_numRequestKinds + 1], 0.0, snaps[e_numRequestKinds + 1].m_count);
+    for (size_t i = 0; i < e_numRequestKinds; ++i)
+        print_row(s_requests[i].m_name, snaps[i], sent[i], replies[i]);
+    fflush(stdout);
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    gflags::SetUsageMessage("Simulates a crowd of plClients logging in to a GateKeeper.\n"
+                            "The GateKeeper's default lobby limits admit 16 connections from a "
+                            "host at 5 per second. Set max_conns_per_ip and conn_rate_per_ip "
+                            "(and the _per_net ones) to 0 in its configuration before loading "
+                            "it from a single machine.");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    theme::log::set_level(theme::log::level::e_warning);
+
+    if (FLAGS_connections <= 0 || FLAGS_threads <= 0 || FLAGS_outstanding <= 0) {
+        fprintf(stderr, "--connections, --threads, and --outstanding must be positive\n");
+        return 1;
+    }
+    if (FLAGS_ping_payload < 0 || FLAGS_ping_payload > kMaxPingPayload) {
+        fprintf(stderr, "--ping_payload must be between 0 and %d\n", kMaxPingPayload);
+        return 1;
+    }
+    if (!parse_mix(FLAGS_mix))
+        return 1;
+
+    theme::crypto crypt;
+    s_crypto = &crypt;
+    if (!load_server_key(crypt))
+        return 1;
+
+    // Every connection needs an fd.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    auto stop = [](int) { s_running.store(false, std::memory_order_relaxed); };
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<theme::load_worker>> workers;
+    for (int32_t i = 0; i < FLAGS_threads; ++i) {
+        size_t target = FLAGS_connections / FLAGS_threads + (i < FLAGS_connections % FLAGS_threads);
+        workers.emplace_back(std::make_unique<theme::load_worker>(
+            i, target, (double)FLAGS_rate / FLAGS_threads, (double)FLAGS_connect_rate / FLAGS_threads));
+    }
+
+    auto take_snapshots = []() {
+        std::vector<theme::latency_histogram::snapshot> snaps;
+        for (const request_stats& req : s_requests)
+            snaps.push_back(req.m_latency.take_snapshot());
+        snaps.push_back(s_connectLatency.take_snapshot());
+        snaps.push_back(s_handshakeLatency.take_snapshot());
+        return snaps;
+    };
+    auto take_counts = [](const theme::counter request_stats::*member) {
+        std::vector<uint64_t> counts;
+        for (const request_stats& req : s_requests)
+            counts.push_back((req.*member).value());
+        return counts;
+    };
+
+    auto start = steady_clock::now();
+    auto end = start + std::chrono::seconds(FLAGS_duration);
+    auto last = start;
+    auto last_snaps = take_snapshots();
+    auto last_sent = take_counts(&request_stats::m_sent);
+    auto last_replies = take_counts(&request_stats::m_replies);
+    for (auto& worker : workers)
+        worker->start();
+
+    while (s_running.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto now = steady_clock::now();
+        if (now >= end)
+            break;
+        if (FLAGS_report_interval <= 0 || now - last < std::chrono::seconds(FLAGS_report_interval))
+            continue;
+
+        auto snaps = take_snapshots();
+        auto sent = take_counts(&request_stats::m_sent);
+        auto replies = take_counts(&request_stats::m_replies);
+        for (size_t i = 0; i < snaps.size(); ++i)
+            snaps[i] = snaps[i] - last_snaps[i];
+        for (size_t i = 0; i < sent.size(); ++i) {
+            sent[i] -= last_sent[i];
+            replies[i] -= last_replies[i];
+        }
+        print_report("interval", std::chrono::duration<double>(now - last).count(),
+                     s_established.value(), snaps, sent, replies);
+
+        last = now;
+        last_snaps = take_snapshots();
+        last_sent = take_counts(&request_stats::m_sent);
+        last_replies = take_counts(&request_stats::m_replies);
+    }
+
+    // The workers hang up on their way out, so count the survivors first.
+    int64_t established = s_established.value();
+    s_running.store(false, std::memory_order_relaxed);
+    for (auto& worker : workers)
+        worker->join();
+
+    print_report("summary", std::chrono::duration<double>(steady_clock::now() - start).count(),
+                 established, take_snapshots(), take_counts(&request_stats::m_sent),
+                 take_counts(&request_stats::m_replies));
+    BN_free(s_key.m_n);
+    BN_free(s_key.m_x);
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../core/log_format.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// =================================================================================
+
+/** Converts one binary log file to text on stdout. */
+static bool decode(const char* path)
+{
+    FILE* stream = fopen(path, "rb");
+    if (!stream) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    std::unique_ptr<FILE, int(*)(FILE*)> closer(stream, fclose);
+
+    char magic[sizeof(theme::log_file::kMagic)];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, stream) != 1 ||
+        memcmp(magic, theme::log_file::kMagic, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, stream) != 1) {
+        fprintf(stderr, "%s: not a ThemeSrv binary log\n", path);
+        return false;
+    }
+    if (version != theme::log_file::kVersion) {
+        fprintf(stderr, "%s: unsupported log version %u\n", path, version);
+        return false;
+    }
+
+    std::vector<std::string> formats;
+    std::string name, data, line, output;
+    char timestamp[64];
+
+    theme::log_file::frame_header header;
+    while (fread(&header, sizeof(header), 1, stream) == 1) {
+        name.resize(header.m_namesz);
+        data.resize(header.m_datasz);
+        if ((header.m_namesz && fread(name.data(), header.m_namesz, 1, stream) != 1) ||
+            (header.m_datasz && fread(data.data(), header.m_datasz, 1, stream) != 1)) {
+            fprintf(stderr, "%s: truncated frame\n", path);
+            break;
+        }
+
+        switch (header.m_type) {
+        case theme::log_file::e_format:
+            if (header.m_format >= formats.size())
+                formats.resize(header.m_format + 1);
+            formats[header.m_format] = data;
+            continue;
+        case theme::log_file::e_text:
+            line = data;
+            break;
+        case theme::log_file::e_deferred:
+            line.clear();
+            if (header.m_format < formats.size())
+                theme::log_args::format(line, formats[header.m_format].c_str(),
+                                        (const uint8_t*)data.data(), data.size());
+            else
+                line = "<unknown format>";
+            break;
+        default:
+            fprintf(stderr, "%s: unknown frame type %u\n", path, header.m_type);
+            return false;
+        }
+
+        theme::log_file::format_time(timestamp, (std::time_t)header.m_time);
+        output.clear();
+        theme::log_file::append_line(output, timestamp, header.m_level, name, line);
+        fwrite(output.data(), 1, output.size(), stdout);
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " LOGFILE..." << std::endl;
+        return 1;
+    }
+
+    bool result = true;
+    for (int i = 1; i < argc; ++i)
+        result &= decode(argv[i]);
+    return result ? 0 : 1;
+}
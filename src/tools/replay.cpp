@@ -0,0 +1,677 @@
+/*   This file is part of ThemeSrv.
+ *
+ *   ThemeSrv is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ThemeSrv is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with ThemeSrv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gflags/gflags.h>
+
+#include "../core/config_parser.h"
+#include "../core/log.h"
+#include "../core/metrics.h"
+#include "../core/slab.h"
+#include "../io/buffer_pool.h"
+#include "../io/capture.h"
+#include "../io/client_base.h"
+#include "../io/poll.h"
+#include "../io/uru_crypt.h"
+#include "../protocol/common.h"
+#include "../protocol/gatekeeper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <openssl/bn.h>
+#include <sys/resource.h>
+#include <unordered_map>
+#include <vector>
+
+// =================================================================================
+
+DEFINE_string(host, "127.0.0.1", "Address of the GateKeeper to replay against");
+DEFINE_int32(port, 14617, "Port of the GateKeeper to replay against");
+DEFINE_string(config_path, "theme.ini", "ThemeSrv configuration to read the gate keys from");
+DEFINE_double(speed, 1.0, "Playback speed relative to the capture, or 0 to send everything as "
+                          "fast as possible");
+DEFINE_int32(linger, 5, "Seconds to wait for outstanding replies once the capture runs out");
+
+// =================================================================================
+
+static theme::log s_log{"REPLAY"};
+
+// These mirror encrypted_handler's.
+enum
+{
+    e_c2s_connect,
+    e_s2c_encrypt,
+};
+
+// The only client seed the GateKeeper accepts, and so the only one we know how to replace.
+constexpr size_t kYDataSize = 64;
+
+typedef std::chrono::steady_clock steady_clock;
+
+// =================================================================================
+
+static theme::counter s_connects{"theme_replay_connects_total", "Captured connections opened"};
+static theme::counter s_connectFailures{"theme_replay_connect_failures_total",
+                                        "Connections that could not be established"};
+static theme::counter s_handshakes{"theme_replay_handshakes_total",
+                                   "Encryption handshakes completed"};
+static theme::counter s_disconnects{"theme_replay_disconnects_total",
+                                    "Connections closed by the server before the capture did"};
+static theme::counter s_errors{"theme_replay_errors_total",
+                               "Connections dropped for a malformed or unexpected reply"};
+static theme::counter s_messages{"theme_replay_messages_total", "Captured messages sent"};
+static theme::counter s_bytes{"theme_replay_bytes_total", "Bytes of captured messages sent"};
+static theme::counter s_replies{"theme_replay_replies_total", "Replies received"};
+static theme::counter s_unanswered{"theme_replay_unanswered_total",
+                                   "Established messages that never got a reply"};
+static theme::latency_histogram s_replyLatency{"theme_replay_reply_latency_seconds",
+                                               "Time from sending a captured message to its reply"};
+static theme::latency_histogram s_handshakeLatency{"theme_replay_handshake_latency_seconds",
+                                                   "Time from sending the client seed to the "
+                                                   "session key"};
+static theme::latency_histogram s_lag{"theme_replay_lag_seconds",
+                                      "How far behind the capture's timing each event was replayed"};
+
+// =================================================================================
+
+/** A frame of the capture, pointing into the loaded file. */
+struct capture_event
+{
+    theme::capture_file::frame_type m_type;
+    uint32_t m_conn;
+    int64_t m_time;
+    const uint8_t* m_data;
+    size_t m_datasz;
+};
+
+/** The server's published key, as would be found in plClient's server.ini. */
+struct server_key
+{
+    uint32_t m_g;
+    BIGNUM* m_n;
+    BIGNUM* m_x;
+};
+
+static const theme::crypto* s_crypto;
+static server_key s_key;
+static std::atomic<bool> s_running{true};
+
+static const theme::config_item s_config[] = {
+    THEME_CONFIG_STR("gate", "crypt_n", "", "Public Key")
+    THEME_CONFIG_STR("gate", "crypt_x", "", "Shared Key")
+    THEME_CONFIG_INT("gate", "crypt_g", 4, "Base Value")
+};
+
+// =================================================================================
+
+namespace theme
+{
+    class replayer;
+
+    /**
+     * Plays back one captured connection.
+     * The connection header and encryption handshake are sent as captured, except that the
+     * client seed is swapped for one of our own so that the server agrees on a key with us.
+     * Everything after that is encrypted with our key.
+     */
+    class replay_client : public client_base, public poll_handler
+    {
+        enum class state
+        {
+            e_connecting,
+            e_cleartext,
+            e_handshaking,
+            e_established,
+        };
+
+        replayer& m_replayer;
+        slab_handle m_handle;
+        state m_state;
+        bool m_polling;
+        bool m_wantHeader;
+
+        /** The capture has closed the connection, so hang up once everything has been answered. */
+        bool m_closing;
+
+        /** Messages waiting for the connection or the session key, in order. */
+        std::deque<const capture_event*> m_queued;
+
+        /** Number of messages sent before the handshake, which tells us where the seed is. */
+        size_t m_cleartext;
+        size_t m_ydatasz;
+        uint8_t m_cliSeed[7];
+        steady_clock::time_point m_start;
+
+        /** When each message still awaiting a reply was sent. The GateKeeper answers in order. */
+        std::deque<steady_clock::time_point> m_awaiting;
+
+        /** Captured messages are written as a single blob, sized on the fly. */
+        net_field m_rawField;
+        size_t m_rawOffsets[2];
+        net_struct m_rawMsg;
+
+        friend class replayer;
+
+        void write_raw(const uint8_t* buf, size_t bufsz);
+        bool send_message(const capture_event& ev);
+        bool handle_message(buffer_ptr_t& buf);
+        bool handle_encrypt(buffer_ptr_t& buf);
+        bool handle_reply(buffer_ptr_t& buf);
+
+        /** \return Returns false if the client is done and has been destroyed. */
+        bool pump();
+
+    public:
+        replay_client(replayer& replay, socket& sock);
+        ~replay_client();
+
+        void enqueue(const capture_event& ev) { m_queued.push_back(&ev); pump(); }
+        void capture_closed() { m_closing = true; pump(); }
+
+        void handle_events(int fd, uint32_t events) override;
+    };
+
+    /** Plays back a whole capture on a single thread. */
+    class replayer
+    {
+        std::unique_ptr<poll_dispatch> m_poll;
+        buffer_pool m_buffers;
+        slab<replay_client> m_clients;
+        std::unordered_map<uint32_t, slab_handle> m_conns;
+
+        void apply(const capture_event& ev);
+
+    public:
+        replayer();
+        replayer(const replayer&) = delete;
+        replayer(replayer&&) = delete;
+
+        poll_dispatch* poll() { return m_poll.get(); }
+        buffer_pool& buffers() { return m_buffers; }
+
+        void close(replay_client& cli) { m_clients.erase(cli.m_handle); }
+
+        void run(const std::vector<capture_event>& events);
+    };
+};
+
+// =================================================================================
+
+theme::replay_client::replay_client(theme::replayer& replay, theme::socket& sock)
+    : client_base(sock, replay.buffers()), m_replayer(replay), m_handle(),
+      m_state(state::e_connecting), m_polling(), m_wantHeader(), m_closing(), m_cleartext(),
+      m_ydatasz(), m_cliSeed(),
+      m_rawField({ net_field::data_type::e_blob, "capture", 1, 0 }), m_rawOffsets(),
+      m_rawMsg({ "capture", 1, &m_rawField, m_rawOffsets, 1, 0 })
+{
+    constexpr uint32_t events = poll_dispatch::e_read | poll_dispatch::e_write | poll_dispatch::e_hup;
+    if (replay.poll()->add_fd(m_socket, (poll_dispatch::events)events, this))
+        m_polling = true;
+}
+
+theme::replay_client::~replay_client()
+{
+    if (m_polling)
+        m_replayer.poll()->remove_fd(m_socket);
+    s_unanswered.inc(m_awaiting.size());
+}
+
+// =================================================================================
+
+void theme::replay_client::write_raw(const uint8_t* buf, size_t bufsz)
+{
+    m_rawField.m_count = bufsz;
+    m_rawOffsets[1] = bufsz;
+    m_rawMsg.m_fixedsz = bufsz;
+    write(&m_rawMsg, buf);
+}
+
+bool theme::replay_client::send_message(const capture_event& ev)
+{
+    if (m_state == state::e_established) {
+        write_raw(ev.m_data, ev.m_datasz);
+        m_awaiting.push_back(steady_clock::now());
+        s_messages.inc();
+        s_bytes.inc(ev.m_datasz);
+        return true;
+    }
+
+    // The connection header goes out as it was captured, then the encryption header...
+    size_t index = m_cleartext++;
+    if (index == 1 && ev.m_datasz == sizeof(protocol::common_encrypt_header)) {
+        auto header = (const protocol::common_encrypt_header*)ev.m_data;
+        if (header->get_msgId() == e_c2s_connect && header->get_bufsz() >= sizeof(*header))
+            m_ydatasz = header->get_bufsz() - sizeof(*header);
+
+        // The server may have allowed an unencrypted session.
+        if (m_ydatasz == 0)
+            m_state = state::e_established;
+    }
+
+    // ...and finally the client seed, which has to be ours so that we know the session key.
+    if (index == 2 && m_ydatasz != 0) {
+        if (m_ydatasz != kYDataSize || ev.m_datasz != m_ydatasz) {
+            s_log.error("{}: captured client seed is {} bytes, expected {}",
+                        m_socket.to_string(), ev.m_datasz, kYDataSize);
+            return false;
+        }
+
+        uint8_t y_data[kYDataSize];
+        if (!s_crypto->make_client_key(s_key.m_g, s_key.m_n, s_key.m_x, sizeof(y_data), y_data,
+                                       sizeof(m_cliSeed), m_cliSeed)) {
+            s_log.error("{}: failed to compute the client key", m_socket.to_string());
+            return false;
+        }
+        write_raw(y_data, sizeof(y_data));
+
+        // The server's seed comes back in the clear.
+        read<protocol::common_encrypt_s2c>();
+        m_state = state::e_handshaking;
+        m_start = steady_clock::now();
+    } else {
+        write_raw(ev.m_data, ev.m_datasz);
+    }
+
+    if (m_state == state::e_established) {
+        m_wantHeader = true;
+        read<protocol::common_msg_std_header>();
+    }
+    s_messages.inc();
+    s_bytes.inc(ev.m_datasz);
+    return true;
+}
+
+bool theme::replay_client::pump()
+{
+    while (!m_queued.empty() && (m_state == state::e_cleartext || m_state == state::e_established)) {
+        const capture_event* ev = m_queued.front();
+        m_queued.pop_front();
+        if (!send_message(*ev)) {
+            s_errors.inc();
+            m_replayer.close(*this);
+            return false;
+        }
+    }
+
+    if (m_state != state::e_connecting)
+        handle_write();
+
+    if (m_closing && m_queued.empty() && !has_pending_write() && m_awaiting.empty()) {
+        m_replayer.close(*this);
+        return false;
+    }
+    return true;
+}
+
+// =================================================================================
+
+bool theme::replay_client::handle_message(theme::buffer_ptr_t& buf)
+{
+    switch (m_state) {
+    case state::e_handshaking:
+        return handle_encrypt(buf);
+    case state::e_established:
+        return handle_reply(buf);
+    default:
+        return false;
+    }
+}
+
+bool theme::replay_client::handle_encrypt(theme::buffer_ptr_t& buf)
+{
+    auto reply = (const protocol::common_encrypt_s2c*)buf.get();
+    if (reply->get_msgId() != e_s2c_encrypt || reply->get_bufsz() != sizeof(*reply)) {
+        s_log.error("{}: bad encryption reply {} ({} bytes)", m_socket.to_string(),
+                    reply->get_msgId(), reply->get_bufsz());
+        return false;
+    }
+
+    uint8_t key[sizeof(m_cliSeed)];
+    static_assert(sizeof(key) == sizeof(reply->m_srvSeed));
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = m_cliSeed[i] ^ reply->m_srvSeed[i];
+    set_crypt_key(sizeof(key), key);
+
+    auto elapsed = steady_clock::now() - m_start;
+    s_handshakeLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    s_handshakes.inc();
+    m_state = state::e_established;
+
+    m_wantHeader = true;
+    read<protocol::common_msg_std_header>();
+    return true;
+}
+
+bool theme::replay_client::handle_reply(theme::buffer_ptr_t& buf)
+{
+    auto header = (const protocol::common_msg_std_header*)buf.get();
+    if (m_wantHeader) {
+        const net_struct* ns;
+        switch (header->get_type()) {
+        case protocol::gatekeeper::e_pingReply:
+            ns = protocol::gatekeeper_pingReply::net_struct;
+            break;
+        case protocol::gatekeeper::e_fileSrvReply:
+            ns = protocol::gatekeeper_fileSrvReply::net_struct;
+            break;
+        case protocol::gatekeeper::e_authSrvReply:
+            ns = protocol::gatekeeper_authSrvReply::net_struct;
+            break;
+        default:
+            s_log.error("{}: unknown reply {x}", m_socket.to_string(), header->get_type());
+            return false;
+        }
+
+        m_wantHeader = false;
+        read(ns, 1, buf);
+        return true;
+    }
+
+    // Whatever the capture sent, each reply answers the oldest message still waiting for one.
+    if (!m_awaiting.empty()) {
+        auto elapsed = steady_clock::now() - m_awaiting.front();
+        s_replyLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        m_awaiting.pop_front();
+    }
+    s_replies.inc();
+
+    m_wantHeader = true;
+    read<protocol::common_msg_std_header>();
+    return true;
+}
+
+// =================================================================================
+
+void theme::replay_client::handle_events(int, uint32_t events)
+{
+    if (events & poll_dispatch::e_hup) {
+        m_polling = false;
+        if (m_state == state::e_connecting)
+            s_connectFailures.inc();
+        else if (!m_closing)
+            s_disconnects.inc();
+        m_replayer.close(*this);
+        return;
+    }
+
+    if (m_state == state::e_connecting) {
+        if (!(events & poll_dispatch::e_write))
+            return;
+
+        int error = m_socket.get_error();
+        if (error != 0) {
+            s_log.debug("{}: connect failed: {}", m_socket.to_string(), strerror(error));
+            s_connectFailures.inc();
+            m_replayer.close(*this);
+            return;
+        }
+        m_state = state::e_cleartext;
+    }
+
+    if ((events & poll_dispatch::e_read) && has_pending_read()) {
+        while (auto buf = handle_read()) {
+            if (!handle_message(buf)) {
+                s_errors.inc();
+                m_replayer.close(*this);
+                return;
+            }
+        }
+    }
+
+    if (pump())
+        refill_keystream();
+}
+
+// =================================================================================
+
+theme::replayer::replayer()
+    : m_poll(poll_dispatch::create())
+{ }
+
+void theme::replayer::apply(const capture_event& ev)
+{
+    if (ev.m_type == capture_file::e_open) {
+        s_connects.inc();
+        socket sock;
+        if (!sock.connect(FLAGS_host.c_str(), FLAGS_port)) {
+            s_connectFailures.inc();
+            return;
+        }
+        auto [handle, cli] = m_clients.emplace(*this, sock);
+        cli->m_handle = handle;
+        m_conns[ev.m_conn] = handle;
+        return;
+    }
+
+    // Anything for a connection that has already gone away is simply skipped.
+    auto it = m_conns.find(ev.m_conn);
+    if (it == m_conns.end())
+        return;
+    replay_client* cli = m_clients.get(it->second);
+    if (!cli) {
+        m_conns.erase(it);
+        return;
+    }
+
+    switch (ev.m_type) {
+    case capture_file::e_message:
+        cli->enqueue(ev);
+        break;
+    case capture_file::e_close:
+        m_conns.erase(it);
+        cli->capture_closed();
+        break;
+    default:
+        // We work out for ourselves when the session is encrypted.
+        break;
+    }
+}
+
+void theme::replayer::run(const std::vector<capture_event>& events)
+{
+    if (events.empty())
+        return;
+
+    auto start = steady_clock::now();
+    int64_t base = events.front().m_time;
+    auto due = [&](const capture_event& ev) {
+        if (FLAGS_speed <= 0.0)
+            return start;
+        auto offset = std::chrono::duration<double, std::micro>((ev.m_time - base) / FLAGS_speed);
+        return start + std::chrono::duration_cast<steady_clock::duration>(offset);
+    };
+
+    size_t next = 0;
+    steady_clock::time_point linger_end;
+    while (s_running.load(std::memory_order_relaxed)) {
+        auto now = steady_clock::now();
+        for (; next < events.size() && due(events[next]) <= now; ++next) {
+            auto lag = now - due(events[next]);
+            s_lag.record(std::chrono::duration_cast<std::chrono::microseconds>(lag).count());
+            apply(events[next]);
+        }
+
+        int timeout = 100;
+        if (next < events.size()) {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(due(events[next]) - now);
+            timeout = (int)std::clamp<int64_t>(wait.count(), 0, timeout);
+        } else if (m_clients.size() == 0) {
+            break;
+        } else if (linger_end == steady_clock::time_point()) {
+            linger_end = now + std::chrono::seconds(FLAGS_linger);
+        } else if (now >= linger_end) {
+            break;
+        }
+        m_poll->dispatch(timeout);
+    }
+    m_clients.clear();
+}
+
+// =================================================================================
+
+static bool load_capture(const char* path, std::vector<uint8_t>& file,
+                         std::vector<capture_event>& events)
+{
+    FILE* stream = fopen(path, "rb");
+    if (!stream) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    std::unique_ptr<FILE, int(*)(FILE*)> closer(stream, fclose);
+
+    char magic[sizeof(theme::capture_file::kMagic)];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, stream) != 1 ||
+        memcmp(magic, theme::capture_file::kMagic, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, stream) != 1) {
+        fprintf(stderr, "%s: not a ThemeSrv capture\n", path);
+        return false;
+    }
+    if (version != theme::capture_file::kVersion) {
+        fprintf(stderr, "%s: unsupported capture version %u\n", path, version);
+        return false;
+    }
+
+    // Captures are replayed straight out of memory so that reading them can't throw off the
+    // timing. The events point into the file, so it can't move once they are parsed.
+    for (uint8_t chunk[64 * 1024];;) {
+        size_t nread = fread(chunk, 1, sizeof(chunk), stream);
+        file.insert(file.end(), chunk, chunk + nread);
+        if (nread < sizeof(chunk))
+            break;
+    }
+
+    size_t pos = 0;
+    theme::capture_file::frame_header header;
+    while (file.size() - pos >= sizeof(header)) {
+        memcpy(&header, file.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        if (file.size() - pos < header.m_datasz) {
+            fprintf(stderr, "%s: truncated frame\n", path);
+            break;
+        }
+        if (header.m_type > theme::capture_file::e_close) {
+            fprintf(stderr, "%s: unknown frame type %u\n", path, header.m_type);
+            return false;
+        }
+
+        events.push_back({ (theme::capture_file::frame_type)header.m_type, header.m_conn,
+                           header.m_time, file.data() + pos, header.m_datasz });
+        pos += header.m_datasz;
+    }
+
+    // Messages are written out once the server is done with them, which can be a little after
+    // other connections' frames.
+    std::stable_sort(events.begin(), events.end(), [](const capture_event& lhs,
+                                                     const capture_event& rhs) {
+        return lhs.m_time < rhs.m_time;
+    });
+    return true;
+}
+
+static bool load_server_key(theme::crypto& crypt)
+{
+    theme::config_parser config(s_config);
+    if (!config.read(FLAGS_config_path.c_str())) {
+        fprintf(stderr, "%s: unable to read the configuration\n", FLAGS_config_path.c_str());
+        return false;
+    }
+
+    const ST::string& n = config.get<const ST::string&>("gate", "crypt_n");
+    const ST::string& x = config.get<const ST::string&>("gate", "crypt_x");
+    if (n.empty() || x.empty()) {
+        fprintf(stderr, "%s: no gate keys configured, run theme_daemon with --generate_keys\n",
+                FLAGS_config_path.c_str());
+        return false;
+    }
+
+    s_key.m_g = config.get<unsigned int>("gate", "crypt_g");
+    s_key.m_n = crypt.load_key(n);
+    s_key.m_x = crypt.load_key(x);
+    return true;
+}
+
+static void print_row(const char* name, const theme::latency_histogram& histogram)
+{
+    auto snap = histogram.take_snapshot();
+    printf("  %-10s %10llu %10llu %10llu %10llu %10llu\n", name, (unsigned long long)snap.m_count,
+           (unsigned long long)snap.percentile(0.5), (unsigned long long)snap.percentile(0.99),
+           (unsigned long long)snap.percentile(0.999), (unsigned long long)snap.max());
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    gflags::SetUsageMessage("Plays back a GateKeeper traffic capture");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    theme::log::set_level(theme::log::level::e_warning);
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s [flags] CAPTURE\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> file;
+    std::vector<capture_event> events;
+    if (!load_capture(argv[1], file, events))
+        return 1;
+
+    theme::crypto crypt;
+    s_crypto = &crypt;
+    if (!load_server_key(crypt))
+        return 1;
+
+    // Every captured connection might be open at once.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    auto stop = [](int) { s_running.store(false, std::memory_order_relaxed); };
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    auto start = steady_clock::now();
+    theme::replayer replay;
+    replay.run(events);
+    double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+    double span = events.empty() ? 0.0 : (events.back().m_time - events.front().m_time) / 1e6;
+
+    printf("replayed %llu connections, %llu messages (%llu bytes) in %.1fs, capture spans %.1fs\n",
+           (unsigned long long)s_connects.value(), (unsigned long long)s_messages.value(),
+           (unsigned long long)s_bytes.value(), seconds, span);
+    printf("connect failures %llu, handshakes %llu, disconnects %llu, errors %llu, replies %llu, "
+           "unanswered %llu\n",
+           (unsigned long long)s_connectFailures.value(), (unsigned long long)s_handshakes.value(),
+           (unsigned long long)s_disconnects.value(), (unsigned long long)s_errors.value(),
+           (unsigned long long)s_replies.value(), (unsigned long long)s_unanswered.value());
+    printf("  %-10s %10s %10s %10s %10s %10s\n", "", "count", "p50 us", "p99 us", "p999 us",
+           "max us");
+    print_row("reply", s_replyLatency);
+    print_row("handshake", s_handshakeLatency);
+    print_row("lag", s_lag);
+
+    BN_free(s_key.m_n);
+    BN_free(s_key.m_x);
+    return 0;
+}